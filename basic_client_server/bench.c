@@ -0,0 +1,380 @@
+/* bench.c
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A request/response benchmark for the server kept alive (server -k).  It
+ * opens CONNECTIONS connections and keeps DEPTH requests outstanding on
+ * each, sending a new request as each answer comes back, for SECONDS
+ * seconds after a short warm-up.  A depth of 1 is the classic ping-pong;
+ * deeper pipelines show how far batching requests on a connection goes.
+ *
+ * Each of a list of depths gets a run of its own, on fresh connections,
+ * and each run is reported as a line of JSON on stdout: answers per
+ * second, and the time from queueing each request to reading its answer
+ * in a latency histogram (see metrics.h).  Requests are SIZE bytes (16 by
+ * default, at most MAX_REQUEST_LEN), the last a newline.
+ *
+ * One thread serves every connection with epoll, so that the client is
+ * cheap next to the server it measures; run several to load a server on a
+ * machine with many cores.
+ *
+ * Usage: ./bench.exe [-c CONNECTIONS] [-p DEPTH[,DEPTH...]] [-d SECONDS]
+ *                    [-l SIZE] HOST_NAME PORT_NO
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+
+#define USAGE "usage: bench [-c CONNECTIONS] [-p DEPTH[,DEPTH...]] " \
+	"[-d SECONDS] [-l SIZE] HOST_NAME PORT_NO\n"
+
+/* most depths in one invocation, a histogram each, and the deepest
+ * pipeline */
+#define MAX_DEPTHS METRICS_MAX_HISTOGRAMS
+#define MAX_DEPTH 4096
+
+/* longest request; the server answers a longer one more than once */
+#define MAX_REQUEST_LEN 16384
+
+#define MAX_EVENTS 256
+
+/* how long connections run before they are measured */
+#define WARMUP_MS 500
+
+/* bytes read from a connection at a time */
+#define READ_LEN 16384
+
+enum counter {
+	REQUESTS_SENT,
+	ANSWERS,
+	NUM_COUNTERS
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+	"requests_sent", "answers"
+};
+
+/* a latency histogram per depth, since histograms are never reset */
+static const char *histogram_names[MAX_DEPTHS];
+
+struct connection {
+	int fd;
+	uint64_t *sent_at;				/* when each outstanding request was
+									 * queued, oldest at head */
+	int head;
+	int outstanding;
+	size_t unsent;					/* bytes queued but not yet written */
+	uint64_t written;				/* bytes written in all */
+};
+
+static int num_connections = 16;
+static int depths[MAX_DEPTHS] = {1, 4, 16, 64};
+static int num_depths = 4;
+static int duration = 3;
+static int request_len = 16;
+
+static struct sockaddr_in serv_addr;
+
+/* depth + 1 requests back to back, so that what is left of any write
+ * starts somewhere in the first */
+static char *requests;
+
+/* Opens a connection to the server; returns its descriptor, or -1 on
+ * failure */
+int open_connection(void)
+{
+	int fd, flags, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	if ((connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) ||
+		((flags = fcntl(fd, F_GETFL, 0)) < 0) ||
+		(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	/* Requests are small and are timed from when they are queued */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return fd;
+}
+
+/* Writes what the connection has queued; returns 0 if the server has gone
+ * and 1 otherwise */
+int write_requests(struct connection *conn)
+{
+	ssize_t n;
+
+	while (conn->unsent > 0) {
+		n = send(conn->fd, requests + conn->written % request_len,
+				 conn->unsent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+		conn->unsent -= n;
+		conn->written += n;
+	}
+
+	return 1;
+}
+
+/* Queues requests until depth are outstanding on the connection */
+void queue_requests(struct connection *conn, int depth, uint64_t now)
+{
+	int count = depth - conn->outstanding, i;
+
+	for (i = 0; i < count; i++) {
+		conn->sent_at[(conn->head + conn->outstanding + i) % depth] = now;
+	}
+
+	conn->outstanding += count;
+	conn->unsent += (size_t)count * request_len;
+	metrics_add(REQUESTS_SENT, count);
+}
+
+/* Reads the answers that have come back on the connection, timing each
+ * while measuring; returns 0 if the server has gone and 1 otherwise */
+int read_answers(struct connection *conn, int depth, int histogram,
+				 int measuring, uint64_t now)
+{
+	char buffer[READ_LEN], *p, *end;
+	ssize_t n;
+
+	while (1) {
+		n = read(conn->fd, buffer, sizeof(buffer));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+		if (n == 0) {
+			return 0;
+		}
+
+		/* Answers come back in order, one line each */
+		for (p = buffer, end = buffer + n;
+			 (p = memchr(p, '\n', end - p)) != NULL; p++) {
+			if (conn->outstanding == 0) {
+				printf("read_answers: more answers than requests\n");
+				return 0;
+			}
+			if (measuring) {
+				metrics_record(histogram, now - conn->sent_at[conn->head]);
+				metrics_add(ANSWERS, 1);
+			}
+			conn->head = (conn->head + 1) % depth;
+			conn->outstanding--;
+		}
+	}
+}
+
+/* Runs connections at depth for the warm-up and then duration, and prints
+ * the results as one line of JSON */
+void run_depth(int depth, int histogram)
+{
+	struct epoll_event events[MAX_EVENTS], event;
+	struct connection *connections, *conn;
+	struct metrics_histogram *h;
+	uint64_t now, start, stop, answers;
+	int epoll_fd, i, n, measuring = 0;
+
+	connections = calloc(num_connections, sizeof(struct connection));
+	if ((connections == NULL) || ((epoll_fd = epoll_create1(0)) < 0) ||
+		((h = malloc(sizeof(struct metrics_histogram))) == NULL)) {
+		printf("run_depth: cannot allocate connections\n");
+		exit(1);
+	}
+
+	now = metrics_now();
+	for (i = 0; i < num_connections; i++) {
+		conn = &connections[i];
+		if (((conn->fd = open_connection()) < 0) ||
+			((conn->sent_at = malloc(depth * sizeof(uint64_t))) == NULL)) {
+			printf("run_depth: cannot connect to the server\n");
+			exit(1);
+		}
+
+		/* Both ways are waited on for as long as the run lasts, so that a
+		 * write left unfinished is finished as soon as it can be */
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+			printf("run_depth: cannot wait on a connection\n");
+			exit(1);
+		}
+
+		queue_requests(conn, depth, now);
+	}
+
+	start = now + WARMUP_MS * 1000000ULL;
+	stop = start + duration * 1000000000ULL;
+	answers = metrics_counter(ANSWERS);
+
+	while ((now = metrics_now()) < stop) {
+		if (!measuring && (now >= start)) {
+			measuring = 1;
+			start = now;
+		}
+
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, 100)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("run_depth: epoll_wait failed\n");
+			exit(1);
+		}
+
+		now = metrics_now();
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+
+			if (!read_answers(conn, depth, histogram, measuring, now)) {
+				printf("run_depth: the server closed a connection\n");
+				exit(1);
+			}
+
+			queue_requests(conn, depth, now);
+			if (!write_requests(conn)) {
+				printf("run_depth: cannot write to the server\n");
+				exit(1);
+			}
+		}
+	}
+
+	for (i = 0; i < num_connections; i++) {
+		close(connections[i].fd);
+		free(connections[i].sent_at);
+	}
+	close(epoll_fd);
+	free(connections);
+
+	answers = metrics_counter(ANSWERS) - answers;
+	metrics_histogram(histogram, h);
+
+	printf("{\"connections\":%d,\"depth\":%d,\"size\":%d,\"duration_s\":%.3f,"
+		   "\"answers\":%llu,\"requests_per_s\":%.1f,"
+		   "\"latency_ns\":{\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,"
+		   "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+		   num_connections, depth, request_len, (now - start) / 1e9,
+		   (unsigned long long)answers, answers / ((now - start) / 1e9),
+		   (unsigned long long)((h->count > 0) ? h->sum / h->count : 0),
+		   (unsigned long long)metrics_percentile(h, 0.5),
+		   (unsigned long long)metrics_percentile(h, 0.9),
+		   (unsigned long long)metrics_percentile(h, 0.99),
+		   (unsigned long long)metrics_percentile(h, 0.999),
+		   (unsigned long long)h->max);
+	fflush(stdout);
+
+	free(h);
+}
+
+/* Reads a comma-separated list of depths into depths; returns 0 if one is
+ * out of range and 1 otherwise */
+int parse_depths(char *list)
+{
+	char *depth;
+
+	num_depths = 0;
+	for (depth = strtok(list, ","); depth != NULL; depth = strtok(NULL, ",")) {
+		if ((num_depths == MAX_DEPTHS) || (atoi(depth) <= 0) ||
+			(atoi(depth) > MAX_DEPTH)) {
+			return 0;
+		}
+		depths[num_depths++] = atoi(depth);
+	}
+
+	return (num_depths > 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hostent *server;
+	int i, opt, deepest = 0;
+
+	while ((opt = getopt(argc, argv, "c:p:d:l:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_connections = atoi(optarg);
+			break;
+		case 'p':
+			if (!parse_depths(optarg)) {
+				printf("main: depths are 1 to %d, at most %d of them\n",
+					   MAX_DEPTH, MAX_DEPTHS);
+				exit(1);
+			}
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'l':
+			request_len = atoi(optarg);
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+
+	if ((argc - optind < 2) || (num_connections <= 0) || (duration <= 0) ||
+		(request_len <= 0) || (request_len > MAX_REQUEST_LEN)) {
+		printf(USAGE);
+		exit(1);
+	}
+
+	if ((server = gethostbyname(argv[optind])) == NULL) {
+		printf("main: host going by name: %s does not exist\n", argv[optind]);
+		exit(1);
+	}
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+	serv_addr.sin_port = htons(atoi(argv[optind + 1]));
+
+	/* Every request is the same: filler and a newline */
+	for (i = 0; i < num_depths; i++) {
+		if (depths[i] > deepest) {
+			deepest = depths[i];
+		}
+	}
+	if ((requests = malloc((size_t)(deepest + 1) * request_len)) == NULL) {
+		printf("main: cannot allocate requests\n");
+		exit(1);
+	}
+	memset(requests, 'r', (size_t)(deepest + 1) * request_len);
+	for (i = 1; i <= deepest + 1; i++) {
+		requests[i * request_len - 1] = '\n';
+	}
+
+	for (i = 0; i < num_depths; i++) {
+		histogram_names[i] = "latency";
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	metrics_init(counter_names, NUM_COUNTERS, histogram_names, num_depths);
+
+	for (i = 0; i < num_depths; i++) {
+		run_depth(depths[i], i);
+	}
+
+	return 0;
+}
@@ -9,29 +9,260 @@
  * from the client; the server then writes a message to the client as 
  * confirmation and proceeds to exit.
  * 
- * Usage: ./server.exe PORT_NO SERVER_NAME
+ * Given -k, the server instead runs until it is killed and keeps every
+ * connection open until the client closes it.  Each line a client sends is
+ * a request, answered with the line "Message received", and a client may
+ * send many requests without waiting for their answers; answers go back in
+ * the order the requests came.  One thread serves every connection with
+ * epoll.  A connection's requests are answered as far as its buffer of
+ * answers has room, and the rest are only read once the client has taken
+ * what was written, so a client that does not read its answers holds up
+ * only itself.  This is the baseline for request/response latency and
+ * throughput; see bench.c.
+ * 
+ * Usage: ./server.exe [-k] PORT_NO SERVER_NAME
  * 
  * */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
 #define BUFFER_LEN 256
 #define MESSAGE_LEN (BUFFER_LEN - 1)
 
+/* bytes of requests and of answers each connection buffers when kept
+ * alive; a request longer than its buffer is answered once */
+#define REQUEST_BUFFER_LEN 16384
+#define ANSWER_BUFFER_LEN 16384
+
+#define ANSWER "Message received\n"
+#define ANSWER_LEN (sizeof(ANSWER) - 1)
+
+#define MAX_EVENTS 64
+#define BACKLOG 128
+
+#define USAGE "usage: server [-k] PORT_NO SERVER_NAME\n"
+
+/* A connection kept alive: requests read but not yet answered, and answers
+ * not yet written */
+struct connection {
+	int fd;
+	unsigned int events;			/* what epoll waits for */
+	size_t in_len;
+	size_t out_len;
+	size_t out_sent;
+	char in[REQUEST_BUFFER_LEN];
+	char out[ANSWER_BUFFER_LEN];
+};
+
+/* Answers the whole requests in the connection's buffer, as many as there
+ * is room to answer, and keeps the rest for later */
+void answer_requests(struct connection *conn)
+{
+	char *start = conn->in, *end = conn->in + conn->in_len, *line;
+
+	while ((conn->out_len + ANSWER_LEN <= ANSWER_BUFFER_LEN) && (start < end)) {
+		if ((line = memchr(start, '\n', end - start)) != NULL) {
+			start = line + 1;
+		} else if ((start == conn->in) && (conn->in_len == REQUEST_BUFFER_LEN)) {
+			/* A request filling the buffer is answered, and the rest of it
+			 * taken as another */
+			start = end;
+		} else {
+			break;
+		}
+
+		memcpy(conn->out + conn->out_len, ANSWER, ANSWER_LEN);
+		conn->out_len += ANSWER_LEN;
+	}
+
+	conn->in_len = end - start;
+	memmove(conn->in, start, conn->in_len);
+}
+
+/* Writes what the connection has to write; returns -1 if the client has
+ * gone and 0 otherwise */
+int write_answers(struct connection *conn)
+{
+	ssize_t n;
+
+	while (conn->out_sent < conn->out_len) {
+		/* A client that has gone gets an error rather than SIGPIPE */
+		n = send(conn->fd, conn->out + conn->out_sent,
+				 conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+		}
+		conn->out_sent += n;
+	}
+
+	conn->out_len = conn->out_sent = 0;
+
+	return 0;
+}
+
+/* Reads and answers requests until the connection would block, either
+ * because the client has sent nothing more or because it has not taken
+ * its answers; then waits on whichever it was.  Returns -1 if the client
+ * has gone and 0 otherwise */
+int serve_connection(int epoll_fd, struct connection *conn)
+{
+	struct epoll_event event;
+	ssize_t n;
+
+	while (1) {
+		answer_requests(conn);
+
+		if (write_answers(conn) < 0) {
+			return -1;
+		}
+
+		/* Read no more until the client takes what it was sent */
+		if (conn->out_len > 0) {
+			break;
+		}
+
+		/* Requests held back for want of room are answered first */
+		if ((conn->in_len > 0) &&
+			((memchr(conn->in, '\n', conn->in_len) != NULL) ||
+			 (conn->in_len == REQUEST_BUFFER_LEN))) {
+			continue;
+		}
+
+		n = read(conn->fd, conn->in + conn->in_len,
+				 REQUEST_BUFFER_LEN - conn->in_len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		conn->in_len += n;
+	}
+
+	event.events = (conn->out_len > 0) ? EPOLLOUT : EPOLLIN;
+	event.data.ptr = conn;
+	if ((event.events != conn->events) &&
+		(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0)) {
+		return -1;
+	}
+	conn->events = event.events;
+
+	return 0;
+}
+
+/* Accepts every connection waiting on sockfd and waits on it for requests */
+void accept_connections(int epoll_fd, int sockfd)
+{
+	struct connection *conn;
+	struct epoll_event event;
+	int cli_sockfd, flags, one = 1;
+
+	while ((cli_sockfd = accept(sockfd, NULL, NULL)) >= 0) {
+		/* Answers are small and should not wait for more to join them */
+		setsockopt(cli_sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (((flags = fcntl(cli_sockfd, F_GETFL, 0)) < 0) ||
+			(fcntl(cli_sockfd, F_SETFL, flags | O_NONBLOCK) < 0) ||
+			((conn = malloc(sizeof(struct connection))) == NULL)) {
+			printf("accept_connections: cannot set up a connection\n");
+			close(cli_sockfd);
+			continue;
+		}
+
+		conn->fd = cli_sockfd;
+		conn->events = EPOLLIN;
+		conn->in_len = conn->out_len = conn->out_sent = 0;
+
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cli_sockfd, &event) < 0) {
+			printf("accept_connections: cannot wait on a connection\n");
+			close(cli_sockfd);
+			free(conn);
+		}
+	}
+}
+
+/* Serves connections on sockfd, kept alive, until the server is killed */
+void serve_forever(int sockfd)
+{
+	struct epoll_event events[MAX_EVENTS], event;
+	struct connection *conn;
+	int epoll_fd, flags, i, n;
+
+	/* The listening socket is told apart from connections by a NULL
+	 * pointer, and never blocks the loop when a client gives up */
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (((flags = fcntl(sockfd, F_GETFL, 0)) < 0) ||
+		(fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) ||
+		((epoll_fd = epoll_create1(0)) < 0) ||
+		(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event) < 0)) {
+		printf("serve_forever: cannot wait on the listening socket\n");
+		exit(1);
+	}
+
+	while (1) {
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("serve_forever: epoll_wait failed\n");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((conn = events[i].data.ptr) == NULL) {
+				accept_connections(epoll_fd, sockfd);
+			} else if (serve_connection(epoll_fd, conn) < 0) {
+				/* Closing the socket also takes it out of the epoll set */
+				close(conn->fd);
+				free(conn);
+			}
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int sockfd, cli_sockfd, port_number, cli_len;
     char buffer[BUFFER_LEN];
     struct sockaddr_in serv_addr, cli_addr;
-    int n;
+    int n, opt, keep_alive = 0;
     
+	while ((opt = getopt(argc, argv, "k")) != -1) {
+		switch (opt) {
+		case 'k':
+			keep_alive = 1;
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+	
 	/* Check that both a name and a port number are provided */
-	if (argc < 3) {
+	if (argc - optind < 2) {
 		printf("main: server requires both name and port number.\n");
+		printf(USAGE);
 		exit(1);
 	}
 	
@@ -45,7 +276,7 @@ int main(int argc, char *argv[])
 	bzero((char *) &serv_addr, sizeof(serv_addr));
 	
 	/* Get the port number from the argument provided */
-	port_number = atoi(argv[1]);
+	port_number = atoi(argv[optind]);
 	
 	/* Initialize serv_addr values; set in_adrr to accept connections to all
 	 * IPs via INADDR_ANY */
@@ -59,6 +290,13 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+	/* Kept alive, the server takes any number of clients, and bursts of
+	 * them */
+	if (keep_alive) {
+		listen(sockfd, BACKLOG);
+		serve_forever(sockfd);
+	}
+	
 	/* Listen for a client connecting to socket */
 	listen(sockfd, 5);
 	cli_len = sizeof(cli_addr);
@@ -0,0 +1,446 @@
+/* bench.c
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Microbenchmarks for the server's hot paths, run without a network: the
+ * client registry (see registry.h) at 10, 1k and 100k clients, building a
+ * broadcast and queueing and writing it to every member of a room (see
+ * message.h), and the frame parser (see protocol.h) fed from memory and
+ * from a socketpair.  Writes go to /dev/null.
+ *
+ * Each benchmark runs for doubling numbers of operations until a run takes
+ * at least MIN_TIME_MS, then prints the time and the number of allocations
+ * per operation of that run.  Allocations are counted by routing the
+ * headers' calls to malloc and friends through counting wrappers.
+ *
+ * Usage: ./bench.exe [-t MIN_TIME_MS] [FILTER]
+ *
+ * Only benchmarks whose names contain FILTER are run.
+ *
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define USAGE "usage: bench [-t MIN_TIME_MS] [FILTER]\n"
+
+/* default shortest run that counts as a measurement */
+#define MIN_TIME_MS 200
+
+/* bytes offered to each read into a parser, as a socket might deliver */
+#define CHUNK_LEN 4096
+
+/* frames in a synthetic stream */
+#define STREAM_FRAMES 4096
+
+static unsigned long allocations = 0;
+
+static inline void *counted_malloc(size_t size)
+{
+	allocations++;
+	return malloc(size);
+}
+
+static inline void *counted_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return calloc(count, size);
+}
+
+static inline void *counted_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return realloc(ptr, size);
+}
+
+static inline void *counted_aligned_alloc(size_t alignment, size_t size)
+{
+	allocations++;
+	return aligned_alloc(alignment, size);
+}
+
+/* Every allocation made by the headers below is counted */
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(ptr, size) counted_realloc(ptr, size)
+#define aligned_alloc(alignment, size) counted_aligned_alloc(alignment, size)
+
+#include "protocol.h"
+#include "registry.h"
+#include "message.h"
+
+struct benchmark {
+	const char *name;
+	void *(*setup)(long arg);
+	void (*run)(void *state, long ops);
+	void (*teardown)(void *state);
+	long arg;
+};
+
+static int null_fd;
+
+/* Returns a pseudo-random number, cheaply and the same on every run */
+static inline uint32_t next_random(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/* Returns the time in nanoseconds */
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* A registry holding size clients, under descriptors 0 to size - 1 */
+struct registry_state {
+	struct client_table table;
+	long size;
+	uint32_t seed;
+};
+
+void *registry_setup(long size)
+{
+	struct registry_state *state = malloc(sizeof(struct registry_state));
+	long i;
+
+	if ((state == NULL) || !client_table_init(&state->table, 0)) {
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		client_table_add(&state->table, i, (void *)(uintptr_t)(i + 1));
+	}
+	state->size = size;
+	state->seed = 2463534242u;
+
+	return state;
+}
+
+void registry_teardown(void *arg)
+{
+	struct registry_state *state = arg;
+
+	client_table_destroy(&state->table);
+	free(state);
+}
+
+/* One client leaves and another takes its descriptor, as happens when
+ * clients come and go */
+void registry_churn(void *arg, long ops)
+{
+	struct registry_state *state = arg;
+	void *client;
+	int fd;
+
+	while (ops-- > 0) {
+		fd = next_random(&state->seed) % state->size;
+		client = client_table_remove(&state->table, fd);
+		client_table_add(&state->table, fd, client);
+	}
+}
+
+/* Finds the client behind a descriptor, as every event does */
+void registry_lookup(void *arg, long ops)
+{
+	struct registry_state *state = arg;
+	uintptr_t sum = 0;
+	int fd;
+
+	while (ops-- > 0) {
+		fd = next_random(&state->seed) % state->size;
+		sum += (uintptr_t)client_table_lookup(&state->table, fd);
+	}
+
+	if (sum == 0) {
+		printf("registry_lookup: no clients found\n");
+	}
+}
+
+/* The outbound queues of a room of members */
+struct broadcast_state {
+	struct outq *queues;
+	long members;
+	char text[64];
+};
+
+/* Builds a chat message once, queues it for every member and writes every
+ * member's queue, as write_to_clients and deliver_to_shard do */
+void broadcast_run(void *arg, long ops)
+{
+	struct broadcast_state *state = arg;
+	struct message *msg;
+	long i;
+
+	while (ops-- > 0) {
+		if ((msg = message_new("sender", state->text, sizeof(state->text),
+							   0)) == NULL) {
+			printf("broadcast_run: cannot build message\n");
+			exit(1);
+		}
+
+		for (i = 0; i < state->members; i++) {
+			outq_push(&state->queues[i], message_hold(msg));
+			outq_flush(&state->queues[i], null_fd);
+		}
+
+		message_release(msg);
+	}
+}
+
+void *broadcast_setup(long members)
+{
+	struct broadcast_state *state = malloc(sizeof(struct broadcast_state));
+	long i;
+
+	if ((state == NULL) ||
+		((state->queues = malloc(members * sizeof(struct outq))) == NULL)) {
+		return NULL;
+	}
+
+	for (i = 0; i < members; i++) {
+		outq_init(&state->queues[i]);
+	}
+	state->members = members;
+	memset(state->text, 'x', sizeof(state->text));
+
+	/* Give every queue its ring, as members that have been sent to before
+	 * have */
+	broadcast_run(state, 1);
+
+	return state;
+}
+
+void broadcast_teardown(void *arg)
+{
+	struct broadcast_state *state = arg;
+	long i;
+
+	for (i = 0; i < state->members; i++) {
+		outq_clear(&state->queues[i]);
+	}
+	free(state->queues);
+	free(state);
+}
+
+/* A stream of frames with payloads of a given size */
+struct parser_state {
+	char *stream;
+	size_t len;
+	struct frame_parser parser;
+	int fds[2];					/* socketpair the stream is written to */
+};
+
+void *parser_setup(long payload_len)
+{
+	struct parser_state *state = malloc(sizeof(struct parser_state));
+	char *p;
+	long i;
+
+	if (state == NULL) {
+		return NULL;
+	}
+
+	state->len = STREAM_FRAMES * (FRAME_HEADER_LEN + payload_len);
+	if ((state->stream = malloc(state->len)) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0, p = state->stream; i < STREAM_FRAMES; i++) {
+		frame_header_encode(p, FRAME_MSG, payload_len);
+		memset(p + FRAME_HEADER_LEN, 'x', payload_len);
+		p += FRAME_HEADER_LEN + payload_len;
+	}
+
+	frame_parser_init(&state->parser);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, state->fds) < 0) {
+		return NULL;
+	}
+
+	return state;
+}
+
+void parser_teardown(void *arg)
+{
+	struct parser_state *state = arg;
+
+	frame_parser_destroy(&state->parser);
+	close(state->fds[0]);
+	close(state->fds[1]);
+	free(state->stream);
+	free(state);
+}
+
+/* Handles every complete frame in the parser; returns how many there were */
+static long parse_frames(struct frame_parser *parser)
+{
+	struct frame frame;
+	long frames = 0;
+
+	while (frame_parser_next(parser, &frame) > 0) {
+		frames++;
+	}
+
+	return frames;
+}
+
+/* Parses frames from the stream handed over in CHUNK_LEN pieces, which
+ * split frames wherever they fall, as reads from a socket do */
+void parser_memory(void *arg, long ops)
+{
+	struct parser_state *state = arg;
+	size_t offset = 0, space_len, len;
+	char *space;
+
+	while (ops > 0) {
+		if ((space = frame_parser_space(&state->parser, &space_len)) == NULL) {
+			printf("parser_memory: cannot grow input buffer\n");
+			exit(1);
+		}
+
+		len = state->len - offset;
+		if (len > CHUNK_LEN) {
+			len = CHUNK_LEN;
+		}
+		if (len > space_len) {
+			len = space_len;
+		}
+
+		memcpy(space, state->stream + offset, len);
+		frame_parser_commit(&state->parser, len);
+		offset = (offset + len) % state->len;
+
+		ops -= parse_frames(&state->parser);
+	}
+}
+
+/* Parses frames written through a socketpair and read back, a chunk at a
+ * time, to include the system calls every read costs */
+void parser_socket(void *arg, long ops)
+{
+	struct parser_state *state = arg;
+	size_t offset = 0, space_len, len;
+	ssize_t n;
+	char *space;
+
+	while (ops > 0) {
+		len = state->len - offset;
+		if (len > CHUNK_LEN) {
+			len = CHUNK_LEN;
+		}
+
+		if (write(state->fds[0], state->stream + offset, len) != (ssize_t)len) {
+			printf("parser_socket: write failed\n");
+			exit(1);
+		}
+		offset = (offset + len) % state->len;
+
+		if ((space = frame_parser_space(&state->parser, &space_len)) == NULL) {
+			printf("parser_socket: cannot grow input buffer\n");
+			exit(1);
+		}
+
+		if ((n = read(state->fds[1], space, space_len)) <= 0) {
+			printf("parser_socket: read failed\n");
+			exit(1);
+		}
+		frame_parser_commit(&state->parser, n);
+
+		ops -= parse_frames(&state->parser);
+	}
+}
+
+static const struct benchmark benchmarks[] = {
+	{"registry/churn/10", registry_setup, registry_churn, registry_teardown, 10},
+	{"registry/churn/1k", registry_setup, registry_churn, registry_teardown, 1000},
+	{"registry/churn/100k", registry_setup, registry_churn, registry_teardown, 100000},
+	{"registry/lookup/10", registry_setup, registry_lookup, registry_teardown, 10},
+	{"registry/lookup/1k", registry_setup, registry_lookup, registry_teardown, 1000},
+	{"registry/lookup/100k", registry_setup, registry_lookup, registry_teardown, 100000},
+	{"broadcast/10", broadcast_setup, broadcast_run, broadcast_teardown, 10},
+	{"broadcast/1k", broadcast_setup, broadcast_run, broadcast_teardown, 1000},
+	{"parser/memory/32", parser_setup, parser_memory, parser_teardown, 32},
+	{"parser/memory/1k", parser_setup, parser_memory, parser_teardown, 1024},
+	{"parser/socket/32", parser_setup, parser_socket, parser_teardown, 32},
+	{"parser/socket/1k", parser_setup, parser_socket, parser_teardown, 1024}
+};
+
+/* Runs the benchmark for doubling numbers of operations until a run lasts
+ * min_time_ms, then prints that run's cost per operation */
+void run_benchmark(const struct benchmark *b, long min_time_ms)
+{
+	uint64_t start, elapsed;
+	unsigned long allocated;
+	void *state;
+	long ops = 1;
+
+	while (1) {
+		if ((state = b->setup(b->arg)) == NULL) {
+			printf("run_benchmark: cannot set up %s\n", b->name);
+			exit(1);
+		}
+
+		allocated = allocations;
+		start = now_ns();
+		b->run(state, ops);
+		elapsed = now_ns() - start;
+		allocated = allocations - allocated;
+
+		b->teardown(state);
+
+		if ((elapsed >= (uint64_t)min_time_ms * 1000000) || (ops >= (1L << 40))) {
+			break;
+		}
+		ops *= 2;
+	}
+
+	printf("%-24s %12ld ops %12.1f ns/op %8.3f allocs/op\n", b->name, ops,
+		   (double)elapsed / ops, (double)allocated / ops);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = "";
+	long min_time_ms = MIN_TIME_MS;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time_ms = atol(optarg);
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	if ((null_fd = open("/dev/null", O_WRONLY)) < 0) {
+		printf("main: cannot open /dev/null\n");
+		exit(1);
+	}
+
+	for (i = 0; i < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); i++) {
+		if (strstr(benchmarks[i].name, filter) != NULL) {
+			run_benchmark(&benchmarks[i], min_time_ms);
+		}
+	}
+
+	return 0;
+}
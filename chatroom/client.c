@@ -1,182 +1,814 @@
 /* client.c
  * Author: Dickson Wong
  * Date: Jan 1, 2018
- * 
+ *
  * A simple client that simply connects to a server and continues to write
- * messages to it until disconnection.
- * 
- * Usage: ./client.exe PORT_NO HOST_NAME
- * 
+ * messages to it until disconnection.  Messages travel in the frames
+ * described in protocol.h; entering .DISCONNECT leaves the chatroom,
+ * /join ROOM moves to another room and /leave returns to the lobby.
+ *
+ * One poll loop serves the keyboard, the server and the terminal, none of
+ * them with a blocking call.  Frames from the server are read as fast as
+ * they arrive and rendered into a buffer that goes to the terminal in as
+ * few writes as it takes, so a slow terminal does not leave the server
+ * waiting on a full socket.  If the terminal falls more than OUTPUT_LIMIT
+ * bytes behind, further messages are counted instead of shown; the client
+ * says how far behind it is every REPORT_MS while it is, and how many
+ * messages it skipped once it has caught up.
+ *
+ * Given -f, the client replays the messages in FILE (or on its standard
+ * input, for "-") instead of reading the keyboard, as fast as the server
+ * takes them or, with -P, at the pace they were recorded.  Each line of FILE
+ * is sent as the user would have typed it, after an optional timestamp in
+ * seconds and a tab; lines are packed into frames many to a write, and what
+ * the server sends back is counted rather than shown.  Once the file is sent
+ * the client prints a line of JSON with what it sent and how fast.
+ *
+ * Usage: ./client.exe [-f FILE] [-P] [-u NAME] PORT_NO HOST_NAME
+ *
  * */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h> 
+#include <netdb.h>
 #include <unistd.h>
-#include <pthread.h>
 
-#define BUFFER_LEN 256
-#define MESSAGE_LEN (BUFFER_LEN - 1)
+#include "protocol.h"
 
 #define CLI_NAME_BUFFER_LEN 30
 #define CLI_NAME_LEN (CLI_NAME_BUFFER_LEN - 1)
 
-/* Clears the buffer */
-void clear_buffer(char *buffer) 
+/* message the user enters to leave the chatroom */
+#define EXIT_MESSAGE ".DISCONNECT"
+
+/* commands the user enters to change rooms */
+#define JOIN_COMMAND "/join "
+#define LEAVE_COMMAND "/leave"
+
+/* most bytes of rendered output kept for a terminal that falls behind */
+#define OUTPUT_LIMIT (4 << 20)
+
+/* how often to say how far behind the terminal is */
+#define REPORT_MS 1000
+
+/* most bytes read from the server before the other descriptors get a turn */
+#define READ_BUDGET (1 << 20)
+
+/* most bytes of a replayed file read ahead, and of frames queued for the
+ * server, before waiting on the server */
+#define REPLAY_BACKLOG (1 << 20)
+
+/* name used when replaying unless -u gives one */
+#define REPLAY_NAME "replay"
+
+#define USAGE "usage: client [-f FILE] [-P] [-u NAME] PORT_NO HOSTNAME\n"
+
+/* A growable buffer of bytes, written out from its front */
+struct buffer {
+	char *data;
+	size_t len;						/* bytes held */
+	size_t cap;
+	size_t sent;					/* bytes at the front already written */
+	unsigned long writes;			/* successful writes, ever */
+	unsigned long long written;		/* bytes written, ever */
+};
+
+/* A file of recorded messages being replayed */
+struct replay {
+	int fd;
+	int paced;						/* keep to the recorded timestamps */
+	int ended;						/* the whole file has been read */
+	int stamped;					/* first_stamp has been seen */
+	double first_stamp;				/* timestamp of the first stamped line */
+	long long start;				/* when the replay began, in microseconds */
+	unsigned long lines;			/* lines sent */
+};
+
+/* bytes on their way to the server, to the terminal, and typed by the user
+ * but not yet making up a whole line */
+static struct buffer to_server, to_terminal, from_user;
+
+/* messages received but not shown since the terminal was too far behind */
+static unsigned long skipped = 0;
+
+/* set when the user interrupts the client */
+static volatile sig_atomic_t interrupted = 0;
+
+/* set while replaying, when messages from the server are only counted */
+static int replaying = 0;
+static unsigned long received = 0;
+
+/* descriptor flags to put back on exit */
+static int stdin_flags = -1, stdout_flags = -1;
+
+/* Appends len bytes at data; returns 0 on failure and 1 on success */
+int buffer_append(struct buffer *b, const char *data, size_t len)
+{
+	size_t cap;
+	char *grown;
+
+	if (len == 0) {
+		return 1;
+	}
+
+	/* Reclaim what has been written before growing */
+	if ((b->sent > 0) && (b->len + len > b->cap)) {
+		memmove(b->data, b->data + b->sent, b->len - b->sent);
+		b->len -= b->sent;
+		b->sent = 0;
+	}
+
+	if (b->len + len > b->cap) {
+		for (cap = (b->cap > 0) ? b->cap : 4096; cap < b->len + len; cap *= 2) {
+		}
+		if ((grown = realloc(b->data, cap)) == NULL) {
+			return 0;
+		}
+		b->data = grown;
+		b->cap = cap;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+	return 1;
+}
+
+/* Returns the number of bytes waiting to be written */
+size_t buffer_pending(const struct buffer *b)
 {
-	bzero((char *) buffer, BUFFER_LEN);
+	return b->len - b->sent;
 }
 
-/* Reads and removes non-EOF characters (including newline) in stdin.
-int clear_input() {
-	char buffer[BUFFER_LEN]; 
-	
-	while (fgets(buffer, BUFFER_LEN, stdin) != NULL) {
-		fgets(buffer, BUFFER_LEN, stdin);
+/* Writes as much of the buffer to fd as it takes without blocking; returns
+ * 1 once the buffer is empty, 0 if fd is full and -1 if the write failed */
+int buffer_flush(struct buffer *b, int fd)
+{
+	ssize_t n;
+
+	while (b->sent < b->len) {
+		if ((n = write(fd, b->data + b->sent, b->len - b->sent)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+		}
+		b->sent += n;
+		b->writes++;
+		b->written += n;
 	}
+
+	b->len = b->sent = 0;
+
+	return 1;
 }
-*/
 
-/* Gets a name from the user and stores it in cli_name */
-void get_username(char *cli_name) {
-	
-	int n;
-	
-	if (cli_name) {
-		/* Prompt client to enter a name */
-		printf("Please enter a name: ");
-		
-		/* Get a name from the user */
-		bzero((char *) cli_name, CLI_NAME_BUFFER_LEN);
-		fgets(cli_name, CLI_NAME_BUFFER_LEN, stdin);
-		
-		/* Remove the newline character in name */
-		if ((n = strcspn(cli_name, "\n")) < CLI_NAME_BUFFER_LEN) {
-			cli_name[n] = '\0';
-		}
-		
-		/* Removes any extra characters from stdin */
-		clear_input();
-	}
-}
-	
-void *handle_server(void *args) {
-	char buffer[BUFFER_LEN];
-	clear_buffer(buffer);
-	
-	int sockfd = *((int *)args);
+/* Queues a frame for the server; returns 0 on failure and 1 on success */
+int send_frame(uint8_t type, const char *payload, uint32_t len)
+{
+	char header[FRAME_HEADER_LEN];
+
+	frame_header_encode(header, type, len);
+
+	return buffer_append(&to_server, header, FRAME_HEADER_LEN) &&
+		buffer_append(&to_server, payload, len);
+}
+
+/* Queues a line of text for the terminal, unless it is too far behind */
+void render(const char *text, size_t len)
+{
+	if (buffer_pending(&to_terminal) + len + 1 > OUTPUT_LIMIT) {
+		skipped++;
+		return;
+	}
+
+	buffer_append(&to_terminal, text, len);
+	buffer_append(&to_terminal, "\n", 1);
+}
+
+/* Queues a line of text for the terminal, formatted as by printf */
+void render_format(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+
+void render_format(const char *format, ...)
+{
+	char line[256];
+	va_list args;
 	int n;
-	int connected = 1;
-	
-	/* Read messages coming in from the server while we are still connected */
-	while (connected) {
-		n = read(sockfd, buffer, MESSAGE_LEN);
-		
-		/* Return when the server has disconnected */
-		if (n <= 0) {
-			connected = 0;
+
+	va_start(args, format);
+	n = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (n > 0) {
+		render(line, ((size_t)n < sizeof(line)) ? (size_t)n : sizeof(line) - 1);
+	}
+}
+
+/* Returns the time in microseconds */
+long long now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/* Says how far behind the terminal is while it is, and what was skipped
+ * once it has caught up; at most once every REPORT_MS */
+void report_lag(void)
+{
+	static long long last_report = 0;
+	size_t pending = buffer_pending(&to_terminal);
+	long long now = now_us() / 1000;
+
+	if (now - last_report < REPORT_MS) {
+		return;
+	}
+
+	if (pending > OUTPUT_LIMIT / 4) {
+		render_format("[terminal is %zu KB behind; %lu messages skipped]",
+					  pending / 1024, skipped);
+		last_report = now;
+	} else if ((skipped > 0) && (pending == 0)) {
+		render_format("[caught up; %lu messages were skipped]", skipped);
+		skipped = 0;
+		last_report = now;
+	}
+}
+
+/* Acts on a frame from the server; returns 0 once the server says goodbye
+ * and 1 otherwise */
+int handle_frame(struct frame *frame)
+{
+	switch (frame->type) {
+	case FRAME_MSG:
+
+		/* Messages kept in the room's history carry their number */
+		if ((frame->flags & FRAME_FLAG_SEQ) && (frame->len >= FRAME_SEQ_LEN)) {
+			frame->payload += FRAME_SEQ_LEN;
+			frame->len -= FRAME_SEQ_LEN;
+		}
+
+		if (replaying) {
+			received++;
 		} else {
-			printf(buffer);
-			clear_buffer(buffer);
+			render(frame->payload, frame->len);
+		}
+		break;
+	case FRAME_PING:
+		send_frame(FRAME_PONG, frame->payload, frame->len);
+		break;
+	case FRAME_BYE:
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Reads and handles whatever the server has sent, up to READ_BUDGET bytes;
+ * returns 0 once the server has gone and 1 otherwise */
+int handle_server(int sockfd, struct frame_parser *input)
+{
+	struct frame frame;
+	size_t space_len, total = 0;
+	char *space;
+	ssize_t n;
+	int rc;
+
+	while (total < READ_BUDGET) {
+		if ((space = frame_parser_space(input, &space_len)) == NULL) {
+			render_format("handle_server: cannot grow input buffer");
+			return 0;
+		}
+
+		if ((n = read(sockfd, space, space_len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+
+		/* The server has disconnected */
+		if (n == 0) {
+			return 0;
+		}
+		frame_parser_commit(input, n);
+		total += n;
+
+		/* Show every complete frame; partial ones wait for the next read */
+		while ((rc = frame_parser_next(input, &frame)) > 0) {
+			if (!handle_frame(&frame)) {
+				return 0;
+			}
+		}
+
+		if (rc < 0) {
+			render_format("handle_server: malformed frame from server");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Acts on a line the user entered; returns 0 if the user is leaving and 1
+ * otherwise */
+int handle_line(const char *cli_name, char *msg, size_t msg_len)
+{
+	msg[msg_len] = '\0';
+
+	if (strcmp(msg, EXIT_MESSAGE) == 0) {
+		return 0;
+	}
+
+	/* Room commands go to the server alone; it answers with a notice */
+	if (strncmp(msg, JOIN_COMMAND, strlen(JOIN_COMMAND)) == 0) {
+		send_frame(FRAME_JOIN, msg + strlen(JOIN_COMMAND),
+				   msg_len - strlen(JOIN_COMMAND));
+	} else if (strcmp(msg, LEAVE_COMMAND) == 0) {
+		send_frame(FRAME_LEAVE, NULL, 0);
+	} else {
+
+		/* Print client's message back to client */
+		if (!replaying) {
+			render_format("%s says: %.*s", cli_name, (int)msg_len, msg);
+		}
+
+		send_frame(FRAME_MSG, msg, msg_len);
+	}
+
+	return 1;
+}
+
+/* Acts on every whole line the user has typed, leaving a partial line in
+ * the buffer until the rest of it arrives; returns 0 if the user is leaving
+ * and 1 otherwise */
+int handle_lines(const char *cli_name)
+{
+	char *line, *newline;
+	size_t left;
+
+	line = from_user.data + from_user.sent;
+	left = buffer_pending(&from_user);
+
+	while ((newline = memchr(line, '\n', left)) != NULL) {
+		if (!handle_line(cli_name, line, newline - line)) {
+			return 0;
+		}
+		from_user.sent += newline - line + 1;
+		left -= newline - line + 1;
+		line = newline + 1;
+	}
+
+	return 1;
+}
+
+/* Reads what the user typed and acts on every whole line; returns 0 if the
+ * user is leaving or input has ended, and 1 otherwise */
+int handle_user(const char *cli_name)
+{
+	char chunk[4096];
+	ssize_t n;
+
+	if ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) < 0) {
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+	}
+
+	/* End of input leaves */
+	if ((n == 0) || !buffer_append(&from_user, chunk, n)) {
+		return 0;
+	}
+
+	return handle_lines(cli_name);
+}
+
+/* Gets a name from the user and stores it in cli_name; whatever the user
+ * typed after it stays in from_user */
+void get_username(char *cli_name) {
+	char chunk[256], *newline;
+	size_t n;
+	ssize_t got;
+
+	/* Prompt client to enter a name */
+	printf("Please enter a name: ");
+	fflush(stdout);
+
+	/* Read up to the end of the first line, or of input */
+	while ((((newline = (from_user.len > 0) ?
+			  memchr(from_user.data, '\n', from_user.len) : NULL)) == NULL) &&
+		   ((got = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0)) {
+		buffer_append(&from_user, chunk, got);
+	}
+
+	n = (newline != NULL) ? (size_t)(newline - from_user.data) : from_user.len;
+
+	/* A name that is too long is cut short */
+	memcpy(cli_name, from_user.data, (n < CLI_NAME_LEN) ? n : CLI_NAME_LEN);
+	cli_name[(n < CLI_NAME_LEN) ? n : CLI_NAME_LEN] = '\0';
+
+	from_user.sent = (newline != NULL) ? n + 1 : n;
+}
+
+/* Takes the timestamp off the front of a recorded line, if it starts with
+ * one followed by a tab; returns 1 if it did and 0 otherwise */
+int take_timestamp(char **line, size_t *len, double *stamp)
+{
+	char *end;
+
+	if ((*len == 0) || !isdigit((unsigned char)**line)) {
+		return 0;
+	}
+
+	/* Every line ends in a newline, which stops strtod */
+	*stamp = strtod(*line, &end);
+	if ((end >= *line + *len) || (*end != '\t')) {
+		return 0;
+	}
+
+	*len -= end + 1 - *line;
+	*line = end + 1;
+
+	return 1;
+}
+
+/* Queues every whole line of the replayed file that is due, while fewer
+ * than REPLAY_BACKLOG bytes wait for the server.  When a paced line is not
+ * yet due, *wait is set to the milliseconds until it is.  Returns 0 if a
+ * line leaves the chatroom and 1 otherwise */
+int replay_lines(const char *cli_name, struct replay *r, int *wait)
+{
+	char *line, *newline, *msg;
+	size_t left, msg_len;
+	double stamp;
+	long long due, now = now_us();
+
+	if ((left = buffer_pending(&from_user)) == 0) {
+		return 1;
+	}
+	line = from_user.data + from_user.sent;
+
+	while ((buffer_pending(&to_server) < REPLAY_BACKLOG) &&
+		   ((newline = memchr(line, '\n', left)) != NULL)) {
+		msg = line;
+		msg_len = newline - line;
+
+		/* Lines without a timestamp go as soon as the one before them */
+		if (take_timestamp(&msg, &msg_len, &stamp) && r->paced) {
+			if (!r->stamped) {
+				r->first_stamp = stamp;
+				r->stamped = 1;
+			}
+
+			due = r->start + (long long)((stamp - r->first_stamp) * 1e6);
+			if (due > now) {
+				*wait = (int)((due - now + 999) / 1000);
+				break;
+			}
+		}
+
+		/* A frame carries no more than the protocol allows */
+		if (msg_len > FRAME_MAX_PAYLOAD) {
+			msg_len = FRAME_MAX_PAYLOAD;
+		}
+
+		if (!handle_line(cli_name, msg, msg_len)) {
+			return 0;
+		}
+		r->lines++;
+
+		from_user.sent += newline - line + 1;
+		left -= newline - line + 1;
+		line = newline + 1;
+	}
+
+	return 1;
+}
+
+/* Reads more of the replayed file; a last line without a newline is given
+ * one.  Returns 0 if the read failed and 1 otherwise */
+int replay_read(struct replay *r)
+{
+	char chunk[65536];
+	ssize_t n;
+
+	if ((n = read(r->fd, chunk, sizeof(chunk))) < 0) {
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+	}
+
+	if (n == 0) {
+		r->ended = 1;
+		if ((buffer_pending(&from_user) > 0) &&
+			(from_user.data[from_user.len - 1] != '\n')) {
+			return buffer_append(&from_user, "\n", 1);
+		}
+		return 1;
+	}
+
+	return buffer_append(&from_user, chunk, n);
+}
+
+/* Sends the replayed file to the server, keeping its frames flowing while
+ * reading what the server sends back, then says goodbye and reads until the
+ * server hangs up, so that closing the socket never throws away messages the
+ * server has yet to read.  Returns 0 if the server went away first and 1
+ * once it has taken everything */
+int replay(int sockfd, struct frame_parser *input, const char *cli_name,
+		   struct replay *r)
+{
+	struct pollfd fds[2];
+	int wait, leaving = 0, said_bye = 0;
+
+	r->start = now_us();
+
+	while (!interrupted) {
+		wait = -1;
+		if (!leaving) {
+			leaving = !replay_lines(cli_name, r, &wait);
+		}
+
+		/* Every line read has been queued */
+		if (!said_bye &&
+			(leaving || (r->ended && (buffer_pending(&from_user) == 0)))) {
+			send_frame(FRAME_BYE, NULL, 0);
+			leaving = said_bye = 1;
+		}
+
+		/* Read ahead only as far as the server keeps up */
+		fds[0].fd = (!leaving && !r->ended &&
+					 (buffer_pending(&from_user) < REPLAY_BACKLOG)) ? r->fd : -1;
+		fds[0].events = POLLIN;
+		fds[1].fd = sockfd;
+		fds[1].events = POLLIN | ((buffer_pending(&to_server) > 0) ? POLLOUT : 0);
+
+		if (poll(fds, 2, wait) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+
+		if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+			!handle_server(sockfd, input)) {
+			return said_bye;
+		}
+
+		if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !replay_read(r)) {
+			render_format("replay: cannot read the file");
+			leaving = 1;
+		}
+
+		if (buffer_flush(&to_server, sockfd) < 0) {
+			render_format("replay: cannot write to server");
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Prints one line of JSON about a finished replay, timed up to when the
+ * server hung up */
+void replay_report(const struct replay *r)
+{
+	double elapsed = (now_us() - r->start) / 1e6;
+
+	if (elapsed <= 0) {
+		elapsed = 1e-6;
+	}
+
+	printf("{\"paced\":%d,\"lines\":%lu,\"bytes\":%llu,\"writes\":%lu,"
+		   "\"received\":%lu,\"elapsed_s\":%.3f,\"lines_per_s\":%.1f,"
+		   "\"mb_per_s\":%.2f}\n",
+		   r->paced, r->lines, to_server.written, to_server.writes, received,
+		   elapsed, r->lines / elapsed, to_server.written / elapsed / 1e6);
+}
+
+/* Makes fd non-blocking and returns its old flags */
+int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags >= 0) {
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	return flags;
+}
+
+/* Puts back the flags of the terminal, which the shell shares */
+void restore_terminal(void)
+{
+	if (stdin_flags >= 0) {
+		fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+	}
+	if (stdout_flags >= 0) {
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+	}
+}
+
+void handle_interrupt(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+/* Chats with the server until the user leaves, input ends or the server
+ * goes away; returns 0 if the server went away and 1 otherwise */
+int interact(int sockfd, struct frame_parser *input, const char *cli_name)
+{
+	struct pollfd fds[3];
+	int connected = 1, leaving;
+
+	printf("Enter a message: ");
+	fflush(stdout);
+
+	/* From here on nothing blocks; the terminal's flags are put back on the
+	 * way out, and an interrupt leaves through the same way */
+	set_nonblocking(sockfd);
+	stdin_flags = set_nonblocking(STDIN_FILENO);
+	stdout_flags = set_nonblocking(STDOUT_FILENO);
+	atexit(restore_terminal);
+
+	/* Lines typed along with the name are acted on first */
+	leaving = !handle_lines(cli_name);
+
+	while (connected && !leaving && !interrupted) {
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		fds[1].fd = sockfd;
+		fds[1].events = POLLIN | ((buffer_pending(&to_server) > 0) ? POLLOUT : 0);
+		fds[2].fd = (buffer_pending(&to_terminal) > 0) ? STDOUT_FILENO : -1;
+		fds[2].events = POLLOUT;
+
+		if (poll(fds, 3, REPORT_MS) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			connected = handle_server(sockfd, input);
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			leaving = !handle_user(cli_name);
+		}
+
+		report_lag();
+
+		/* Each turn of the loop ends with one batch of writes to each */
+		if (buffer_flush(&to_server, sockfd) < 0) {
+			render_format("interact: cannot write to server");
+			connected = 0;
+		}
+		if (buffer_flush(&to_terminal, STDOUT_FILENO) < 0) {
+			break;
 		}
 	}
-			
+
+	return connected;
 }
 
 int main(int argc, char *argv[])
-{	
-    int sockfd, port_number, n;
+{
+    int sockfd, port_number;
 
     struct sockaddr_in serv_addr;
     struct hostent *server;
 
-    char buffer[BUFFER_LEN];
     char cli_name[CLI_NAME_BUFFER_LEN];
-    char *msg;
-    int connected = 1;
-    pthread_t server_thread;
-    
+    struct frame_parser input;
+    struct replay r = { .fd = -1 };
+    char *replay_path = NULL, *name = NULL;
+    int opt;
+
+	/* Read the options; without -f the user types the messages */
+	while ((opt = getopt(argc, argv, "f:Pu:")) != -1) {
+		switch (opt) {
+		case 'f':
+			replay_path = optarg;
+			break;
+		case 'P':
+			r.paced = 1;
+			break;
+		case 'u':
+			name = optarg;
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+
     /* Check that both hostname and port are provided */
-    if (argc < 3) {
-		printf("USAGE: client PORT_NO HOSTNAME\n");
+    if (argc - optind < 2) {
+		printf(USAGE);
 		exit(1);
 	}
- 
+
+	/* Open the file to replay before connecting, in case it is missing */
+	if (replay_path != NULL) {
+		r.fd = (strcmp(replay_path, "-") == 0) ? STDIN_FILENO :
+			open(replay_path, O_RDONLY);
+		if (r.fd < 0) {
+			printf("main: cannot open %s\n", replay_path);
+			exit(1);
+		}
+		replaying = 1;
+	}
+
 	/* Get the port number of the server from arguments */
-    port_number = atoi(argv[1]);
-    
+    port_number = atoi(argv[optind]);
+
     /* Attempt to open a socket */
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    
+
     if (sockfd < 0) {
 		printf("main: error opening a socket\n");
 		exit(1);
 	}
 
 	/* Attempt to get host information from name provided */
-    server = gethostbyname(argv[2]);
-    
+    server = gethostbyname(argv[optind + 1]);
+
     if (server == NULL) {
-        printf("main: host going by name: %s does not exist", argv[2]);
+        printf("main: host going by name: %s does not exist", argv[optind + 1]);
         exit(1);
     }
-    
+
     /* Fill serv_addr buffer with zeroes */
     bzero((char *) &serv_addr, sizeof(serv_addr));
-    
+
     /* Fill in serv_addr information */
     serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, 
+    bcopy((char *)server->h_addr,
          (char *)&serv_addr.sin_addr.s_addr,
          server->h_length);
     serv_addr.sin_port = htons(port_number);
-    
+
     /* Attempt to create a connection to server via sockfd */
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
 		printf("main: connect to host failed\n");
 		exit(1);
 	}
-    
-    /* Get a usename from the user */
-    get_username(cli_name);
-	
+
+    /* Get a usename from the user, unless one was given or nobody is typing */
+    if ((name == NULL) && !replaying) {
+		get_username(cli_name);
+	} else {
+		snprintf(cli_name, sizeof(cli_name), "%s",
+				 (name != NULL) ? name : REPLAY_NAME);
+	}
+
 	/* Pass on the username to the server */
-	n = write(sockfd, cli_name, CLI_NAME_LEN);
-	
-	/* Spawn another thread to read messages coming in from server */
-	pthread_create(&server_thread, NULL, (void *)handle_server, (void *)&sockfd);
-	
-	printf("Enter a message: ");
-			
-	/* Continue to read and write messages while connected */
-    while(connected)    
-    {
-
-		/* Get message from user and write to server */
-		bzero(buffer, BUFFER_LEN);
-		msg = fgets(buffer, MESSAGE_LEN, stdin);
-		
-		/* Remove the newline character entered by the user */
-		msg[strcspn(msg, "\n")] = '\0';
-		
-		/* Print client's message back to client */
-		printf("%s says: %s\n",cli_name, msg);
-		
-		/* Write non-NULL msg to sockfd */
-		if (msg != NULL) {
-
-			n = write(sockfd, buffer, strlen(buffer));
-			bzero(buffer, BUFFER_LEN);
-			
-			if (n < 0) {
-				printf("main: cannot write to server\n");
-				exit(1);
-			}
+	send_frame(FRAME_HELLO, cli_name, strlen(cli_name));
+
+	frame_parser_init(&input);
+	signal(SIGINT, handle_interrupt);
+	signal(SIGTERM, handle_interrupt);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* A replay needs no terminal; the file and socket alone are polled */
+	if (replaying) {
+		set_nonblocking(sockfd);
+		stdin_flags = (r.fd == STDIN_FILENO) ? set_nonblocking(r.fd) : -1;
+		atexit(restore_terminal);
+
+		if (replay(sockfd, &input, cli_name, &r)) {
+			replay_report(&r);
+		} else {
+			render_format("Disconnected from server");
 		}
+	} else if (interact(sockfd, &input, cli_name)) {
+
+		/* Let the server know we are leaving, after whatever was typed */
+		send_frame(FRAME_BYE, NULL, 0);
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+		buffer_flush(&to_server, sockfd);
+	} else {
+		render_format("Disconnected from server");
 	}
-    
+
+	restore_terminal();
+	buffer_flush(&to_terminal, STDOUT_FILENO);
+
+	frame_parser_destroy(&input);
+	free(to_server.data);
+	free(to_terminal.data);
+	free(from_user.data);
+
     return 0;
 }
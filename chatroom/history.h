@@ -0,0 +1,530 @@
+/* history.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Per-room message history kept in append-only log files.
+ *
+ * Each room's log is a run of segment files in the history directory,
+ * named after the room (in hex) and the sequence number of their first
+ * message.  A segment is created at its full size and mapped into memory;
+ * appending copies a message's frame, exactly as it is sent to clients,
+ * to the end of the newest segment, and a full segment is sealed, trimmed
+ * to its length and replaced by a new one.  Only the newest
+ * HISTORY_MAX_SEGMENTS segments of a room are kept.
+ *
+ * Since the log holds the very bytes clients are sent, replaying history
+ * needs no encoding: a replay is a few ranges of mapped segments, handed to
+ * the client's queue as file messages (see message.h) and sent with
+ * sendfile.  Segments are reference counted so that one dropped from the
+ * log stays mapped until every replay using it has gone out.
+ *
+ * Appends only reach the page cache; a background thread flushes every
+ * log's new records to disk every HISTORY_SYNC_MS, so one sync covers all
+ * the messages appended meanwhile.  The same thread seals full segments,
+ * so that no appender waits on the disk.  A log is recovered the first time its
+ * room is opened, by scanning its newest segment for the last whole
+ * record.
+ *
+ * */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "message.h"
+#include "rooms.h"
+#include "../common/log.h"
+
+/* size of a segment file while it is being appended to */
+#define HISTORY_SEGMENT_LEN (8 << 20)
+
+/* number of segments kept for each room */
+#define HISTORY_MAX_SEGMENTS 16
+
+/* how often appended messages are flushed to disk */
+#define HISTORY_SYNC_MS 50
+
+/* longest history directory name, and longest segment file name in it */
+#define HISTORY_PATH_LEN 4096
+#define SEGMENT_PATH_LEN (HISTORY_PATH_LEN + 2 * ROOM_NAME_LEN + 32)
+
+struct segment {
+	int refs;
+	int fd;
+	char *base;						/* mapping of HISTORY_SEGMENT_LEN bytes */
+	size_t len;						/* bytes of whole records */
+	int sealed;						/* full, and waiting for the sync thread
+									 * to seal it */
+	uint64_t first_seq;
+	char path[SEGMENT_PATH_LEN];
+};
+
+struct room_log {
+	pthread_mutex_t lock;
+	char hex_name[2 * ROOM_NAME_LEN + 1];
+	struct segment *segments[HISTORY_MAX_SEGMENTS];	/* oldest first */
+	int count;
+	uint64_t next_seq;
+	size_t synced;					/* bytes of the newest segment on disk */
+};
+
+struct history {
+	char dir[HISTORY_PATH_LEN];
+	struct room_log **logs;			/* by room id; NULL until opened */
+	int max_rooms;
+	pthread_mutex_t lock;			/* held while opening a log */
+	pthread_t syncer;
+};
+
+/* Takes another reference to a segment */
+static inline void segment_hold(struct segment *seg)
+{
+	__atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to a segment, unmapping it when none remain; takes a
+ * void pointer to serve as a message's release callback */
+static inline void segment_release(void *owner)
+{
+	struct segment *seg = owner;
+
+	if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		munmap(seg->base, HISTORY_SEGMENT_LEN);
+		close(seg->fd);
+		free(seg);
+	}
+}
+
+/* Returns whether a whole record starts at offset in the segment, storing
+ * its length and sequence number */
+static inline int segment_record(const struct segment *seg, size_t offset,
+								 size_t file_len, size_t *len, uint64_t *seq)
+{
+	const uint8_t *header = (const uint8_t *)seg->base + offset;
+	uint32_t payload;
+
+	if (offset + FRAME_HEADER_LEN + FRAME_SEQ_LEN > file_len) {
+		return 0;
+	}
+
+	payload = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+			  ((uint32_t)header[6] << 8) | (uint32_t)header[7];
+
+	if ((header[0] != PROTO_VERSION) || !(header[3] & FRAME_FLAG_SEQ) ||
+		(payload < FRAME_SEQ_LEN) ||
+		(offset + FRAME_HEADER_LEN + payload > file_len)) {
+		return 0;
+	}
+
+	*len = FRAME_HEADER_LEN + payload;
+	*seq = frame_get_u64(seg->base + offset + FRAME_HEADER_LEN);
+
+	return 1;
+}
+
+/* Opens and maps the segment of log starting at first_seq, creating it if
+ * need be, and finds the end of its records; returns NULL on failure */
+static inline struct segment *segment_open(struct history *h,
+										   struct room_log *log,
+										   uint64_t first_seq, int create)
+{
+	struct segment *seg;
+	struct stat st;
+	size_t len;
+	uint64_t seq;
+
+	if ((seg = malloc(sizeof(struct segment))) == NULL) {
+		return NULL;
+	}
+
+	snprintf(seg->path, sizeof(seg->path), "%s/%s.%020llu.log", h->dir,
+			 log->hex_name, (unsigned long long)first_seq);
+
+	seg->refs = 1;
+	seg->len = 0;
+	seg->sealed = 0;
+	seg->first_seq = first_seq;
+	seg->fd = open(seg->path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+
+	if ((seg->fd < 0) || (fstat(seg->fd, &st) < 0)) {
+		goto fail;
+	}
+
+	/* Only the newest segment is appended to, and it is kept at full size */
+	if (create && (ftruncate(seg->fd, HISTORY_SEGMENT_LEN) < 0)) {
+		goto fail;
+	}
+
+	seg->base = mmap(NULL, HISTORY_SEGMENT_LEN, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		goto fail;
+	}
+
+	if (!create) {
+		while (segment_record(seg, seg->len, st.st_size, &len, &seq)) {
+			seg->len += len;
+		}
+	}
+
+	return seg;
+
+fail:
+	if (seg->fd >= 0) {
+		close(seg->fd);
+	}
+	free(seg);
+	return NULL;
+}
+
+/* Writes the segment's records to disk and trims the file to them, once no
+ * more will be appended; called by the sync thread without the log's lock,
+ * since the write waits on the disk */
+static inline void segment_seal(struct segment *seg)
+{
+	msync(seg->base, seg->len, MS_SYNC);
+
+	if (ftruncate(seg->fd, seg->len) < 0) {
+		log_error("segment_seal: cannot trim %s", seg->path);
+	}
+}
+
+/* Comparison of sequence numbers for qsort */
+static inline int history_compare_seq(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Reopens the newest segments left in the directory by an earlier run;
+ * returns 0 on failure and 1 on success */
+static inline int room_log_recover(struct history *h, struct room_log *log)
+{
+	size_t prefix_len = strlen(log->hex_name);
+	uint64_t *seqs = NULL, *grown, last = 0;
+	unsigned long long seq;
+	struct segment *seg;
+	struct dirent *entry;
+	int count = 0, capacity = 0, i, first;
+	size_t offset, len;
+	DIR *dir;
+
+	if ((dir = opendir(h->dir)) == NULL) {
+		return 0;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if ((strncmp(entry->d_name, log->hex_name, prefix_len) != 0) ||
+			(entry->d_name[prefix_len] != '.') ||
+			(sscanf(entry->d_name + prefix_len + 1, "%20llu.log", &seq) != 1)) {
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity = (capacity > 0) ? capacity * 2 : 16;
+			if ((grown = realloc(seqs, capacity * sizeof(uint64_t))) == NULL) {
+				break;
+			}
+			seqs = grown;
+		}
+		seqs[count++] = seq;
+	}
+	closedir(dir);
+
+	qsort(seqs, count, sizeof(uint64_t), history_compare_seq);
+
+	/* Older segments than are kept were meant to be gone already */
+	first = (count > HISTORY_MAX_SEGMENTS) ? count - HISTORY_MAX_SEGMENTS : 0;
+
+	for (i = first; i < count; i++) {
+		if ((seg = segment_open(h, log, seqs[i], 0)) == NULL) {
+			continue;
+		}
+		log->segments[log->count++] = seg;
+	}
+	free(seqs);
+
+	/* The last record of the newest segment gives the next number, or its
+	 * name if it holds no whole record yet */
+	log->next_seq = 1;
+	if (log->count > 0) {
+		seg = log->segments[log->count - 1];
+		log->next_seq = seg->first_seq;
+
+		offset = 0;
+		while (segment_record(seg, offset, seg->len, &len, &last)) {
+			offset += len;
+		}
+
+		/* Appending resumes in place, so the segment goes back to full size */
+		if (ftruncate(seg->fd, HISTORY_SEGMENT_LEN) < 0) {
+			return 0;
+		}
+		log->synced = seg->len;
+	}
+
+	if (last + 1 > log->next_seq) {
+		log->next_seq = last + 1;
+	}
+
+	return 1;
+}
+
+/* Returns the log of room, opening and recovering it the first time the
+ * room is named; returns NULL on failure */
+static inline struct room_log *history_open(struct history *h, int room,
+											const char *name)
+{
+	struct room_log *log;
+	int i;
+
+	if ((room < 0) || (room >= h->max_rooms)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&h->lock);
+
+	if ((log = h->logs[room]) == NULL) {
+		if ((log = calloc(1, sizeof(struct room_log))) != NULL) {
+			pthread_mutex_init(&log->lock, NULL);
+
+			for (i = 0; (name[i] != '\0') && (i < ROOM_NAME_LEN); i++) {
+				snprintf(log->hex_name + 2 * i, 3, "%02x",
+						 (unsigned char)name[i]);
+			}
+
+			if (room_log_recover(h, log)) {
+				__atomic_store_n(&h->logs[room], log, __ATOMIC_RELEASE);
+			} else {
+				log_error("history_open: cannot recover the log of %s", name);
+				free(log);
+				log = NULL;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&h->lock);
+
+	return log;
+}
+
+/* Gives msg, a frame built with FRAME_FLAG_SEQ, the next sequence number
+ * of its room and appends it to the room's log; returns 0 on failure and 1
+ * on success */
+static inline int history_append(struct history *h, struct message *msg)
+{
+	struct room_log *log = __atomic_load_n(&h->logs[msg->room],
+										   __ATOMIC_ACQUIRE);
+	struct segment *seg, *newest = NULL;
+	int ok = 1;
+
+	if ((log == NULL) || (msg->len > HISTORY_SEGMENT_LEN)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&log->lock);
+
+	if (log->count > 0) {
+		newest = log->segments[log->count - 1];
+	}
+
+	/* Start a new segment when the newest one is full */
+	if ((newest == NULL) || (newest->len + msg->len > HISTORY_SEGMENT_LEN)) {
+		if ((seg = segment_open(h, log, log->next_seq, 1)) == NULL) {
+			ok = 0;
+		} else {
+			/* The sync thread seals the full segment, off the lock */
+			if (newest != NULL) {
+				newest->sealed = 1;
+			}
+
+			if (log->count == HISTORY_MAX_SEGMENTS) {
+				unlink(log->segments[0]->path);
+				segment_release(log->segments[0]);
+				memmove(&log->segments[0], &log->segments[1],
+						(log->count - 1) * sizeof(struct segment *));
+				log->count--;
+			}
+
+			log->segments[log->count++] = newest = seg;
+			log->synced = 0;
+		}
+	}
+
+	if (ok) {
+		msg->seq = log->next_seq++;
+		frame_put_u64(msg->data + FRAME_HEADER_LEN, msg->seq);
+		memcpy(newest->base + newest->len, msg->data, msg->len);
+		newest->len += msg->len;
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return ok;
+}
+
+/* Stores in out, at most HISTORY_MAX_SEGMENTS of them, file messages that
+ * together hold the room's messages numbered after after, or only the last
+ * last of those when last is positive, and stores in upto the number of the
+ * last message covered.  Returns the number of messages stored */
+static inline int history_replay(struct history *h, int room, uint64_t after,
+								 int last, struct message **out,
+								 uint64_t *upto)
+{
+	struct room_log *log;
+	struct segment *seg;
+	size_t offset, len;
+	uint64_t seq;
+	int i, n = 0;
+
+	*upto = 0;
+
+	if ((room < 0) || (room >= h->max_rooms) ||
+		((log = __atomic_load_n(&h->logs[room], __ATOMIC_ACQUIRE)) == NULL)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&log->lock);
+
+	*upto = log->next_seq - 1;
+
+	if ((last > 0) && (log->next_seq > (uint64_t)last + 1) &&
+		(after < log->next_seq - 1 - last)) {
+		after = log->next_seq - 1 - last;
+	}
+
+	for (i = 0; i < log->count; i++) {
+		seg = log->segments[i];
+
+		/* Skip segments that end at or before after */
+		if ((i + 1 < log->count) && (log->segments[i + 1]->first_seq <= after + 1)) {
+			continue;
+		}
+
+		/* Find the first record past after; only the first segment used
+		 * can start partway through */
+		offset = 0;
+		if (seg->first_seq <= after) {
+			while (segment_record(seg, offset, seg->len, &len, &seq) &&
+				   (seq <= after)) {
+				offset += len;
+			}
+		}
+
+		if (offset >= seg->len) {
+			continue;
+		}
+
+		segment_hold(seg);
+		out[n] = message_new_file(seg->base + offset, seg->len - offset,
+								  seg->fd, offset, segment_release, seg);
+		if (out[n] == NULL) {
+			segment_release(seg);
+			break;
+		}
+		n++;
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return n;
+}
+
+/* Flushes every log's newly appended records to disk every HISTORY_SYNC_MS,
+ * so that one sync covers a whole batch of appends, and seals the segments
+ * that filled up meanwhile */
+static inline void *history_sync(void *args)
+{
+	struct history *h = args;
+	struct room_log *log;
+	struct segment *seg, *full[HISTORY_MAX_SEGMENTS];
+	size_t from, to, page = sysconf(_SC_PAGESIZE);
+	int i, j, num_full;
+
+	while (1) {
+		usleep(HISTORY_SYNC_MS * 1000);
+
+		for (i = 0; i < h->max_rooms; i++) {
+			if ((log = __atomic_load_n(&h->logs[i], __ATOMIC_ACQUIRE)) == NULL) {
+				continue;
+			}
+
+			pthread_mutex_lock(&log->lock);
+			num_full = 0;
+			for (j = 0; j < log->count - 1; j++) {
+				if (log->segments[j]->sealed) {
+					log->segments[j]->sealed = 0;
+					segment_hold(log->segments[j]);
+					full[num_full++] = log->segments[j];
+				}
+			}
+			pthread_mutex_unlock(&log->lock);
+
+			/* A full segment takes no more appends, so needs no lock */
+			for (j = 0; j < num_full; j++) {
+				segment_seal(full[j]);
+				segment_release(full[j]);
+			}
+
+			pthread_mutex_lock(&log->lock);
+			seg = (log->count > 0) ? log->segments[log->count - 1] : NULL;
+			if ((seg == NULL) || (seg->len == log->synced)) {
+				pthread_mutex_unlock(&log->lock);
+				continue;
+			}
+			segment_hold(seg);
+			from = log->synced & ~(page - 1);
+			to = seg->len;
+			pthread_mutex_unlock(&log->lock);
+
+			/* Appends carry on while the records are written out */
+			msync(seg->base + from, to - from, MS_SYNC);
+
+			pthread_mutex_lock(&log->lock);
+			if ((log->count > 0) && (log->segments[log->count - 1] == seg) &&
+				(log->synced < to)) {
+				log->synced = to;
+			}
+			pthread_mutex_unlock(&log->lock);
+
+			segment_release(seg);
+		}
+	}
+
+	return NULL;
+}
+
+/* Prepares a history kept in directory dir, creating it if need be, for
+ * rooms with ids below max_rooms, and starts flushing it to disk; returns 0
+ * on failure and 1 on success */
+static inline int history_init(struct history *h, const char *dir,
+							   int max_rooms)
+{
+	if ((strlen(dir) >= sizeof(h->dir)) ||
+		((mkdir(dir, 0755) < 0) && (errno != EEXIST))) {
+		return 0;
+	}
+
+	strcpy(h->dir, dir);
+	h->max_rooms = max_rooms;
+
+	if (((h->logs = calloc(max_rooms, sizeof(struct room_log *))) == NULL) ||
+		(pthread_mutex_init(&h->lock, NULL) != 0)) {
+		return 0;
+	}
+
+	return (pthread_create(&h->syncer, NULL, history_sync, h) == 0);
+}
+
+#endif
@@ -0,0 +1,624 @@
+/* loadgen.c
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A load generator for the chatroom server.  It opens CONNECTIONS clients
+ * from one process, names each with a HELLO frame and, after a short
+ * warm-up, has SENDERS of them send MSG frames of SIZE bytes at RATE
+ * messages per second in total for SECONDS seconds.  Every client reads
+ * what the server relays.
+ *
+ * Each message carries the time it was due to be sent.  A client that
+ * receives it records the time since then in a latency histogram (see
+ * metrics.h), so a sender held up by a full socket shows up as latency
+ * rather than hiding it.  Once sending stops, the clients wait up to a
+ * grace period for every message to reach every client; then the run is
+ * reported as a single line of JSON on stdout, so that runs against
+ * different servers can be compared.
+ *
+ * Connections are spread over THREADS threads, each serving its share
+ * with its own epoll loop.  All clients join ROOM if one is given, and
+ * stay in the lobby otherwise; every message is expected by every client,
+ * its sender included.
+ *
+ * Usage: ./loadgen.exe [-c CONNECTIONS] [-s SENDERS] [-r RATE] [-l SIZE]
+ *                      [-d SECONDS] [-t THREADS] [-R ROOM] PORT_NO HOST_NAME
+ *
+ * */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "../common/metrics.h"
+
+#define USAGE "usage: loadgen [-c CONNECTIONS] [-s SENDERS] [-r RATE] " \
+	"[-l SIZE] [-d SECONDS] [-t THREADS] [-R ROOM] PORT_NO HOST_NAME\n"
+
+/* maximum number of events handled per call to epoll_wait */
+#define MAX_EVENTS 256
+
+/* how long clients are given to settle in before sending starts */
+#define WARMUP_MS 500
+
+/* how long after sending stops the clients wait for the last messages */
+#define GRACE_MS 5000
+
+/* most messages a thread sends in one go when it has fallen behind, so
+ * that it still reads in between */
+#define MAX_BURST 256
+
+/* bytes a client may have waiting to be written before it skips sends */
+#define MAX_PENDING (1 << 20)
+
+/* a message's send time, as 16 hex digits at the start of its text */
+#define STAMP_LEN 16
+
+/* What the load generator counts */
+enum counter {
+	SENT,
+	SKIPPED,			/* sends skipped since the socket was backed up */
+	RECEIVED,
+	BYTES_IN,
+	NUM_COUNTERS
+};
+
+enum histogram {
+	LATENCY,
+	NUM_HISTOGRAMS
+};
+
+struct connection {
+	int sock_fd;
+	int index;
+	struct frame_parser input;
+	char *out;					/* frames waiting to be written */
+	size_t out_len;
+	size_t out_cap;
+	size_t out_sent;
+};
+
+/* A thread and the connections it serves */
+struct worker {
+	pthread_t thread;
+	int index;
+	int epoll_fd;
+	struct connection *connections;
+	int count;
+	int senders;				/* the first senders of the connections send */
+	int first_sender;			/* index of the first among all senders */
+};
+
+static int num_connections = 100;
+static int num_senders = 0;
+static int rate = 1000;
+static int msg_size = 64;
+static int duration = 10;
+static int num_threads = 1;
+static char *room = NULL;
+
+static struct sockaddr_in serv_addr;
+
+/* every thread waits for the others to connect, then for the clock to be
+ * set */
+static pthread_barrier_t connected, started;
+
+/* when sending starts and stops, and when waiting for stragglers ends */
+static uint64_t start_ns, stop_ns, deadline_ns;
+
+/* threads still sending, and when the last message arrived */
+static int sending_threads;
+static uint64_t last_received_ns;
+
+/* Raises the limit on open descriptors as far as allowed, since every
+ * connection holds one */
+void raise_fd_limit(void)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/* Writes as much of the connection's waiting frames as the socket takes
+ * without blocking; returns 0 if the write failed and 1 otherwise */
+int flush_connection(struct connection *conn)
+{
+	ssize_t n;
+
+	while (conn->out_sent < conn->out_len) {
+		n = write(conn->sock_fd, conn->out + conn->out_sent,
+				  conn->out_len - conn->out_sent);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+		conn->out_sent += n;
+	}
+
+	conn->out_len = conn->out_sent = 0;
+
+	return 1;
+}
+
+/* Appends a frame to the connection's waiting frames and writes what it
+ * can; returns 0 on failure and 1 on success */
+int send_frame(struct connection *conn, uint8_t type, const char *payload,
+			   uint32_t len)
+{
+	size_t needed = conn->out_len + FRAME_HEADER_LEN + len;
+	size_t cap;
+	char *grown;
+
+	if (needed > conn->out_cap) {
+		cap = (conn->out_cap > 0) ? conn->out_cap : 4096;
+		while (cap < needed) {
+			cap *= 2;
+		}
+		if ((grown = realloc(conn->out, cap)) == NULL) {
+			return 0;
+		}
+		conn->out = grown;
+		conn->out_cap = cap;
+	}
+
+	frame_header_encode(conn->out + conn->out_len, type, len);
+	memcpy(conn->out + conn->out_len + FRAME_HEADER_LEN, payload, len);
+	conn->out_len = needed;
+
+	return flush_connection(conn);
+}
+
+/* Sends a chat message stamped with the time it was due */
+void send_message(struct connection *conn, uint64_t due, char *text)
+{
+	char stamp[STAMP_LEN + 1];
+
+	if (conn->out_len - conn->out_sent > MAX_PENDING) {
+		metrics_add(SKIPPED, 1);
+		return;
+	}
+
+	snprintf(stamp, sizeof(stamp), "%016llx", (unsigned long long)due);
+	memcpy(text, stamp, STAMP_LEN);
+
+	if (!send_frame(conn, FRAME_MSG, text, msg_size)) {
+		printf("send_message: write to server failed\n");
+		exit(1);
+	}
+
+	metrics_add(SENT, 1);
+}
+
+/* Records the latency of a chat frame "NAME says: STAMP..." sent during
+ * this run; anything else, such as notices and replayed history, is
+ * ignored */
+void receive_message(struct frame *frame, uint64_t now)
+{
+	static const char says[] = " says: ";
+	char *text, *end = frame->payload + frame->len;
+	uint64_t due = 0;
+	int i, digit;
+
+	if ((frame->flags & FRAME_FLAG_SEQ) && (frame->len >= FRAME_SEQ_LEN)) {
+		frame->payload += FRAME_SEQ_LEN;
+		frame->len -= FRAME_SEQ_LEN;
+	}
+
+	text = memmem(frame->payload, frame->len, says, sizeof(says) - 1);
+	if ((text == NULL) || (end - (text += sizeof(says) - 1) < STAMP_LEN)) {
+		return;
+	}
+
+	for (i = 0; i < STAMP_LEN; i++) {
+		if ((text[i] >= '0') && (text[i] <= '9')) {
+			digit = text[i] - '0';
+		} else if ((text[i] >= 'a') && (text[i] <= 'f')) {
+			digit = text[i] - 'a' + 10;
+		} else {
+			return;
+		}
+		due = (due << 4) | digit;
+	}
+
+	if ((due < start_ns) || (due > now)) {
+		return;
+	}
+
+	metrics_add(RECEIVED, 1);
+	metrics_record(LATENCY, now - due);
+}
+
+/* Reads everything waiting on the connection and handles every complete
+ * frame; returns 0 once the server has hung up and 1 otherwise */
+int read_connection(struct connection *conn)
+{
+	struct frame frame;
+	size_t space_len;
+	char *space;
+	ssize_t n;
+	int rc, received = 0;
+
+	while (1) {
+		if ((space = frame_parser_space(&conn->input, &space_len)) == NULL) {
+			return 0;
+		}
+
+		if ((n = read(conn->sock_fd, space, space_len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (n == 0) {
+			return 0;
+		}
+
+		metrics_add(BYTES_IN, n);
+		frame_parser_commit(&conn->input, n);
+
+		while ((rc = frame_parser_next(&conn->input, &frame)) > 0) {
+			if (frame.type == FRAME_MSG) {
+				receive_message(&frame, metrics_now());
+				received = 1;
+			} else if (frame.type == FRAME_PING) {
+				send_frame(conn, FRAME_PONG, frame.payload, frame.len);
+			}
+		}
+
+		if (rc < 0) {
+			return 0;
+		}
+	}
+
+	if (received) {
+		__atomic_store_n(&last_received_ns, metrics_now(), __ATOMIC_RELAXED);
+	}
+
+	return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+/* Connects the worker's clients, names them and moves them to the room;
+ * returns 0 on failure and 1 on success */
+int connect_worker(struct worker *worker)
+{
+	struct connection *conn;
+	struct epoll_event event;
+	char name[32];
+	int i, enable = 1, flags;
+
+	if ((worker->epoll_fd = epoll_create1(0)) < 0) {
+		printf("connect_worker: cannot create epoll instance\n");
+		return 0;
+	}
+
+	for (i = 0; i < worker->count; i++) {
+		conn = &worker->connections[i];
+
+		if (((conn->sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+			(connect(conn->sock_fd, (struct sockaddr *)&serv_addr,
+					 sizeof(serv_addr)) < 0)) {
+			printf("connect_worker: connect to host failed\n");
+			return 0;
+		}
+
+		/* Small frames go out as they are sent, as a user's would */
+		setsockopt(conn->sock_fd, IPPROTO_TCP, TCP_NODELAY, &enable,
+				   sizeof(enable));
+
+		snprintf(name, sizeof(name), "lg%d", conn->index);
+		if (!frame_write(conn->sock_fd, FRAME_HELLO, name, strlen(name)) ||
+			((room != NULL) &&
+			 !frame_write(conn->sock_fd, FRAME_JOIN, room, strlen(room)))) {
+			printf("connect_worker: cannot write to server\n");
+			return 0;
+		}
+
+		if (((flags = fcntl(conn->sock_fd, F_GETFL, 0)) < 0) ||
+			(fcntl(conn->sock_fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+			printf("connect_worker: cannot make socket non-blocking\n");
+			return 0;
+		}
+
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->sock_fd,
+					  &event) < 0) {
+			printf("connect_worker: epoll_ctl failed\n");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Returns the number of messages every client should receive in all,
+ * once every thread has stopped sending */
+uint64_t expected_messages(void)
+{
+	return metrics_counter(SENT) * num_connections;
+}
+
+/* Connects the worker's clients, then has each of its senders send at its
+ * share of the rate while reading whatever arrives, until every message has
+ * arrived everywhere or the grace period is over */
+void *run_worker(void *args)
+{
+	struct worker *worker = args;
+	struct epoll_event events[MAX_EVENTS];
+	struct connection *conn;
+	uint64_t now, next_send = 0, interval = 0;
+	char *text;
+	int n, i, burst, timeout, sending = 1, next_sender = 0;
+
+	if (!connect_worker(worker)) {
+		exit(1);
+	}
+
+	if ((text = malloc(msg_size)) == NULL) {
+		printf("run_worker: malloc failed\n");
+		exit(1);
+	}
+	memset(text, 'x', msg_size);
+
+	pthread_barrier_wait(&connected);
+	pthread_barrier_wait(&started);
+
+	/* Every sender sends an equal share of the rate, so a thread's share
+	 * goes with its senders, and a thread with none sends nothing; threads
+	 * start offset by their first sender, within an interval, so that they
+	 * take turns rather than sending together */
+	if (worker->senders == 0) {
+		sending = 0;
+		__atomic_sub_fetch(&sending_threads, 1, __ATOMIC_ACQ_REL);
+	} else {
+		interval = (uint64_t)1000000000 * num_senders /
+			((uint64_t)rate * worker->senders);
+		next_send = start_ns + interval * worker->first_sender / num_senders;
+	}
+
+	while (1) {
+		now = metrics_now();
+
+		if (sending) {
+			for (burst = 0; (burst < MAX_BURST) && (next_send <= now) &&
+					 (next_send < stop_ns); burst++) {
+				send_message(&worker->connections[next_sender], next_send,
+							 text);
+				next_sender = (next_sender + 1) % worker->senders;
+				next_send += interval;
+			}
+
+			if (next_send >= stop_ns) {
+				sending = 0;
+				__atomic_sub_fetch(&sending_threads, 1, __ATOMIC_ACQ_REL);
+			}
+		}
+
+		/* The total is only known once every thread has stopped */
+		if (!sending &&
+			(((__atomic_load_n(&sending_threads, __ATOMIC_ACQUIRE) == 0) &&
+			  (metrics_counter(RECEIVED) >= expected_messages())) ||
+			 (now >= deadline_ns))) {
+			break;
+		}
+
+		if (sending) {
+			timeout = (next_send > now) ? (next_send - now) / 1000000 : 0;
+		} else {
+			timeout = 10;
+		}
+
+		if ((n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("run_worker: epoll_wait failed\n");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+
+			if ((events[i].events & EPOLLOUT) && !flush_connection(conn)) {
+				printf("run_worker: write to server failed\n");
+				exit(1);
+			}
+
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+				!read_connection(conn)) {
+				printf("run_worker: server closed connection %d\n", conn->index);
+				exit(1);
+			}
+		}
+	}
+
+	free(text);
+
+	return NULL;
+}
+
+/* Prints the run's settings and results as one line of JSON */
+void report(void)
+{
+	struct metrics_histogram *h;
+	uint64_t sent = metrics_counter(SENT);
+	uint64_t received = metrics_counter(RECEIVED);
+	uint64_t expected = expected_messages();
+	uint64_t last = __atomic_load_n(&last_received_ns, __ATOMIC_RELAXED);
+	double elapsed = (last > start_ns) ? (last - start_ns) / 1e9 : 0;
+
+	if ((h = malloc(sizeof(struct metrics_histogram))) == NULL) {
+		printf("report: malloc failed\n");
+		exit(1);
+	}
+	metrics_histogram(LATENCY, h);
+
+	/* The rate sent at is given next to the rate asked for, as a client
+	 * backed up by the server skips sends */
+	printf("{\"connections\":%d,\"senders\":%d,\"threads\":%d,\"rate\":%d,"
+		   "\"sent_per_s\":%.1f,\"size\":%d,\"duration_s\":%d,\"room\":",
+		   num_connections, num_senders, num_threads, rate,
+		   sent / (double)duration, msg_size, duration);
+	metrics_json_string(stdout, (room != NULL) ? room : "lobby");
+	printf(",\"sent\":%llu,\"skipped\":%llu,\"expected\":%llu,"
+		   "\"received\":%llu,\"lost\":%llu,\"bytes_in\":%llu,"
+		   "\"elapsed_s\":%.3f,\"received_per_s\":%.1f,"
+		   "\"latency_ns\":{\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,"
+		   "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+		   (unsigned long long)sent,
+		   (unsigned long long)metrics_counter(SKIPPED),
+		   (unsigned long long)expected, (unsigned long long)received,
+		   (unsigned long long)((expected > received) ? expected - received : 0),
+		   (unsigned long long)metrics_counter(BYTES_IN), elapsed,
+		   (elapsed > 0) ? received / elapsed : 0.0,
+		   (unsigned long long)((h->count > 0) ? h->sum / h->count : 0),
+		   (unsigned long long)metrics_percentile(h, 0.5),
+		   (unsigned long long)metrics_percentile(h, 0.9),
+		   (unsigned long long)metrics_percentile(h, 0.99),
+		   (unsigned long long)metrics_percentile(h, 0.999),
+		   (unsigned long long)h->max);
+
+	free(h);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hostent *server;
+	struct worker *workers;
+	int i, j, opt, first, senders;
+
+	while ((opt = getopt(argc, argv, "c:s:r:l:d:t:R:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_connections = atoi(optarg);
+			break;
+		case 's':
+			num_senders = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'l':
+			msg_size = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'R':
+			room = optarg;
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+
+	/* Every connection sends unless told otherwise, and a message must have
+	 * room for its stamp */
+	if ((num_senders <= 0) || (num_senders > num_connections)) {
+		num_senders = num_connections;
+	}
+	if (msg_size < STAMP_LEN) {
+		msg_size = STAMP_LEN;
+	}
+	if ((argc - optind < 2) || (num_connections <= 0) || (rate <= 0) ||
+		(duration <= 0) || (num_threads <= 0)) {
+		printf(USAGE);
+		exit(1);
+	}
+	if (num_threads > num_connections) {
+		num_threads = num_connections;
+	}
+
+	if ((server = gethostbyname(argv[optind + 1])) == NULL) {
+		printf("main: host going by name: %s does not exist\n",
+			   argv[optind + 1]);
+		exit(1);
+	}
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+	serv_addr.sin_port = htons(atoi(argv[optind]));
+
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = calloc(num_threads, sizeof(struct worker));
+	if ((workers == NULL) ||
+		(pthread_barrier_init(&connected, NULL, num_threads + 1) != 0) ||
+		(pthread_barrier_init(&started, NULL, num_threads + 1) != 0)) {
+		printf("main: cannot allocate workers\n");
+		exit(1);
+	}
+
+	/* Connections and senders are dealt out as evenly as they go */
+	for (i = first = senders = 0; i < num_threads; i++) {
+		workers[i].index = i;
+		workers[i].count = num_connections / num_threads +
+			(i < num_connections % num_threads);
+		workers[i].senders = num_senders / num_threads +
+			(i < num_senders % num_threads);
+		workers[i].first_sender = senders;
+		senders += workers[i].senders;
+		workers[i].connections = calloc(workers[i].count,
+										sizeof(struct connection));
+		if (workers[i].connections == NULL) {
+			printf("main: cannot allocate connections\n");
+			exit(1);
+		}
+		for (j = 0; j < workers[i].count; j++) {
+			workers[i].connections[j].index = first + j;
+			frame_parser_init(&workers[i].connections[j].input);
+		}
+		first += workers[i].count;
+	}
+
+	sending_threads = num_threads;
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+						   &workers[i]) != 0) {
+			printf("main: cannot start thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	/* The clock starts once everyone is connected and has settled in */
+	pthread_barrier_wait(&connected);
+	start_ns = metrics_now() + (uint64_t)WARMUP_MS * 1000000;
+	stop_ns = start_ns + (uint64_t)duration * 1000000000;
+	deadline_ns = stop_ns + (uint64_t)GRACE_MS * 1000000;
+	pthread_barrier_wait(&started);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	report();
+
+	return 0;
+}
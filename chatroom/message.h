@@ -0,0 +1,555 @@
+/* message.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Broadcast messages built once and shared by every recipient.
+ *
+ * A message holds the exact bytes written to each client, a whole frame as
+ * described in protocol.h, in a single allocation, so it can go out with one
+ * system call per recipient.  Messages are immutable once built and are
+ * freed when the last holder releases its reference; references are counted
+ * atomically since a message may be queued for clients on several threads.
+ *
+ * A message may also stand for a range of a file that is mapped into
+ * memory, such as a stretch of a room's history: its bytes are those in the
+ * mapping, and a queue sends it with sendfile instead of copying it out.
+ * Whoever owns the file is told through the message's release callback
+ * when the range is no longer needed.
+ *
+ * Messages are allocated from pools of a few size classes (see pool.h), so
+ * that steady traffic costs no call to malloc or free; only messages larger
+ * than the biggest class go to malloc.
+ *
+ * Each client also owns an outbound queue of messages that could not be
+ * written straight away.  The queue is drained with non-blocking writes when
+ * the client's socket becomes writable, several messages per writev.
+ *
+ * A queue may send messages of at least zerocopy_min bytes with
+ * MSG_ZEROCOPY, one message per sendmsg, so that the kernel sends from the
+ * shared message instead of copying it for every recipient.  The kernel
+ * then reads the message after the call returns, so the queue holds a
+ * reference for each such send until the socket's error queue reports it
+ * done (see outq_zerocopy_reap).
+ *
+ * */
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "../common/pool.h"
+
+/* initial number of slots in an outbound queue */
+#define OUTQ_MIN_CAPACITY 8
+
+/* maximum number of messages written by one call to outq_flush */
+#define OUTQ_MAX_IOV 64
+
+/* number of size classes messages are allocated from */
+#define MESSAGE_CLASSES 4
+
+struct message {
+	int refs;
+	int size_class;				/* pool it came from; -1 if from malloc */
+	int room;					/* room the message is broadcast to */
+	uint64_t seq;				/* sequence number in the room's history;
+								 * 0 if the message is not kept */
+	uint64_t born;				/* when the bytes it carries were read, in
+								 * nanoseconds; 0 if not timed */
+	size_t len;
+	char *data;					/* the bytes to write */
+
+	/* set when data is a range of a mapped file */
+	int file_fd;
+	off_t file_offset;
+	void (*release)(void *owner);
+	void *owner;
+
+	char bytes[];				/* data of a message built in memory */
+};
+
+/* Whole allocations, header included, of each size class, from a short
+ * chat line up to a long paste; larger frames are rare enough for malloc */
+static struct pool message_pools[MESSAGE_CLASSES] = {
+	POOL_INITIALIZER(256),
+	POOL_INITIALIZER(1024),
+	POOL_INITIALIZER(4096),
+	POOL_INITIALIZER(16384)
+};
+
+/* Allocates a message of len bytes with a single reference held by the
+ * caller; returns NULL if no memory can be allocated */
+static inline struct message *message_alloc(size_t len)
+{
+	size_t size = sizeof(struct message) + len;
+	struct message *msg;
+	int size_class;
+
+	for (size_class = 0; size_class < MESSAGE_CLASSES; size_class++) {
+		if (size <= message_pools[size_class].size) {
+			break;
+		}
+	}
+
+	if (size_class < MESSAGE_CLASSES) {
+		msg = pool_alloc(&message_pools[size_class]);
+	} else {
+		size_class = -1;
+		msg = malloc(size);
+	}
+
+	if (msg == NULL) {
+		return NULL;
+	}
+
+	msg->refs = 1;
+	msg->size_class = size_class;
+	msg->room = 0;
+	msg->seq = 0;
+	msg->born = 0;
+	msg->len = len;
+	msg->data = msg->bytes;
+	msg->file_fd = -1;
+	msg->release = NULL;
+
+	return msg;
+}
+
+/* Makes a message of the len bytes at data, which are also found at offset
+ * in the file fd; release is called with owner once the message is freed.
+ * Returns NULL if no memory can be allocated */
+static inline struct message *message_new_file(char *data, size_t len,
+											   int fd, off_t offset,
+											   void (*release)(void *),
+											   void *owner)
+{
+	struct message *msg;
+
+	if ((msg = message_alloc(0)) == NULL) {
+		return NULL;
+	}
+
+	msg->len = len;
+	msg->data = data;
+	msg->file_fd = fd;
+	msg->file_offset = offset;
+	msg->release = release;
+	msg->owner = owner;
+
+	return msg;
+}
+
+/* Builds a frame of the given type around a copy of payload */
+static inline struct message *message_new_frame(uint8_t type,
+												const char *payload,
+												uint32_t len)
+{
+	struct message *msg;
+
+	if ((msg = message_alloc(FRAME_HEADER_LEN + len)) == NULL) {
+		return NULL;
+	}
+
+	frame_header_encode(msg->data, type, len);
+	memcpy(msg->data + FRAME_HEADER_LEN, payload, len);
+
+	return msg;
+}
+
+/* Builds the chat frame "name says: text"; with FRAME_FLAG_SEQ in flags,
+ * space is left at the front of the payload for a sequence number, to be
+ * filled in when the message is added to a history */
+static inline struct message *message_new(const char *name, const char *text,
+										  size_t text_len, uint16_t flags)
+{
+	static const char says[] = " says: ";
+	size_t name_len = strlen(name);
+	size_t seq_len = (flags & FRAME_FLAG_SEQ) ? FRAME_SEQ_LEN : 0;
+	size_t len = seq_len + name_len + (sizeof(says) - 1) + text_len;
+	struct message *msg;
+	char *p;
+
+	if ((len > FRAME_MAX_PAYLOAD) ||
+		((msg = message_alloc(FRAME_HEADER_LEN + len)) == NULL)) {
+		return NULL;
+	}
+
+	frame_header_encode(msg->data, FRAME_MSG, len);
+	msg->data[2] = (flags >> 8) & 0xff;
+	msg->data[3] = flags & 0xff;
+
+	p = msg->data + FRAME_HEADER_LEN;
+	memset(p, 0, seq_len);
+	p += seq_len;
+	memcpy(p, name, name_len);
+	p += name_len;
+	memcpy(p, says, sizeof(says) - 1);
+	p += sizeof(says) - 1;
+	memcpy(p, text, text_len);
+
+	return msg;
+}
+
+/* Takes another reference to msg and returns it */
+static inline struct message *message_hold(struct message *msg)
+{
+	__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+	return msg;
+}
+
+/* Drops a reference to msg, freeing it when no references remain */
+static inline void message_release(struct message *msg)
+{
+	if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (msg->release != NULL) {
+			msg->release(msg->owner);
+		}
+
+		if (msg->size_class >= 0) {
+			pool_free(&message_pools[msg->size_class], msg);
+		} else {
+			free(msg);
+		}
+	}
+}
+
+/* FIFO of messages waiting to be written to a client; the ring grows by
+ * doubling and any limit on its length is left to the caller */
+struct outq {
+	struct message **ring;
+	unsigned int head;
+	unsigned int count;
+	unsigned int capacity;		/* always zero or a power of two */
+	size_t offset;				/* bytes of the head message already written */
+	unsigned int busy;			/* messages at the head handed to the kernel
+								 * by an asynchronous send still in flight */
+	unsigned long bytes_sent;	/* bytes written from the queue so far */
+	unsigned long messages_sent;	/* messages written in full so far */
+	unsigned long writes;		/* system calls that wrote from the queue */
+
+	/* zero-copy sends; off while zerocopy_min is 0 */
+	size_t zerocopy_min;		/* shortest message sent without a copy */
+	struct outq *zerocopy;		/* a reference per send the kernel may still
+								 * be reading from, oldest first */
+	unsigned long zerocopy_sent;	/* zero-copy sends so far */
+	unsigned long zerocopy_copied;	/* of those, sends the kernel copied */
+};
+
+/* Prepares an empty queue; no memory is allocated until the first push */
+static inline void outq_init(struct outq *q)
+{
+	q->ring = NULL;
+	q->head = q->count = q->capacity = 0;
+	q->offset = 0;
+	q->busy = 0;
+	q->bytes_sent = q->messages_sent = q->writes = 0;
+	q->zerocopy_min = 0;
+	q->zerocopy = NULL;
+	q->zerocopy_sent = q->zerocopy_copied = 0;
+}
+
+/* Returns the i-th oldest message in the queue */
+static inline struct message *outq_at(const struct outq *q, unsigned int i)
+{
+	return q->ring[(q->head + i) & (q->capacity - 1)];
+}
+
+/* Makes room for one more message; returns 0 on failure and 1 on success */
+static inline int outq_reserve(struct outq *q)
+{
+	struct message **ring;
+	unsigned int capacity, i;
+
+	if (q->count == q->capacity) {
+		capacity = (q->capacity > 0) ? q->capacity * 2 : OUTQ_MIN_CAPACITY;
+
+		if ((ring = malloc(capacity * sizeof(struct message *))) == NULL) {
+			return 0;
+		}
+
+		/* Unwrap the old ring so the oldest message sits in slot 0 */
+		for (i = 0; i < q->count; i++) {
+			ring[i] = outq_at(q, i);
+		}
+
+		free(q->ring);
+		q->ring = ring;
+		q->head = 0;
+		q->capacity = capacity;
+	}
+
+	return 1;
+}
+
+/* Appends msg, taking over the caller's reference; returns 0 on failure and
+ * 1 on success */
+static inline int outq_push(struct outq *q, struct message *msg)
+{
+	if (!outq_reserve(q)) {
+		return 0;
+	}
+
+	q->ring[(q->head + q->count) & (q->capacity - 1)] = msg;
+	q->count++;
+
+	return 1;
+}
+
+/* Removes the head message, releasing the queue's reference */
+static inline void outq_pop(struct outq *q)
+{
+	message_release(q->ring[q->head]);
+	q->head = (q->head + 1) & (q->capacity - 1);
+	q->count--;
+	q->offset = 0;
+}
+
+/* Removes the head message and hands the queue's reference to the caller;
+ * the head must not have been partly written */
+static inline struct message *outq_take(struct outq *q)
+{
+	struct message *msg = q->ring[q->head];
+
+	q->head = (q->head + 1) & (q->capacity - 1);
+	q->count--;
+
+	return msg;
+}
+
+/* Drops the oldest message that has not been partly written nor handed to
+ * the kernel; returns 1 if a message was dropped and 0 if there was none to
+ * drop */
+static inline int outq_drop_oldest(struct outq *q)
+{
+	unsigned int victim, i;
+
+	/* A partly written head must be finished or the stream is corrupted */
+	victim = (q->offset > 0) ? 1 : 0;
+	if (victim < q->busy) {
+		victim = q->busy;
+	}
+
+	if (victim >= q->count) {
+		return 0;
+	}
+
+	message_release(outq_at(q, victim));
+
+	/* Close the gap by shifting the messages before the victim forward */
+	for (i = victim; i > 0; i--) {
+		q->ring[(q->head + i) & (q->capacity - 1)] = outq_at(q, i - 1);
+	}
+
+	q->head = (q->head + 1) & (q->capacity - 1);
+	q->count--;
+
+	return 1;
+}
+
+/* Records that len bytes from the front of the queue were written,
+ * retiring every message that went out in full */
+static inline void outq_advance(struct outq *q, size_t len)
+{
+	q->bytes_sent += len;
+
+	while ((q->count > 0) && (len >= outq_at(q, 0)->len - q->offset)) {
+		len -= outq_at(q, 0)->len - q->offset;
+		outq_pop(q);
+		q->messages_sent++;
+	}
+	q->offset += len;
+}
+
+/* Returns 1 if msg is to be sent with MSG_ZEROCOPY */
+static inline int outq_zerocopy_wanted(const struct outq *q,
+									   const struct message *msg)
+{
+	return (q->zerocopy_min > 0) && (msg->file_fd < 0) &&
+		(msg->len >= q->zerocopy_min);
+}
+
+/* Sends the rest of the head message, msg, with MSG_ZEROCOPY and keeps a
+ * reference to it until the kernel is done with it.  Returns what sendmsg
+ * returns; fails with ENOBUFS if the kernel will not pin more pages for the
+ * socket or no memory can be allocated */
+static inline ssize_t outq_send_zerocopy(struct outq *q, int fd,
+										 struct message *msg, size_t len)
+{
+	struct iovec iov = {msg->data + q->offset, len};
+	struct msghdr hdr = {.msg_iov = &iov, .msg_iovlen = 1};
+	ssize_t written;
+
+	if (q->zerocopy == NULL) {
+		if ((q->zerocopy = malloc(sizeof(struct outq))) == NULL) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		outq_init(q->zerocopy);
+	}
+
+	/* Make room for the reference first, since the send cannot be undone */
+	if (!outq_reserve(q->zerocopy)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if ((written = sendmsg(fd, &hdr, MSG_ZEROCOPY)) >= 0) {
+		outq_push(q->zerocopy, message_hold(msg));
+		q->zerocopy_sent++;
+	}
+
+	return written;
+}
+
+/* Releases the reference to every message whose zero-copy sends on fd the
+ * kernel has reported done; call when fd has something on its error queue.
+ * Returns the number of sends reported */
+static inline int outq_zerocopy_reap(struct outq *q, int fd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr hdr;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *err;
+	uint32_t done;
+	int reaped = 0;
+
+	if (q->zerocopy == NULL) {
+		return 0;
+	}
+
+	while (1) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &hdr, MSG_ERRQUEUE) < 0) {
+			break;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+			 cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+			if (!(((cmsg->cmsg_level == SOL_IP) &&
+				   (cmsg->cmsg_type == IP_RECVERR)) ||
+				  ((cmsg->cmsg_level == SOL_IPV6) &&
+				   (cmsg->cmsg_type == IPV6_RECVERR)))) {
+				continue;
+			}
+
+			err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if ((err->ee_errno != 0) ||
+				(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+				continue;
+			}
+
+			/* Sends ee_info to ee_data are done; the kernel numbers them
+			 * in order and reports them in order */
+			done = err->ee_data - err->ee_info + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				q->zerocopy_copied += done;
+			}
+
+			while ((done-- > 0) && (q->zerocopy->count > 0)) {
+				message_release(outq_take(q->zerocopy));
+				reaped++;
+			}
+		}
+	}
+
+	return reaped;
+}
+
+/* Writes as much of the queue to fd as the socket accepts without blocking;
+ * returns 1 once the queue is empty, 0 if the socket is full and -1 if the
+ * write failed */
+static inline int outq_flush(struct outq *q, int fd)
+{
+	struct iovec iov[OUTQ_MAX_IOV];
+	struct message *msg;
+	unsigned int i, n;
+	ssize_t written;
+	size_t offered;
+	off_t offset;
+	int full;
+
+	while (q->count > 0) {
+		msg = outq_at(q, 0);
+		offered = msg->len - q->offset;
+
+		/* A file range goes from the page cache to the socket directly */
+		if (msg->file_fd >= 0) {
+			offset = msg->file_offset + q->offset;
+			written = sendfile(fd, msg->file_fd, &offset, offered);
+		} else if (outq_zerocopy_wanted(q, msg) &&
+				   (((written = outq_send_zerocopy(q, fd, msg, offered)) >= 0) ||
+					(errno != ENOBUFS))) {
+			/* Sent without a copy, or failed for a reason a copy would not
+			 * have avoided either */
+		} else {
+
+			/* Gather as many queued messages as fit in one writev, up to the
+			 * next file range or zero-copy message */
+			n = (q->count < OUTQ_MAX_IOV) ? q->count : OUTQ_MAX_IOV;
+
+			iov[0].iov_base = msg->data + q->offset;
+			iov[0].iov_len = offered;
+			for (i = 1; i < n; i++) {
+				msg = outq_at(q, i);
+				if ((msg->file_fd >= 0) || outq_zerocopy_wanted(q, msg)) {
+					break;
+				}
+				iov[i].iov_base = msg->data;
+				iov[i].iov_len = msg->len;
+				offered += msg->len;
+			}
+
+			written = writev(fd, iov, i);
+		}
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+		}
+		q->writes++;
+
+		/* The socket took less than offered, so it must be full */
+		full = ((size_t)written < offered);
+
+		outq_advance(q, written);
+
+		if (full) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Releases every queued message and the ring itself, along with the
+ * messages held for zero-copy sends; the socket must be closed so that the
+ * kernel no longer reads them */
+static inline void outq_clear(struct outq *q)
+{
+	while (q->count > 0) {
+		outq_pop(q);
+	}
+
+	if (q->zerocopy != NULL) {
+		outq_clear(q->zerocopy);
+		free(q->zerocopy);
+	}
+
+	free(q->ring);
+	outq_init(q);
+}
+
+#endif
@@ -0,0 +1,260 @@
+/* protocol.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * The framing protocol spoken between the chatroom client and server.
+ *
+ * Every message travels as a frame: an eight byte header followed by a
+ * payload of any length up to FRAME_MAX_PAYLOAD.  Multi-byte fields are
+ * big-endian.
+ *
+ *     0         1         2                   4                    8
+ *     +---------+---------+-------------------+--------------------+--- -
+ *     | version |  type   |       flags       |   payload length   | ...
+ *     +---------+---------+-------------------+--------------------+--- -
+ *
+ * A frame with FRAME_FLAG_SEQ set starts its payload with the eight byte
+ * sequence number the server gave the message in its room's history.
+ *
+ * Since TCP may split or merge writes, a frame_parser collects whatever is
+ * read from a socket and hands back complete frames.  Bytes are read
+ * straight into the parser's buffer and frames point into that buffer, so
+ * a frame is never copied on its way in.
+ *
+ * */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PROTO_VERSION 1
+
+#define FRAME_HEADER_LEN 8
+#define FRAME_MAX_PAYLOAD (1 << 20)
+
+/* least amount of free space offered to each read into a parser */
+#define FRAME_READ_MIN 4096
+
+/* the payload starts with a sequence number */
+#define FRAME_FLAG_SEQ 0x0001
+#define FRAME_SEQ_LEN 8
+
+enum frame_type {
+	FRAME_HELLO = 1,	/* client to server: the client's name */
+	FRAME_MSG = 2,		/* a chat message; from the server "NAME says: MSG" */
+	FRAME_BYE = 3,		/* either side: the connection is about to close */
+	FRAME_PING = 4,		/* either side: asks the peer for a PONG */
+	FRAME_PONG = 5,		/* answer to a PING, echoing its payload */
+	FRAME_JOIN = 6,		/* client to server: move to the named room */
+	FRAME_LEAVE = 7,	/* client to server: go back to the lobby */
+	FRAME_REPLAY = 8	/* client to server: resend the room's messages after
+						 * the sequence number in the payload */
+};
+
+struct frame {
+	uint8_t version;
+	uint8_t type;
+	uint16_t flags;
+	uint32_t len;
+	char *payload;		/* valid until the parser is next read into */
+};
+
+struct frame_parser {
+	char *buf;
+	size_t capacity;
+	size_t start;		/* first byte not yet parsed */
+	size_t end;			/* one past the last byte read */
+};
+
+/* Fills in the header of a frame of the given type and payload length */
+static inline void frame_header_encode(char *header, uint8_t type,
+									   uint32_t len)
+{
+	header[0] = PROTO_VERSION;
+	header[1] = type;
+	header[2] = 0;
+	header[3] = 0;
+	header[4] = (len >> 24) & 0xff;
+	header[5] = (len >> 16) & 0xff;
+	header[6] = (len >> 8) & 0xff;
+	header[7] = len & 0xff;
+}
+
+/* Stores a 64-bit value big-endian */
+static inline void frame_put_u64(char *p, uint64_t value)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* Reads a big-endian 64-bit value */
+static inline uint64_t frame_get_u64(const char *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		value = (value << 8) | (uint8_t)p[i];
+	}
+
+	return value;
+}
+
+/* Writes a whole frame to a blocking descriptor; returns 0 on failure and 1
+ * on success */
+static inline int frame_write(int fd, uint8_t type, const char *payload,
+							  uint32_t len)
+{
+	char header[FRAME_HEADER_LEN];
+	struct iovec iov[2];
+	int n = 2;
+	ssize_t written;
+
+	frame_header_encode(header, type, len);
+	iov[0].iov_base = header;
+	iov[0].iov_len = FRAME_HEADER_LEN;
+	iov[1].iov_base = (char *)payload;
+	iov[1].iov_len = len;
+
+	/* Keep writing until the socket has taken the whole frame */
+	while (n > 0) {
+		if ((written = writev(fd, &iov[2 - n], n)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+
+		while ((n > 0) && ((size_t)written >= iov[2 - n].iov_len)) {
+			written -= iov[2 - n].iov_len;
+			n--;
+		}
+		if (n > 0) {
+			iov[2 - n].iov_base = (char *)iov[2 - n].iov_base + written;
+			iov[2 - n].iov_len -= written;
+		}
+	}
+
+	return 1;
+}
+
+/* Prepares an empty parser; no memory is allocated until the first read */
+static inline void frame_parser_init(struct frame_parser *p)
+{
+	p->buf = NULL;
+	p->capacity = p->start = p->end = 0;
+}
+
+/* Frees the parser's buffer */
+static inline void frame_parser_destroy(struct frame_parser *p)
+{
+	free(p->buf);
+	frame_parser_init(p);
+}
+
+/* Returns where the next read into the parser should go, storing the room
+ * available there in space.  Any partial frame is moved to the front of the
+ * buffer first, and the buffer grows to fit a large frame; returns NULL if
+ * no memory can be allocated */
+static inline char *frame_parser_space(struct frame_parser *p, size_t *space)
+{
+	size_t pending = p->end - p->start;
+	size_t needed = FRAME_READ_MIN;
+	size_t capacity;
+	char *grown;
+
+	/* Only the bytes left over from a partial frame need to move */
+	if ((pending > 0) && (p->capacity - p->end < FRAME_READ_MIN)) {
+		memmove(p->buf, p->buf + p->start, pending);
+	} else if (pending > 0) {
+		*space = p->capacity - p->end;
+		return p->buf + p->end;
+	}
+	p->start = 0;
+	p->end = pending;
+
+	/* A partial frame whose header has arrived says how much it needs */
+	if (pending >= FRAME_HEADER_LEN) {
+		needed = FRAME_HEADER_LEN +
+			(((uint32_t)(uint8_t)p->buf[4] << 24) |
+			 ((uint32_t)(uint8_t)p->buf[5] << 16) |
+			 ((uint32_t)(uint8_t)p->buf[6] << 8) |
+			 (uint32_t)(uint8_t)p->buf[7]);
+		if (needed < pending + FRAME_READ_MIN) {
+			needed = pending + FRAME_READ_MIN;
+		}
+	}
+
+	if (p->capacity < needed) {
+		capacity = (p->capacity > 0) ? p->capacity : FRAME_READ_MIN;
+		while (capacity < needed) {
+			capacity *= 2;
+		}
+		if ((grown = realloc(p->buf, capacity)) == NULL) {
+			return NULL;
+		}
+		p->buf = grown;
+		p->capacity = capacity;
+	}
+
+	*space = p->capacity - p->end;
+	return p->buf + p->end;
+}
+
+/* Records that n bytes were read into the space given by
+ * frame_parser_space */
+static inline void frame_parser_commit(struct frame_parser *p, size_t n)
+{
+	p->end += n;
+}
+
+/* Takes the next complete frame from the parser; returns 1 if a frame was
+ * stored in f, 0 if more bytes are needed and -1 if the stream is not valid
+ * (unknown version or oversized frame) */
+static inline int frame_parser_next(struct frame_parser *p, struct frame *f)
+{
+	const uint8_t *header = (const uint8_t *)p->buf + p->start;
+	size_t pending = p->end - p->start;
+	uint32_t len;
+
+	if (pending < FRAME_HEADER_LEN) {
+		return 0;
+	}
+
+	len = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+		  ((uint32_t)header[6] << 8) | (uint32_t)header[7];
+
+	if ((header[0] != PROTO_VERSION) || (len > FRAME_MAX_PAYLOAD)) {
+		return -1;
+	}
+
+	if (pending < FRAME_HEADER_LEN + (size_t)len) {
+		return 0;
+	}
+
+	f->version = header[0];
+	f->type = header[1];
+	f->flags = ((uint16_t)header[2] << 8) | header[3];
+	f->len = len;
+	f->payload = p->buf + p->start + FRAME_HEADER_LEN;
+
+	p->start += FRAME_HEADER_LEN + len;
+
+	/* Once everything is parsed, the next read can start from the front */
+	if (p->start == p->end) {
+		p->start = p->end = 0;
+	}
+
+	return 1;
+}
+
+#endif
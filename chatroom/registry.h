@@ -0,0 +1,173 @@
+/* registry.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A growable table of connected clients indexed by socket descriptor.
+ *
+ * Clients are kept in one dense array so that a broadcast walks contiguous
+ * memory, while a second array maps each descriptor to its slot in the dense
+ * array.  Adding appends to the dense array and removing moves the last
+ * entry into the freed slot, so insert, remove and lookup are all O(1).
+ * Both arrays double in size when they run out of room.
+ *
+ * */
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdlib.h>
+
+/* initial number of slots allocated for clients and descriptors */
+#define CLIENT_TABLE_MIN_CAPACITY 64
+
+struct client_entry {
+	int fd;
+	void *client;
+};
+
+struct client_table {
+	struct client_entry *entries;	/* dense array of connected clients */
+	int count;
+	int capacity;
+
+	int *slot_of_fd;				/* slot of each descriptor; -1 if unused */
+	int fd_capacity;
+
+	int max_clients;				/* 0 when the table is unbounded */
+};
+
+/* Grows array to hold at least needed elements of size bytes, doubling the
+ * current capacity; returns 0 on failure and 1 on success */
+static inline int client_table_grow(void **array, int *capacity, int needed,
+									size_t size)
+{
+	int new_capacity = (*capacity > 0) ? *capacity : CLIENT_TABLE_MIN_CAPACITY;
+	void *grown;
+
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+
+	if ((grown = realloc(*array, new_capacity * size)) == NULL) {
+		return 0;
+	}
+
+	*array = grown;
+	*capacity = new_capacity;
+
+	return 1;
+}
+
+/* Prepares an empty table holding at most max_clients clients (0 for no
+ * limit); returns 0 on failure and 1 on success */
+static inline int client_table_init(struct client_table *table, int max_clients)
+{
+	table->entries = NULL;
+	table->count = 0;
+	table->capacity = 0;
+	table->slot_of_fd = NULL;
+	table->fd_capacity = 0;
+	table->max_clients = max_clients;
+
+	return client_table_grow((void **)&table->entries, &table->capacity, 0,
+							 sizeof(struct client_entry));
+}
+
+/* Frees the arrays owned by the table; the clients themselves are left
+ * alone */
+static inline void client_table_destroy(struct client_table *table)
+{
+	free(table->entries);
+	free(table->slot_of_fd);
+	table->entries = NULL;
+	table->slot_of_fd = NULL;
+	table->count = table->capacity = table->fd_capacity = 0;
+}
+
+/* Returns 1 if the table cannot take another client */
+static inline int client_table_full(const struct client_table *table)
+{
+	return (table->max_clients > 0) && (table->count >= table->max_clients);
+}
+
+/* Returns the client registered under fd, or NULL if there is none */
+static inline void *client_table_lookup(const struct client_table *table,
+										int fd)
+{
+	int slot;
+
+	if ((fd < 0) || (fd >= table->fd_capacity)) {
+		return NULL;
+	}
+
+	slot = table->slot_of_fd[fd];
+
+	return (slot < 0) ? NULL : table->entries[slot].client;
+}
+
+/* Registers client under fd; returns 0 on failure (table full, descriptor in
+ * use or out of memory) and 1 on success */
+static inline int client_table_add(struct client_table *table, int fd,
+								   void *client)
+{
+	int old_capacity = table->fd_capacity;
+	int i;
+
+	if ((fd < 0) || client_table_full(table)) {
+		return 0;
+	}
+
+	/* Make room for the descriptor, marking all new descriptors unused */
+	if (fd >= table->fd_capacity) {
+		if (!client_table_grow((void **)&table->slot_of_fd,
+							   &table->fd_capacity, fd + 1, sizeof(int))) {
+			return 0;
+		}
+		for (i = old_capacity; i < table->fd_capacity; i++) {
+			table->slot_of_fd[i] = -1;
+		}
+	}
+
+	if (table->slot_of_fd[fd] >= 0) {
+		return 0;
+	}
+
+	if (table->count == table->capacity) {
+		if (!client_table_grow((void **)&table->entries, &table->capacity,
+							   table->count + 1, sizeof(struct client_entry))) {
+			return 0;
+		}
+	}
+
+	table->entries[table->count].fd = fd;
+	table->entries[table->count].client = client;
+	table->slot_of_fd[fd] = table->count;
+	table->count++;
+
+	return 1;
+}
+
+/* Unregisters the client under fd by moving the last client into its slot;
+ * returns the removed client, or NULL if fd was not registered */
+static inline void *client_table_remove(struct client_table *table, int fd)
+{
+	struct client_entry *last;
+	void *client;
+	int slot;
+
+	if ((fd < 0) || (fd >= table->fd_capacity) ||
+		((slot = table->slot_of_fd[fd]) < 0)) {
+		return NULL;
+	}
+
+	client = table->entries[slot].client;
+	last = &table->entries[table->count - 1];
+
+	table->entries[slot] = *last;
+	table->slot_of_fd[last->fd] = slot;
+	table->slot_of_fd[fd] = -1;
+	table->count--;
+
+	return client;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/* rooms.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Named chat rooms and the index of who is in each.
+ *
+ * A room_table gives every room name a small, stable id.  Names are only
+ * looked up when a client joins a room, so the table is a simple hash table
+ * behind one mutex; rooms are never removed, which keeps ids valid for
+ * messages still in flight.
+ *
+ * A room_members list holds the members of one room in a dense array, so a
+ * broadcast to the room walks contiguous memory and touches only the
+ * room's members.  Each member remembers its slot in the array so that
+ * leaving moves the last member into it, as in registry.h.
+ *
+ * */
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ROOM_NAME_LEN 32
+
+/* number of hash buckets; a power of two */
+#define ROOM_BUCKETS 1024
+
+/* initial number of slots in a member list */
+#define ROOM_MIN_CAPACITY 8
+
+struct room {
+	int id;
+	char name[ROOM_NAME_LEN];
+	struct room *next;				/* next room in the same bucket */
+};
+
+struct room_table {
+	pthread_mutex_t lock;
+	struct room *buckets[ROOM_BUCKETS];
+	int count;
+	int max_rooms;
+};
+
+/* One room's members on one thread */
+struct room_members {
+	void **members;
+	int count;
+	int capacity;
+};
+
+/* Returns the bucket of the room called name */
+static inline unsigned int room_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	/* FNV-1a */
+	while (*name != '\0') {
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	}
+
+	return hash & (ROOM_BUCKETS - 1);
+}
+
+/* Prepares an empty table holding at most max_rooms rooms; returns 0 on
+ * failure and 1 on success */
+static inline int room_table_init(struct room_table *table, int max_rooms)
+{
+	memset(table->buckets, 0, sizeof(table->buckets));
+	table->count = 0;
+	table->max_rooms = max_rooms;
+
+	return (pthread_mutex_init(&table->lock, NULL) == 0);
+}
+
+/* Returns the id of the room called name, creating the room if it does not
+ * exist yet; returns -1 if the table is full or out of memory */
+static inline int room_table_get(struct room_table *table, const char *name)
+{
+	unsigned int bucket = room_hash(name);
+	struct room *room;
+	int id = -1;
+
+	pthread_mutex_lock(&table->lock);
+
+	for (room = table->buckets[bucket]; room != NULL; room = room->next) {
+		if (strcmp(room->name, name) == 0) {
+			id = room->id;
+			break;
+		}
+	}
+
+	if ((room == NULL) && (table->count < table->max_rooms) &&
+		((room = malloc(sizeof(struct room))) != NULL)) {
+		room->id = id = table->count++;
+		strncpy(room->name, name, ROOM_NAME_LEN - 1);
+		room->name[ROOM_NAME_LEN - 1] = '\0';
+		room->next = table->buckets[bucket];
+		table->buckets[bucket] = room;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+
+	return id;
+}
+
+/* Appends member to the list and stores its slot; returns 0 on failure and
+ * 1 on success */
+static inline int room_members_add(struct room_members *room, void *member,
+								   int *slot)
+{
+	void **grown;
+	int capacity;
+
+	if (room->count == room->capacity) {
+		capacity = (room->capacity > 0) ? room->capacity * 2 : ROOM_MIN_CAPACITY;
+
+		if ((grown = realloc(room->members, capacity * sizeof(void *))) == NULL) {
+			return 0;
+		}
+
+		room->members = grown;
+		room->capacity = capacity;
+	}
+
+	*slot = room->count;
+	room->members[room->count++] = member;
+
+	return 1;
+}
+
+/* Removes the member in slot by moving the last member into it; returns the
+ * member moved, whose slot is now slot, or NULL if the removed member was
+ * the last */
+static inline void *room_members_remove(struct room_members *room, int slot)
+{
+	room->count--;
+
+	if (slot == room->count) {
+		return NULL;
+	}
+
+	room->members[slot] = room->members[room->count];
+
+	return room->members[slot];
+}
+
+#endif
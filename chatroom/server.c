@@ -1,300 +1,2476 @@
 /* server.c
  * Author: Dickson Wong
  * Last Updated: Jan 1, 2018
- * 
- * A simple server using socket that establishes connections with up to 
- * four clients and receives messages.  Server will write the messages to the 
- * other clients connected to the server.  The HOST_NAME of this server
- * will be localhost.
- * 
- * Usage: ./server.exe PORT_NO SERVER_NAME
- * 
+ *
+ * A simple server using socket that establishes connections with any number
+ * of clients (or up to MAX_CLIENTS when given) and receives messages.  Server
+ * will write the messages to the other clients connected to the server.  The
+ * HOST_NAME of this server will be localhost.
+ *
+ * The listening socket and every client socket are non-blocking and are
+ * served by a single edge-triggered epoll loop; each client is a small state
+ * machine (waiting for its name, then chatting) that handle_client advances
+ * whenever its socket becomes readable.  Clients and server exchange the
+ * length-prefixed frames described in protocol.h.
+ *
+ * Clients are kept in a table indexed by socket descriptor (see registry.h)
+ * so that joins and leaves cost the same however many clients are connected.
+ *
+ * Every client is in one room at a time, starting in the lobby, and moves
+ * with JOIN and LEAVE frames.  Each shard keeps the members of each room in
+ * a dense list (see rooms.h), so a message is handed only to the members of
+ * its sender's room and only to shards with members there.
+ *
+ * With -H HISTORY_DIR every room's messages are also appended to a log in
+ * that directory (see history.h) and numbered.  A client entering a room
+ * is sent its last REPLAY_COUNT messages, and a REPLAY frame asks for all
+ * of them after a given number; replays go out with sendfile straight from
+ * the log.
+ *
+ * Messages are never written to a client with a blocking call.  Whatever a
+ * client cannot take immediately waits in its outbound queue (see message.h)
+ * until its socket becomes writable.  A queue may hold at most QUEUE_LIMIT
+ * messages; when a client falls further behind, POLICY decides whether to
+ * drop its oldest message ("drop", the default), disconnect it
+ * ("disconnect") or stop reading from senders until it catches up ("pause").
+ *
+ * With -s SHARDS the server runs that many shards (one per core when SHARDS
+ * is 0), each a thread pinned to its own core with its own SO_REUSEPORT
+ * listening socket, epoll loop and slice of the clients, so the kernel
+ * spreads new connections across them.  A broadcast is delivered to the
+ * sender's own shard directly and posted to every other shard through that
+ * shard's inbox: one lock-free single-producer ring per sending shard.
+ * Each shard also publishes how many members it has in each room, replaced
+ * as a whole at the end of any round in which clients joined or left, so
+ * other shards read the counts without locks (see rcu.h) and skip shards
+ * with no one to deliver to.
+ *
+ * With -b uring each shard drives its sockets through io_uring instead of
+ * epoll (see uring.h): one multishot accept per listener, multishot
+ * receives into a shared ring of provided buffers, and sendmsg requests for
+ * every client with queued messages, all submitted together with a single
+ * io_uring_enter per round.  Since a client's messages go out when the
+ * round's sends complete rather than as they are queued, a burst within one
+ * round counts against QUEUE_LIMIT in full; give bursty rooms a larger -q.
+ * If the kernel lacks what the backend needs (multishot receives arrived in
+ * Linux 6.0), the server says so and falls back to epoll.
+ *
+ * Shards never print: they log through log.h, which queues each line on a
+ * ring of the shard's own and leaves the writing to a background thread.
+ * Debug lines, such as one per read, are only kept when built with
+ * -DLOG_LEVEL=LOG_DEBUG.
+ *
+ * With -A ADMIN_SOCKET the server answers on a Unix socket at that path
+ * with its counters, the time from reading each chat message to writing it
+ * to the last member of its room, and a line about every client (see
+ * metrics.h); send "json" for JSON instead of text.  Counters are kept per
+ * shard and only summed when read, and the shards report their own clients
+ * when asked, so keeping the metrics takes no locks on the hot path.
+ *
+ * With -C WINDOW_US[,MESSAGES] a client's outbound queue is corked: a
+ * message queued for a client with nothing waiting starts a window of
+ * WINDOW_US microseconds, and whatever is queued by the time it closes, or
+ * as soon as MESSAGES (OUTQ_MAX_IOV by default) are waiting, goes out in one
+ * writev or sendmsg.  Bursts then cost one system call and a few packets per
+ * recipient instead of one per message, for at most WINDOW_US more latency.
+ * Each shard keeps its corked clients in the order they were corked and one
+ * timerfd set to the oldest one's deadline.
+ *
+ * With -Z MIN_BYTES messages of at least MIN_BYTES are sent with
+ * MSG_ZEROCOPY, straight from the one shared copy, and each recipient's
+ * queue holds on to the message until the socket's error queue says the
+ * kernel is done with it (see message.h).  Pinning pages costs more than
+ * copying a small message, so MIN_BYTES should be some kilobytes.  Over
+ * loopback the kernel still copies once per recipient, on delivery.  The
+ * io_uring backend always copies.
+ *
+ * No connection is kept forever (see -T).  A client must send its HELLO
+ * within HANDSHAKE_S seconds of connecting; one that has sent nothing for
+ * IDLE_S seconds is sent a PING, and is disconnected if it stays silent
+ * for as long again; and one whose queue has not moved for STALL_S
+ * seconds is taken to have stopped reading and is disconnected.  Each
+ * client has one timer, on a hashed timer wheel of its shard's (see
+ * timerwheel.h), set for the earliest deadline that applies to it.  Reads
+ * and writes only note the time: when the timer goes off the deadlines are
+ * worked out afresh, and the timer is set again if none has passed.  So
+ * the busy path never touches the wheel, and keeping deadlines on even a
+ * great many clients costs a few timers firing per tick.
+ *
+ * Usage: ./server.exe [-m MAX_CLIENTS] [-q QUEUE_LIMIT] [-p POLICY]
+ *                     [-s SHARDS] [-b epoll|uring] [-H HISTORY_DIR]
+ *                     [-n REPLAY_COUNT] [-A ADMIN_SOCKET]
+ *                     [-C WINDOW_US[,MESSAGES]] [-Z MIN_BYTES]
+ *                     [-T IDLE_S[,HANDSHAKE_S[,STALL_S]]]
+ *                     PORT_NO SERVER_NAME
+ *
  * */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
-#define BUFFER_LEN 256
-#define MESSAGE_LEN (BUFFER_LEN - 1)
-#define MAX_CLIENTS 4
+#include "registry.h"
+#include "message.h"
+#include "uring.h"
+#include "rooms.h"
+#include "history.h"
+#include "../common/ring.h"
+#include "../common/rcu.h"
+#include "../common/log.h"
+#include "../common/metrics.h"
+#include "../common/pool.h"
+#include "../common/timerwheel.h"
 
 /* maximum length of client name */
 #define CLI_NAME_LEN 30
 
-/* number of characters in .DISCONNECT */
-#define EXIT_MESSAGE_LEN 11
+/* maximum number of events handled per call to epoll_wait */
+#define MAX_EVENTS 64
+
+/* most rooms that can ever be created; room 0 is the lobby */
+#define MAX_ROOMS 4096
+#define LOBBY 0
+
+/* default number of messages a client may have waiting to be written */
+#define DEFAULT_QUEUE_LIMIT 256
+
+/* number of messages each shard's inbox can hold from each other shard */
+#define INBOX_LEN 4096
+
+/* size of each shard's io_uring and of its pool of receive buffers */
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 1024
+#define URING_BUF_LEN 4096
+#define URING_BUF_GROUP 0
+
+/* maximum number of messages sent by one io_uring sendmsg; large enough to
+ * take a client's whole default queue at once */
+#define URING_MAX_IOV 256
+
+/* number of messages replayed to a client entering a room */
+#define DEFAULT_REPLAY_COUNT 20
+
+/* how long the admin socket waits for the shards to report their clients */
+#define REPORT_TIMEOUT_MS 1000
+
+/* seconds a client may stay silent before it is sent a PING, take to send
+ * its HELLO, and leave its queue unwritten, unless -T says otherwise */
+#define DEFAULT_IDLE_S 60
+#define DEFAULT_HANDSHAKE_S 10
+#define DEFAULT_STALL_S 30
+
+/* length of a tick of each shard's timer wheel, and number of slots; the
+ * wheel turns once every 102 seconds */
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 1024
+
+#define USAGE "usage: server [-m MAX_CLIENTS] [-q QUEUE_LIMIT] " \
+	"[-p drop|disconnect|pause] [-s SHARDS] [-b epoll|uring] " \
+	"[-H HISTORY_DIR] [-n REPLAY_COUNT] [-A ADMIN_SOCKET] " \
+	"[-C WINDOW_US[,MESSAGES]] [-Z MIN_BYTES] " \
+	"[-T IDLE_S[,HANDSHAKE_S[,STALL_S]]] PORT_NO SERVER_NAME\n"
+
+/* Ways of waiting for and performing socket I/O */
+enum backend {
+	BACKEND_EPOLL,		/* readiness through epoll, non-blocking calls */
+	BACKEND_URING		/* requests and completions through io_uring */
+};
+
+/* What the server counts (see metrics.h), named as on the admin socket */
+enum counter {
+	BYTES_IN,
+	BYTES_OUT,
+	MESSAGES_IN,			/* chat messages received */
+	MESSAGES_OUT,			/* messages written to clients in full */
+	MESSAGES_DROPPED,		/* messages dropped for slow clients */
+	WRITES,					/* system calls writing to clients */
+	ZEROCOPY_SENDS,			/* writes sent with MSG_ZEROCOPY */
+	ZEROCOPY_COPIED,		/* of those, writes the kernel copied anyway */
+	CLIENTS_ACCEPTED,
+	CLIENTS_REJECTED,		/* connections refused while the server is full */
+	CLIENTS_DISCONNECTED,
+	CLIENTS_TIMED_OUT,		/* of those, clients that missed a deadline */
+	PINGS_SENT,				/* PINGs sent to silent clients */
+	NUM_COUNTERS
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+	"bytes_in", "bytes_out", "messages_in", "messages_out",
+	"messages_dropped", "writes", "zerocopy_sends", "zerocopy_copied",
+	"clients_accepted", "clients_rejected",
+	"clients_disconnected", "clients_timed_out", "pings_sent"
+};
+
+/* Time from reading a chat message to writing it to the last member of its
+ * room, in nanoseconds */
+enum histogram {
+	DELIVERY_LATENCY,
+	NUM_HISTOGRAMS
+};
+
+static const char *histogram_names[NUM_HISTOGRAMS] = {
+	"delivery_latency_ns"
+};
+
+/* Kinds of io_uring request, kept in the low bits of each request's
+ * user_data next to the client or shard it belongs to */
+enum uring_op {
+	URING_RECV,
+	URING_SEND,
+	URING_ACCEPT,
+	URING_WAKE,
+	URING_CANCEL,
+	URING_CORK,
+	URING_TICK
+};
+
+#define URING_OP_MASK 7
+
+/* A sendmsg request in flight; the kernel reads it until it completes */
+struct uring_send {
+	struct msghdr msg;
+	struct iovec iov[URING_MAX_IOV];
+};
+
+/* A thread serving its own listening socket and its own clients */
+struct shard {
+	_Alignas(RING_CACHE_LINE) int index;
+	pthread_t thread;
+
+	int epoll_fd;
+	struct uring ring;					/* used instead of epoll_fd with
+										 * the io_uring backend */
+	int listen_fd;
+	int wake_fd;						/* eventfd written when posting here */
+	int cork_fd;						/* timerfd set to the oldest corked
+										 * client's deadline */
+	int tick_fd;						/* timerfd going off every tick of
+										 * the timer wheel */
+	uint64_t now;						/* time the round started */
+	struct timer_wheel timers;			/* every client's deadlines */
+
+	/* table of this shard's clients, indexed by socket descriptor */
+	struct client_table clients;
+
+	/* clients that have been closed and are waiting to be removed, and
+	 * senders whose input is not being read */
+	struct client_node *closed_clients;
+	struct client_node *paused_clients;
+
+	/* clients whose queues are held back, oldest first, and whether the
+	 * timer is set */
+	struct client_node *corked_head, *corked_tail;
+	int cork_armed;
+
+	struct spsc_ring *inbox;			/* messages from each other shard */
+	struct outq *backlog;				/* messages to each shard that did not
+										 * fit in its inbox yet */
+	int *wake;							/* shards posted to this round */
 
+	/* members of each room on this shard, indexed by room id */
+	struct room_members *rooms;
+	int num_rooms;
+
+	/* room counts as published to the other shards, whether they are out
+	 * of date, and the counts they replaced */
+	struct members *members;
+	int members_changed;
+	struct rcu_garbage garbage;
+
+	/* the admin socket's request for a report on the shard's clients (1 for
+	 * text, 2 for JSON), the report once written and the number of
+	 * messages queued for the shard's clients when it was */
+	int report_wanted;
+	char *report;
+	unsigned long report_queued;
+};
+
+static struct shard *shards;
+static int num_shards = 1;
+static enum backend backend = BACKEND_EPOLL;
+
+/* every shard reads the others' published room counts; each reports
+ * itself quiescent once per round */
+static struct rcu_domain rcu;
+
+/* every room ever joined, by name */
+static struct room_table rooms;
+
+/* each room's message history, kept when a directory is given with -H */
+static struct history history;
+static int keep_history = 0;
+static int replay_count = DEFAULT_REPLAY_COUNT;
+
+/* limit on and number of clients across all shards, and the last id given
+ * to a client */
+static int max_clients = 0;
 static int num_clients = 0;
-static struct client_node *head;
 static int current_id = 0;
 
-/* mutex controlling access to table of clients (and number of clients) */
-pthread_mutex_t client_table_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Ways of dealing with a client whose outbound queue is full */
+enum slow_policy {
+	SLOW_DROP_OLDEST,	/* drop the client's oldest queued message */
+	SLOW_DISCONNECT,	/* disconnect the client */
+	SLOW_PAUSE_SENDER	/* stop reading senders until the client catches up */
+};
+
+static enum slow_policy slow_policy = SLOW_DROP_OLDEST;
+static unsigned int queue_limit = DEFAULT_QUEUE_LIMIT;
+
+/* how long, in nanoseconds, and up to how many messages a client's queue is
+ * held back to be written at once; no holding back with a window of 0 */
+static uint64_t cork_window = 0;
+static unsigned int cork_messages = OUTQ_MAX_IOV;
+
+/* shortest message sent with MSG_ZEROCOPY; 0 to always copy */
+static size_t zerocopy_min = 0;
 
-/* mutex controlling read/write to a client at any time */
-pthread_mutex_t client_serve_lock = PTHREAD_MUTEX_INITIALIZER;
+/* how long, in nanoseconds, a client may stay silent before it is sent a
+ * PING, take to send its HELLO, and leave its queue unwritten; 0 for no
+ * limit.  Clients are timed if any is set */
+static uint64_t idle_timeout = DEFAULT_IDLE_S * 1000000000ULL;
+static uint64_t handshake_timeout = DEFAULT_HANDSHAKE_S * 1000000000ULL;
+static uint64_t stall_timeout = DEFAULT_STALL_S * 1000000000ULL;
+static int timing = 1;
+
+/* number of clients on any shard whose queues are over the limit and
+ * holding senders back */
+static int stalled_clients = 0;
+
+/* States a client moves through over the lifetime of its connection */
+enum client_state {
+	CLIENT_AWAIT_NAME,	/* connected; waiting for the client's HELLO */
+	CLIENT_CHATTING,	/* named; every MSG frame is broadcast */
+	CLIENT_CLOSED		/* disconnected; waiting to be removed */
+};
 
 struct client_node {
 	int id;
 	int sock_fd;
+	struct shard *shard;
+	enum client_state state;
 	char name[CLI_NAME_LEN];
-	struct client_node *next;
+	int room;						/* room the client is in; -1 if none */
+	int room_slot;					/* slot in the room's member list */
+	uint64_t replayed;				/* last message of the room replayed */
+
+	struct frame_parser input;		/* bytes read but not yet handled */
+	struct outq outq;				/* messages waiting to be written */
+	unsigned long dropped;			/* messages dropped for being too slow */
+	unsigned long bytes_in;
+	unsigned long messages_in;
+	uint64_t read_at;				/* time of the last read, for latency
+									 * and the idle deadline */
+	uint64_t connected_at;
+	uint64_t progress_at;			/* time the queue last started or moved */
+	uint64_t pinged_at;				/* time of the last PING sent */
+	struct timer timer;				/* set for the earliest deadline */
+	int stalled;					/* queue is over the limit */
+	int paused;						/* input is not being read */
+	int corked;						/* queue is held back until cork_deadline */
+	int cork_listed;				/* on the shard's corked list */
+	uint64_t cork_deadline;
+	struct client_node *next_closed;
+	struct client_node *next_paused;
+	struct client_node *next_corked;
+
+	/* io_uring backend only */
+	int uring_ops;					/* requests in flight for the client */
+	int recv_armed;					/* a multishot receive is in flight */
+	int removed;					/* out of the table; freed once no
+									 * request is in flight */
+	struct uring_send *send;		/* sendmsg in flight, if any */
+};
+
+/* How many members a shard has in each room at one point in time.  The
+ * counts are never changed once published; joins and leaves publish new
+ * ones at the end of the round, and the old ones are freed once no shard
+ * can still be reading them */
+struct members {
+	struct rcu_head rcu;
+	int num_rooms;
+	int room_counts[];				/* members in each room, by room id */
 };
 
-/* Add a client to the list; returns 0 on failure and 1 on success */
-int add_client(struct client_node *new_client) 
+/* Client nodes and their io_uring send state come from pools, so clients
+ * coming and going do not call malloc */
+static struct pool client_pool = POOL_INITIALIZER(sizeof(struct client_node));
+static struct pool send_pool = POOL_INITIALIZER(sizeof(struct uring_send));
+
+/* Add a client to its shard's table; returns 0 on failure and 1 on
+ * success */
+int add_client(struct client_node *new_client)
+{
+	return client_table_add(&new_client->shard->clients, new_client->sock_fd,
+							new_client);
+}
+
+/* Closes the client's socket and frees everything it holds */
+void free_client(struct client_node *cli_node)
+{
+	static const struct linger abort_linger = {1, 0};
+
+	/* Data the kernel may still be reading from a message about to be
+	 * released is discarded rather than sent */
+	if ((cli_node->outq.zerocopy != NULL) &&
+		(cli_node->outq.zerocopy->count > 0)) {
+		setsockopt(cli_node->sock_fd, SOL_SOCKET, SO_LINGER, &abort_linger,
+				   sizeof(abort_linger));
+	}
+
+	/* Closing the socket also removes it from the epoll set */
+	close(cli_node->sock_fd);
+	frame_parser_destroy(&cli_node->input);
+	outq_clear(&cli_node->outq);
+	if (cli_node->send != NULL) {
+		pool_free(&send_pool, cli_node->send);
+	}
+
+	/* Return the node to be removed to the pool */
+	pool_free(&client_pool, cli_node);
+}
+
+/* Remove a client from the shard's table given its socket, closing the
+ * socket; returns 0 on failure and 1 success */
+int remove_client(struct shard *shard, int sock_fd)
 {
-	if (num_clients >= MAX_CLIENTS) {
+	struct client_node *current;
+
+	/* If no client is registered under sock_fd, there is nothing to remove */
+	if ((current = client_table_remove(&shard->clients, sock_fd)) == NULL) {
 		return 0;
 	}
-	
-	/* If no node at head of list, then make new client node the head */
-	if (head == NULL) {
-		head = new_client;
-		num_clients++;
+
+	__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+	timer_cancel(&shard->timers, &current->timer);
+
+	/* The kernel may still be using a client with io_uring requests in
+	 * flight; shutting the socket down makes them all complete, and the last
+	 * completion frees the client */
+	if (current->uring_ops > 0) {
+		current->removed = 1;
+		shutdown(current->sock_fd, SHUT_RDWR);
 		return 1;
 	}
-	
-	struct client_node *current = head;
-	int i = 0;
-	
-	/* Locate the end of the list and add the new client */
-	while ((current->next) != NULL) {
-		current = current->next;
 
-	}
-	current->next = new_client;
-	
-	num_clients++;
-	
+	free_client(current);
+
 	return 1;
 }
 
-/* Remove a client from the list given the id; returns 0 on failure and 1 success */
-int remove_client(int id)
+/* Puts the socket into non-blocking mode; returns 0 on failure and 1 on
+ * success */
+int set_nonblocking(int fd)
 {
-	int rc = 0;
-	
-	/* If head is NULL for any reason, then id could not be found */
-	if (head == NULL) {
-		return rc;
-	}
-	
-	struct client_node *prev = NULL;
-	struct client_node *current = head;
-	
-	/* Find the node whose id matches the given id */
-	while ((current != NULL) && (current->id  != id)) {
-		prev = current;
-		current = current->next;
-	}
-		
-	/* If current is NULL, then node with given id doesn't exist */
-	if (current == NULL) {
-		return rc;
-	}
-	
-	/* If prev was NULL, then node to be removed is head; otherwise, 
-	 * join prev and current.next */
-	if (prev == NULL) {
-		head = head->next;
-	} else {
-		prev->next = current->next;
-	}
-	
-	/* Free the memory allocated for the node to be removed */
-	free(current);
-	
-	/* Decrease the number of clients connect */
-	num_clients--;
-	
-	return 1;
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+		return 0;
+	}
+
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
 }
-	
-/* Clears the buffer by replacing all characters by zeros */
-void clear_buffer(char *buffer) 
-{
-	bzero((char *) buffer, BUFFER_LEN);
-}
-
-/* Write message to all clients, given message from specified client */
-void write_to_clients(char *name, char *msg) {
-	struct client_node *current = head;
-	int i = 0;
-	
-	while (current != NULL) {
-		write(current->sock_fd, name, strlen(name));
-		write(current->sock_fd, " says: ", 7);
-		write(current->sock_fd, msg, strlen(msg));
-		write(current->sock_fd, "\n", 2);
-		current = current->next;
-	}
-}
-
-/* Interface with the client as specified in args; prints all messages
- * received from client; return 0 upon disconnection; on any instance of
- * error occuring, return -1 */
-void *handle_client(void *args) {
-	char buffer[BUFFER_LEN];
-	clear_buffer(buffer);
-	
-	struct client_node cli_node = *(struct client_node *)args;
-	struct client_node *current = head;
-	int n;
-	int client_connected = 1;
-	int i = 0;
-	
-	/* Wait for the client to identify their name; if no name is received or
-	 * client disconnects, then disconnect the client */
-	if ((n = read(cli_node.sock_fd, cli_node.name, CLI_NAME_LEN)) <= 0) {
-		printf("Client did not identify themselves; disconnecting client...\n");
-		client_connected = 0;
-	}
-	
-	/* While the client is connected, read messages and print on server. */
-	while (client_connected) {
-		n = read(cli_node.sock_fd, buffer, MESSAGE_LEN);
-		printf("%d bytes were read\n", n);
-		
-		/* User must have disconnected */
-		if ((n <= 0) || (strncmp(buffer, ".DISCONNECT", EXIT_MESSAGE_LEN) == 0)) {
-			client_connected = 0;
-		} else {
-			
-			/* lock serve_client lock */
-			pthread_mutex_lock(&client_serve_lock);
 
-			/* Print message from client */
-			printf("%s says: %s\n", cli_node.name, buffer);
-			
-			/* Write to all clients */
-			write_to_clients(cli_node.name, buffer);
-			
-			/* unlock serve client lock */
-			pthread_mutex_unlock(&client_serve_lock);
-			
-			clear_buffer(buffer);
-
-		}
-    }
-    
-    // REMOVE CLIENT
-    
-    /* Lock the table of clients */
-    printf("Removing client with id %d; locking table\n", cli_node.id);
-    pthread_mutex_lock(&client_table_lock);
-    
-    /* Remove client node from the list */
-    printf("ending connection with: %d\n", cli_node.id);
-    printf("result : %d\n", remove_client(cli_node.id));
-    
-   	/* Unlock the table of clients */
-	printf("succesfully removed; unlocking table\n");
-	pthread_mutex_unlock(&client_table_lock);
-}
-
-/* Attempts to create a new connection and adds it to the list of clients
- * being served.  If a new connection cannot be made, return 0; otherwise,
- * upon client's disconnection, return 1 */
-int handle_new_connection(int sockfd) 
-{
-	int cli_sockfd, cli_len;
-	int rc = 0;
-	struct client_node *cli_node;
-	
-    struct sockaddr_in cli_addr;
-    pthread_t cli_thread;
-    
-    /* Attempt to accept a new connection */
-    cli_sockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &cli_len);
-    if (cli_sockfd < 0) {
-		printf("handle_new_connection: error on accept\n");
-		return rc;
-	}
-	
-	if (num_clients >= MAX_CLIENTS) {
-		return rc;
-	}
-	
-	printf("Locking table and adding new client\n");
-	/* Lock the table of clients */
-	pthread_mutex_lock(&client_table_lock);
-	
-	/* Create new client node and add new client information */
-	cli_node = malloc(sizeof(struct client_node));
-	
-	/* Exit if no memory can be allocated */
-	if (cli_node == NULL) {
-		printf("handle_new_connection: malloc failed\n");
-		return rc;
+/* Wakes the shard's loop if it is waiting for events */
+void wake_shard(struct shard *shard)
+{
+	uint64_t one = 1;
+
+	if (write(shard->wake_fd, &one, sizeof(one)) < 0) {
+		/* The counter is already non-zero, so the shard will wake anyway */
 	}
-	
-	current_id++;
-	cli_node->id = current_id;
-	cli_node->sock_fd = cli_sockfd;
-	cli_node->next = NULL;
-	
-	/* Attempt to add a new client to the table */
-	if (add_client(cli_node) > 0) {
-		
-		/* Spawn another thread to handle the client */
-		pthread_create(&cli_thread, NULL, (void *)handle_client, (void *)cli_node);
-		//detach
-		rc = 1;
-	}
-			
-	printf("handle_new_connection; rc value: %d\n", rc);
-	/* Unlock the table lock */
-	pthread_mutex_unlock(&client_table_lock);
-		
-	return rc;	
-}
-	
-int main(int argc, char *argv[])
+}
+
+/* Marks the client as closed; it is removed once the current round of
+ * events has been handled, so that tables being walked stay intact */
+void close_client(struct client_node *cli_node)
 {
-	int sockfd, port_number;
-    struct sockaddr_in serv_addr;
-    
-	/* Check that both a name and a port number are provided */
-	if (argc < 3) {
-		printf("usage: server PORT_NO SERVER_NAME\n");
+	if (cli_node->state != CLIENT_CLOSED) {
+		cli_node->state = CLIENT_CLOSED;
+		cli_node->next_closed = cli_node->shard->closed_clients;
+		cli_node->shard->closed_clients = cli_node;
+	}
+}
+
+/* Returns the user_data identifying a request of type op for ptr */
+uint64_t uring_tag(void *ptr, enum uring_op op)
+{
+	return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/* Starts a multishot receive into the shard's provided buffers */
+void uring_arm_recv(struct client_node *cli_node)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&cli_node->shard->ring)) == NULL) {
+		close_client(cli_node);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cli_node->sock_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = uring_tag(cli_node, URING_RECV);
+
+	cli_node->recv_armed = 1;
+	cli_node->uring_ops++;
+}
+
+/* Cancels the client's multishot receive so that its input stops being
+ * read */
+void uring_cancel_recv(struct client_node *cli_node)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&cli_node->shard->ring)) == NULL) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = uring_tag(cli_node, URING_RECV);
+	sqe->user_data = uring_tag(NULL, URING_CANCEL);
+}
+
+/* Sends the front of the client's queue with one sendmsg, unless a send is
+ * already in flight; the rest goes out when it completes */
+void uring_send(struct client_node *cli_node)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_send *send;
+	struct message *msg;
+	unsigned int i, n;
+
+	if ((cli_node->state == CLIENT_CLOSED) || (cli_node->outq.count == 0) ||
+		((send = cli_node->send) != NULL && send->msg.msg_iovlen > 0)) {
+		return;
+	}
+
+	if (send == NULL) {
+		if ((send = cli_node->send = pool_alloc(&send_pool)) == NULL) {
+			close_client(cli_node);
+			return;
+		}
+		memset(send, 0, sizeof(*send));
+	}
+
+	if ((sqe = uring_get_sqe(&cli_node->shard->ring)) == NULL) {
+		close_client(cli_node);
+		return;
+	}
+
+	n = (cli_node->outq.count < URING_MAX_IOV) ?
+		cli_node->outq.count : URING_MAX_IOV;
+
+	for (i = 0; i < n; i++) {
+		msg = outq_at(&cli_node->outq, i);
+		send->iov[i].iov_base = msg->data;
+		send->iov[i].iov_len = msg->len;
+	}
+	send->iov[0].iov_base = (char *)send->iov[0].iov_base +
+		cli_node->outq.offset;
+	send->iov[0].iov_len -= cli_node->outq.offset;
+
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = n;
+	cli_node->outq.busy = n;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cli_node->sock_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = uring_tag(cli_node, URING_SEND);
+
+	cli_node->uring_ops++;
+}
+
+/* Starts a multishot accept on the shard's listening socket */
+void uring_arm_accept(struct shard *shard)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&shard->ring)) == NULL) {
+		log_error("uring_arm_accept: submission queue full");
 		exit(1);
 	}
-	
-	/* Create a main socket that communicates with the other sockets */
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		printf("main: socket failed\n");
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = uring_tag(shard, URING_ACCEPT);
+}
+
+/* Starts a multishot poll on the shard's cork timer */
+void uring_arm_cork(struct shard *shard)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&shard->ring)) == NULL) {
+		log_error("uring_arm_cork: submission queue full");
 		exit(1);
 	}
-	
-	/* Set all values in buffer serv_addr to zero */
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	
-	/* Get the port number from the argument provided */
-	port_number = atoi(argv[1]);
-	
-	/* Initialize serv_addr values; set in_adrr to accept connections to all
-	 * IPs via INADDR_ANY */
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port_number); 
-	serv_addr.sin_addr.s_addr = INADDR_ANY;
-	
-	/* Attempt to bind address to socket */
-	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-		printf("main: bind socket to %d failed\n", port_number);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->cork_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_tag(shard, URING_CORK);
+}
+
+/* Starts a multishot poll on the shard's tick timer */
+void uring_arm_tick(struct shard *shard)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&shard->ring)) == NULL) {
+		log_error("uring_arm_tick: submission queue full");
+		exit(1);
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->tick_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_tag(shard, URING_TICK);
+}
+
+/* Starts a multishot poll on the shard's wake-up eventfd */
+void uring_arm_wake(struct shard *shard)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&shard->ring)) == NULL) {
+		log_error("uring_arm_wake: submission queue full");
+		exit(1);
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->wake_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_tag(shard, URING_WAKE);
+}
+
+/* Stops reading from the client until no client is stalled any more */
+void pause_client(struct client_node *cli_node)
+{
+	if (!cli_node->paused) {
+		cli_node->paused = 1;
+		cli_node->next_paused = cli_node->shard->paused_clients;
+		cli_node->shard->paused_clients = cli_node;
+
+		if (cli_node->recv_armed) {
+			uring_cancel_recv(cli_node);
+		}
+	}
+}
+
+/* Marks the client as no longer holding senders back; once no client on
+ * any shard is stalled, every shard is woken to resume its paused senders */
+void unstall_client(struct client_node *cli_node)
+{
+	int i;
+
+	cli_node->stalled = 0;
+
+	if (__atomic_sub_fetch(&stalled_clients, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (i = 0; i < num_shards; i++) {
+			wake_shard(&shards[i]);
+		}
+	}
+}
+
+/* Writes as much of the client's queue as its socket takes right now,
+ * closing the client if the write fails.  With io_uring the write is only
+ * queued, to be submitted with everything else at the end of the round */
+void flush_client(struct client_node *cli_node)
+{
+	unsigned long bytes_sent, messages_sent, writes, zerocopy_sent;
+	int rc;
+
+	if (backend == BACKEND_URING) {
+		uring_send(cli_node);
+		return;
+	}
+
+	bytes_sent = cli_node->outq.bytes_sent;
+	messages_sent = cli_node->outq.messages_sent;
+	writes = cli_node->outq.writes;
+	zerocopy_sent = cli_node->outq.zerocopy_sent;
+
+	rc = outq_flush(&cli_node->outq, cli_node->sock_fd);
+
+	if (cli_node->outq.bytes_sent != bytes_sent) {
+		cli_node->progress_at = cli_node->shard->now;
+	}
+
+	metrics_add(BYTES_OUT, cli_node->outq.bytes_sent - bytes_sent);
+	metrics_add(MESSAGES_OUT, cli_node->outq.messages_sent - messages_sent);
+	metrics_add(WRITES, cli_node->outq.writes - writes);
+	metrics_add(ZEROCOPY_SENDS, cli_node->outq.zerocopy_sent - zerocopy_sent);
+
+	if (rc < 0) {
+		close_client(cli_node);
+		return;
+	}
+
+	/* A stalled client lets paused senders go once it is half drained */
+	if (cli_node->stalled && (cli_node->outq.count <= queue_limit / 2)) {
+		unstall_client(cli_node);
+	}
+}
+
+/* Sets the shard's cork timer to go off at deadline, on the monotonic
+ * clock in nanoseconds */
+void arm_cork_timer(struct shard *shard, uint64_t deadline)
+{
+	struct itimerspec timer = {{0, 0}, {0, 0}};
+
+	timer.it_value.tv_sec = deadline / 1000000000;
+	timer.it_value.tv_nsec = deadline % 1000000000;
+
+	if (timerfd_settime(shard->cork_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+		log_error("arm_cork_timer: timerfd_settime failed");
 		exit(1);
 	}
-	
-	/* Listen for a client connecting to socket */
-	while ((listen(sockfd, 5) != -1) && (num_clients < MAX_CLIENTS)) 
-	{
-		handle_new_connection(sockfd);
-    }
-    
+	shard->cork_armed = 1;
+}
+
+/* Holds the client's queue back for cork_window, so that what is queued in
+ * the meantime goes out together.  A client written early because its queue
+ * filled up is still on the list, and keeps its place and deadline */
+void cork_client(struct client_node *cli_node)
+{
+	struct shard *shard = cli_node->shard;
+
+	cli_node->corked = 1;
+	if (cli_node->cork_listed) {
+		return;
+	}
+
+	cli_node->cork_listed = 1;
+	cli_node->cork_deadline = metrics_now() + cork_window;
+	cli_node->next_corked = NULL;
+
+	if (shard->corked_tail == NULL) {
+		shard->corked_head = cli_node;
+	} else {
+		shard->corked_tail->next_corked = cli_node;
+	}
+	shard->corked_tail = cli_node;
+
+	/* Clients are corked in deadline order, so only the oldest is timed */
+	if (!shard->cork_armed) {
+		arm_cork_timer(shard, cli_node->cork_deadline);
+	}
+}
+
+/* Writes the queue of every corked client whose window has closed, and sets
+ * the timer for the oldest one left.  Clients written early because their
+ * queues filled up are simply taken off the list */
+void uncork_clients(struct shard *shard)
+{
+	struct client_node *cli_node;
+	uint64_t now = metrics_now(), expirations;
+
+	if (read(shard->cork_fd, &expirations, sizeof(expirations)) < 0) {
+		/* The timer had not gone off; the deadlines are checked all the same */
+	}
+	shard->cork_armed = 0;
+
+	while ((cli_node = shard->corked_head) != NULL) {
+		if (cli_node->corked && (cli_node->cork_deadline > now)) {
+			arm_cork_timer(shard, cli_node->cork_deadline);
+			break;
+		}
+
+		shard->corked_head = cli_node->next_corked;
+		if (shard->corked_head == NULL) {
+			shard->corked_tail = NULL;
+		}
+		cli_node->cork_listed = 0;
+
+		if (cli_node->corked) {
+			cli_node->corked = 0;
+			if (cli_node->state != CLIENT_CLOSED) {
+				flush_client(cli_node);
+			}
+		}
+	}
+}
+
+/* Moves the shard's timer wheel on to the start of the round, acting on
+ * every client deadline that has come */
+void tick_shard(struct shard *shard)
+{
+	uint64_t expirations;
+
+	if (read(shard->tick_fd, &expirations, sizeof(expirations)) < 0) {
+		/* The timer had not gone off; the wheel is moved on all the same */
+	}
+
+	timer_wheel_advance(&shard->timers, shard->now);
+}
+
+/* Releases the messages of every zero-copy send to the client that the
+ * kernel has finished with */
+void reap_zerocopy(struct client_node *cli_node)
+{
+	unsigned long copied = cli_node->outq.zerocopy_copied;
+
+	outq_zerocopy_reap(&cli_node->outq, cli_node->sock_fd);
+
+	metrics_add(ZEROCOPY_COPIED, cli_node->outq.zerocopy_copied - copied);
+}
+
+/* Queues msg for the client, applying the slow consumer policy if the queue
+ * is already full, and starts writing if nothing was waiting before, or
+ * corks the client if corking is on.  The sender is NULL for messages
+ * posted from another shard */
+void queue_message(struct client_node *cli_node, struct message *msg,
+				   struct client_node *sender)
+{
+	int was_empty;
+
+	/* Messages already handed to the kernel are on their way out and do not
+	 * count against the limit */
+	if (cli_node->outq.count - cli_node->outq.busy >= queue_limit) {
+		switch (slow_policy) {
+		case SLOW_DROP_OLDEST:
+			cli_node->dropped++;
+			metrics_add(MESSAGES_DROPPED, 1);
+
+			/* If only a partly written message is queued, drop this one */
+			if (!outq_drop_oldest(&cli_node->outq)) {
+				return;
+			}
+			break;
+
+		case SLOW_DISCONNECT:
+			log_warn("%s is too slow; disconnecting client...", cli_node->name);
+			close_client(cli_node);
+			return;
+
+		case SLOW_PAUSE_SENDER:
+			if (!cli_node->stalled) {
+				cli_node->stalled = 1;
+				__atomic_add_fetch(&stalled_clients, 1, __ATOMIC_ACQ_REL);
+			}
+			if (sender != NULL) {
+				pause_client(sender);
+			}
+			break;
+		}
+	}
+
+	was_empty = (cli_node->outq.count == 0);
+
+	if (!outq_push(&cli_node->outq, message_hold(msg))) {
+		message_release(msg);
+		cli_node->dropped++;
+		metrics_add(MESSAGES_DROPPED, 1);
+		return;
+	}
+
+	if (was_empty) {
+		cli_node->progress_at = cli_node->shard->now;
+		if (cork_window > 0) {
+			cork_client(cli_node);
+		} else {
+			flush_client(cli_node);
+		}
+	} else if (cli_node->corked &&
+			   (cli_node->outq.count - cli_node->outq.busy >= cork_messages)) {
+		/* The client stays on the corked list until its deadline */
+		cli_node->corked = 0;
+		flush_client(cli_node);
+	}
+}
+
+/* Works out the client's deadlines when the earliest of them comes.  A
+ * client that has not named itself in time, has not answered a PING or has
+ * stopped taking what is written to it is closed; one silent for
+ * idle_timeout is sent a PING.  Otherwise the timer is set again for the
+ * next deadline; since writes do not move the timer, a queue is checked at
+ * least every stall_timeout, and one that stopped moving is found within
+ * twice that */
+void client_timeout(struct timer *timer)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)timer - offsetof(struct client_node, timer));
+	uint64_t now = cli_node->shard->now, next = UINT64_MAX, deadline;
+	struct message *ping;
+
+	if (cli_node->state == CLIENT_CLOSED) {
+		return;
+	}
+
+	if ((cli_node->state == CLIENT_AWAIT_NAME) && (handshake_timeout > 0)) {
+		if ((deadline = cli_node->connected_at + handshake_timeout) <= now) {
+			log_warn("Client did not identify themselves in time; disconnecting client...");
+			goto timed_out;
+		}
+		next = deadline;
+	}
+
+	if (stall_timeout > 0) {
+		if ((cli_node->outq.count > 0) &&
+			(cli_node->progress_at + stall_timeout <= now)) {
+			log_warn("%s stopped reading; disconnecting client...",
+					 cli_node->name);
+			goto timed_out;
+		}
+		if (now + stall_timeout < next) {
+			next = now + stall_timeout;
+		}
+	}
+
+	/* A paused client is not being read, so its silence means nothing */
+	if ((idle_timeout > 0) && cli_node->paused) {
+		deadline = now + idle_timeout;
+	} else if (idle_timeout > 0) {
+		deadline = cli_node->read_at + idle_timeout;
+
+		if (deadline + idle_timeout <= now) {
+			log_warn("%s did not answer a PING; disconnecting client...",
+					 cli_node->name);
+			goto timed_out;
+		}
+
+		/* Silence is met with one PING, and a PING unanswered for as long
+		 * again with a disconnect */
+		if (deadline <= now) {
+			if ((cli_node->pinged_at <= cli_node->read_at) &&
+				(cli_node->state == CLIENT_CHATTING) &&
+				((ping = message_new_frame(FRAME_PING, NULL, 0)) != NULL)) {
+				cli_node->pinged_at = now;
+				metrics_add(PINGS_SENT, 1);
+				queue_message(cli_node, ping, NULL);
+				message_release(ping);
+			}
+			deadline += idle_timeout;
+		}
+	}
+
+	if ((idle_timeout > 0) && (deadline < next)) {
+		next = deadline;
+	}
+
+	if (next != UINT64_MAX) {
+		timer_set(&cli_node->shard->timers, timer, next);
+	}
+	return;
+
+timed_out:
+	metrics_add(CLIENTS_TIMED_OUT, 1);
+	close_client(cli_node);
+}
+
+/* Queues msg for every chatting client of the shard */
+void deliver_to_shard(struct shard *shard, struct message *msg,
+					  struct client_node *sender)
+{
+	struct client_node *current;
+	struct room_members *room;
+	int i;
+
+	if (msg->room >= shard->num_rooms) {
+		return;
+	}
+
+	/* Members closed during the broadcast stay in the list until the end of
+	 * the round, so the list does not shift under the loop */
+	room = &shard->rooms[msg->room];
+
+	for (i = 0; i < room->count; i++) {
+		current = room->members[i];
+
+		/* Members who joined after the message was kept have had it
+		 * replayed already */
+		if ((current->state == CLIENT_CHATTING) &&
+			((msg->seq == 0) || (msg->seq > current->replayed))) {
+			queue_message(current, msg, sender);
+		}
+	}
+}
+
+/* Posts msg to another shard's inbox, keeping it in a backlog while the
+ * inbox is full so that messages from one shard stay in order */
+void post_to_shard(struct shard *shard, int target, struct message *msg)
+{
+	message_hold(msg);
+
+	if ((shard->backlog[target].count == 0) &&
+		spsc_ring_push(&shards[target].inbox[shard->index], msg)) {
+		shard->wake[target] = 1;
+		return;
+	}
+
+	if (!outq_push(&shard->backlog[target], msg)) {
+		message_release(msg);
+	}
+}
+
+/* Records how long a timed message took to reach its last recipient; called
+ * as the message's release callback, with the message as owner */
+void message_delivered(void *owner)
+{
+	struct message *msg = owner;
+
+	metrics_record(DELIVERY_LATENCY, metrics_now() - msg->born);
+}
+
+/* Write message to all clients, given message from specified client; the
+ * message is built once and queued for every client, which shares it.
+ * Clients on other shards get it through their shards' inboxes */
+void write_to_clients(struct client_node *sender, const char *msg,
+					  size_t msg_len) {
+	struct shard *shard = sender->shard;
+	struct members *members;
+	struct message *out;
+	int i;
+
+	if ((out = message_new(sender->name, msg, msg_len,
+						   keep_history ? FRAME_FLAG_SEQ : 0)) == NULL) {
+		log_error("write_to_clients: cannot build message");
+		return;
+	}
+	out->room = sender->room;
+
+	/* The clock stops when the last recipient's copy is written or dropped */
+	out->born = sender->read_at;
+	out->release = message_delivered;
+	out->owner = out;
+
+	if (keep_history && !history_append(&history, out)) {
+		log_error("write_to_clients: cannot keep message");
+	}
+
+	deliver_to_shard(shard, out, sender);
+
+	/* Shards without members in the room have no one to deliver to.  A
+	 * client joining on another shard this very round is seen from the next
+	 * round */
+	for (i = 0; i < num_shards; i++) {
+		if (i == shard->index) {
+			continue;
+		}
+
+		members = __atomic_load_n(&shards[i].members, __ATOMIC_ACQUIRE);
+
+		if ((out->room < members->num_rooms) &&
+			(members->room_counts[out->room] > 0)) {
+			post_to_shard(shard, i, out);
+		}
+	}
+
+	message_release(out);
+
+	/* Senders also hold off while clients on other shards are stalled */
+	if ((slow_policy == SLOW_PAUSE_SENDER) &&
+		(__atomic_load_n(&stalled_clients, __ATOMIC_ACQUIRE) > 0)) {
+		pause_client(sender);
+	}
+}
+
+/* Moves backlogged messages into other shards' inboxes as room frees up,
+ * then wakes every shard that was posted to this round */
+void flush_backlogs(struct shard *shard)
+{
+	struct outq *backlog;
+	int i;
+
+	for (i = 0; i < num_shards; i++) {
+		backlog = &shard->backlog[i];
+
+		while ((backlog->count > 0) &&
+			   spsc_ring_push(&shards[i].inbox[shard->index],
+							  outq_at(backlog, 0))) {
+			outq_take(backlog);
+			shard->wake[i] = 1;
+		}
+
+		if (shard->wake[i]) {
+			shard->wake[i] = 0;
+			wake_shard(&shards[i]);
+		}
+	}
+}
+
+/* Delivers every message other shards have posted to this one */
+void drain_inbox(struct shard *shard)
+{
+	struct message *msg;
+	uint64_t count;
+	int i;
+
+	if (read(shard->wake_fd, &count, sizeof(count)) < 0) {
+		/* Nothing was signalled; the rings are checked all the same */
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		while ((msg = spsc_ring_pop(&shard->inbox[i])) != NULL) {
+			deliver_to_shard(shard, msg, NULL);
+			message_release(msg);
+		}
+	}
+}
+
+/* Queues a line of text from the server to the client alone */
+void send_notice(struct client_node *cli_node, const char *text)
+{
+	struct message *notice;
+
+	if ((notice = message_new_frame(FRAME_MSG, text, strlen(text))) != NULL) {
+		queue_message(cli_node, notice, cli_node);
+		message_release(notice);
+	}
+}
+
+/* Takes the client out of its room, if it is in one */
+void leave_room(struct client_node *cli_node)
+{
+	struct shard *shard = cli_node->shard;
+	struct client_node *moved;
+
+	if (cli_node->room < 0) {
+		return;
+	}
+
+	moved = room_members_remove(&shard->rooms[cli_node->room],
+								cli_node->room_slot);
+	if (moved != NULL) {
+		moved->room_slot = cli_node->room_slot;
+	}
+
+	cli_node->room = -1;
+	shard->members_changed = 1;
+}
+
+/* Moves the client to the room with the given id; returns 0 on failure, in
+ * which case the client stays where it was, and 1 on success */
+int enter_room(struct client_node *cli_node, int room)
+{
+	struct shard *shard = cli_node->shard;
+	struct room_members *grown;
+	int num_rooms, slot;
+
+	if (room == cli_node->room) {
+		return 1;
+	}
+
+	/* Make room for the room's members on this shard */
+	if (room >= shard->num_rooms) {
+		num_rooms = (shard->num_rooms > 0) ? shard->num_rooms : 8;
+		while (num_rooms <= room) {
+			num_rooms *= 2;
+		}
+
+		grown = realloc(shard->rooms, num_rooms * sizeof(struct room_members));
+		if (grown == NULL) {
+			return 0;
+		}
+
+		memset(&grown[shard->num_rooms], 0,
+			   (num_rooms - shard->num_rooms) * sizeof(struct room_members));
+		shard->rooms = grown;
+		shard->num_rooms = num_rooms;
+	}
+
+	if (!room_members_add(&shard->rooms[room], cli_node, &slot)) {
+		return 0;
+	}
+
+	leave_room(cli_node);
+	cli_node->room = room;
+	cli_node->room_slot = slot;
+	shard->members_changed = 1;
+
+	return 1;
+}
+
+/* Queues the client's room's messages numbered after after, or only the
+ * last of them when last is positive, straight from the room's log */
+void replay_room(struct client_node *cli_node, uint64_t after, int last)
+{
+	struct message *ranges[HISTORY_MAX_SEGMENTS];
+	int i, n;
+
+	if (!keep_history) {
+		return;
+	}
+
+	n = history_replay(&history, cli_node->room, after, last, ranges,
+					   &cli_node->replayed);
+
+	for (i = 0; i < n; i++) {
+		queue_message(cli_node, ranges[i], cli_node);
+		message_release(ranges[i]);
+	}
+}
+
+/* Handles a JOIN frame: moves the client to the room it names, creating
+ * the room if need be, and tells the client where it ended up */
+void join_room(struct client_node *cli_node, const char *name, size_t len)
+{
+	char room_name[ROOM_NAME_LEN];
+	char notice[ROOM_NAME_LEN + 32];
+	int room;
+
+	if (len >= ROOM_NAME_LEN) {
+		len = ROOM_NAME_LEN - 1;
+	}
+	memcpy(room_name, name, len);
+	room_name[len] = '\0';
+
+	if ((len == 0) || (strlen(room_name) != len)) {
+		send_notice(cli_node, "Room names cannot be empty or contain NUL");
+		return;
+	}
+
+	if (((room = room_table_get(&rooms, room_name)) < 0) ||
+		(keep_history && (history_open(&history, room, room_name) == NULL)) ||
+		!enter_room(cli_node, room)) {
+		snprintf(notice, sizeof(notice), "Cannot join %s", room_name);
+		send_notice(cli_node, notice);
+		return;
+	}
+
+	snprintf(notice, sizeof(notice), "You are now in %s", room_name);
+	send_notice(cli_node, notice);
+	replay_room(cli_node, 0, replay_count);
+}
+
+/* Acts on one frame received from the client; returns 1 while the client
+ * is still connected and 0 once it has asked to leave or broken protocol */
+int handle_frame(struct client_node *cli_node, struct frame *frame)
+{
+	struct message *pong;
+	size_t len;
+
+	switch (cli_node->state) {
+	case CLIENT_AWAIT_NAME:
+
+		/* Nothing is relayed until the client has identified themselves */
+		if (frame->type != FRAME_HELLO) {
+			log_warn("Client did not identify themselves; disconnecting client...");
+			return 0;
+		}
+
+		len = (frame->len < CLI_NAME_LEN) ? frame->len : CLI_NAME_LEN - 1;
+		memcpy(cli_node->name, frame->payload, len);
+		cli_node->name[len] = '\0';
+		cli_node->state = CLIENT_CHATTING;
+
+		/* Everyone starts out in the lobby */
+		if (!enter_room(cli_node, LOBBY)) {
+			return 0;
+		}
+		replay_room(cli_node, 0, replay_count);
+		return 1;
+
+	case CLIENT_CHATTING:
+		switch (frame->type) {
+		case FRAME_MSG:
+			cli_node->messages_in++;
+			metrics_add(MESSAGES_IN, 1);
+
+			/* Print message from client */
+			log_info("%s says: %.*s", cli_node->name, (int)frame->len,
+					 frame->payload);
+
+			/* Write to all clients */
+			write_to_clients(cli_node, frame->payload, frame->len);
+			return 1;
+
+		case FRAME_PING:
+			if ((pong = message_new_frame(FRAME_PONG, frame->payload,
+										  frame->len)) != NULL) {
+				queue_message(cli_node, pong, cli_node);
+				message_release(pong);
+			}
+			return 1;
+
+		case FRAME_JOIN:
+			join_room(cli_node, frame->payload, frame->len);
+			return 1;
+
+		case FRAME_LEAVE:
+			if (!enter_room(cli_node, LOBBY)) {
+				return 0;
+			}
+			send_notice(cli_node, "You are back in the lobby");
+			replay_room(cli_node, 0, replay_count);
+			return 1;
+
+		case FRAME_REPLAY:
+			if (frame->len == FRAME_SEQ_LEN) {
+				replay_room(cli_node, frame_get_u64(frame->payload), 0);
+			}
+			return 1;
+
+		case FRAME_BYE:
+
+			/* User must have disconnected */
+			return 0;
+
+		default:
+			return 1;
+		}
+
+	case CLIENT_CLOSED:
+		break;
+	}
+
+	return 0;
+}
+
+/* Handles every complete frame waiting in the client's input, stopping
+ * early if the client is paused; returns 1 while the client is still
+ * connected and 0 once it has been closed */
+int handle_input(struct client_node *cli_node)
+{
+	struct frame frame;
+	int rc = 0;
+
+	while (!cli_node->paused &&
+		   ((rc = frame_parser_next(&cli_node->input, &frame)) > 0)) {
+		if (!handle_frame(cli_node, &frame)) {
+			close_client(cli_node);
+			return 0;
+		}
+	}
+
+	if (rc < 0) {
+		log_warn("%s sent a malformed frame; disconnecting client...",
+				 cli_node->name);
+		close_client(cli_node);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Advance the client's state machine with everything that can be read from
+ * its socket without blocking.  Since the socket is edge-triggered, reads
+ * continue until the kernel reports EAGAIN; every complete frame read is
+ * handled in order.  Returns 1 while the client is still connected and 0
+ * once it has disconnected or an error occurred */
+int handle_client(struct client_node *cli_node)
+{
+	char *space;
+	size_t space_len;
+	ssize_t n;
+
+	while ((cli_node->state != CLIENT_CLOSED) && !cli_node->paused) {
+
+		/* Handle frames left over from before the client was paused first */
+		if (!handle_input(cli_node) || cli_node->paused) {
+			break;
+		}
+
+		if ((space = frame_parser_space(&cli_node->input, &space_len)) == NULL) {
+			log_error("handle_client: cannot grow input buffer");
+			close_client(cli_node);
+			break;
+		}
+
+		n = read(cli_node->sock_fd, space, space_len);
+
+		/* Everything available has been consumed; wait for the next edge */
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			break;
+		}
+
+		if ((n < 0) && (errno == EINTR)) {
+			continue;
+		}
+
+		/* Client disconnected before or while talking */
+		if (n <= 0) {
+			if (cli_node->state == CLIENT_AWAIT_NAME) {
+				log_warn("Client did not identify themselves; disconnecting client...");
+			}
+			close_client(cli_node);
+			break;
+		}
+
+		log_debug("%d bytes were read", (int)n);
+		cli_node->bytes_in += n;
+		cli_node->read_at = metrics_now();
+		metrics_add(BYTES_IN, n);
+		frame_parser_commit(&cli_node->input, n);
+	}
+
+	return (cli_node->state != CLIENT_CLOSED);
+}
+
+/* Publishes new room counts for the shard if clients joined or left this
+ * round, retiring the previous counts; on failure the old counts stay up
+ * and publishing is tried again next round */
+void publish_members(struct shard *shard)
+{
+	struct members *members, *old;
+	int i;
+
+	if (!shard->members_changed) {
+		return;
+	}
+
+	members = malloc(sizeof(struct members) + shard->num_rooms * sizeof(int));
+	if (members == NULL) {
+		log_error("publish_members: malloc failed");
+		return;
+	}
+
+	members->num_rooms = shard->num_rooms;
+	for (i = 0; i < shard->num_rooms; i++) {
+		members->room_counts[i] = shard->rooms[i].count;
+	}
+
+	old = shard->members;
+	__atomic_store_n(&shard->members, members, __ATOMIC_RELEASE);
+	rcu_retire(&rcu, &shard->garbage, &old->rcu);
+
+	shard->members_changed = 0;
+}
+
+/* Writes a report on each of the shard's clients if the admin socket has
+ * asked for one, as a line of text or a JSON object each */
+void write_report(struct shard *shard)
+{
+	struct client_node *current;
+	unsigned long queued = 0;
+	char *report;
+	size_t len;
+	FILE *out;
+	int wanted, i;
+
+	if ((wanted = __atomic_load_n(&shard->report_wanted, __ATOMIC_ACQUIRE)) == 0) {
+		return;
+	}
+
+	if ((out = open_memstream(&report, &len)) == NULL) {
+		return;
+	}
+
+	for (i = 0; i < shard->clients.count; i++) {
+		current = shard->clients.entries[i].client;
+		queued += current->outq.count;
+
+		if (wanted == 2) {
+			fprintf(out, "%s{\"id\":%d,\"name\":", (i > 0) ? "," : "",
+					current->id);
+			metrics_json_string(out, current->name);
+			fprintf(out, ",\"room\":%d,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+					"\"messages_in\":%lu,\"messages_out\":%lu,"
+					"\"dropped\":%lu,\"queued\":%u}",
+					current->room, current->bytes_in, current->outq.bytes_sent,
+					current->messages_in, current->outq.messages_sent,
+					current->dropped, current->outq.count);
+		} else {
+			fprintf(out, "client %d room %d bytes_in %lu bytes_out %lu "
+					"messages_in %lu messages_out %lu dropped %lu queued %u "
+					"name %s\n",
+					current->id, current->room, current->bytes_in,
+					current->outq.bytes_sent, current->messages_in,
+					current->outq.messages_sent, current->dropped,
+					current->outq.count, current->name);
+		}
+	}
+
+	fclose(out);
+
+	shard->report_queued = queued;
+	free(__atomic_exchange_n(&shard->report, report, __ATOMIC_ACQ_REL));
+	__atomic_store_n(&shard->report_wanted, 0, __ATOMIC_RELEASE);
+}
+
+/* Writes the server's queued messages and every shard's report on its
+ * clients to the admin socket; called from the admin socket's thread, which
+ * asks each shard for its report and waits for them */
+void report_clients(FILE *out, int json)
+{
+	unsigned long queued = 0;
+	char **reports;
+	int i, waited, pending, first = 1;
+
+	if ((reports = calloc(num_shards, sizeof(char *))) == NULL) {
+		return;
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		free(__atomic_exchange_n(&shards[i].report, NULL, __ATOMIC_ACQ_REL));
+		__atomic_store_n(&shards[i].report_wanted, json ? 2 : 1,
+						 __ATOMIC_RELEASE);
+		wake_shard(&shards[i]);
+	}
+
+	/* A shard reports at the end of its round, which the wake-up ends */
+	for (waited = 0; waited < REPORT_TIMEOUT_MS; waited++) {
+		pending = 0;
+		for (i = 0; i < num_shards; i++) {
+			pending += (__atomic_load_n(&shards[i].report_wanted,
+										__ATOMIC_ACQUIRE) != 0);
+		}
+		if (pending == 0) {
+			break;
+		}
+		usleep(1000);
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		reports[i] = __atomic_exchange_n(&shards[i].report, NULL,
+										 __ATOMIC_ACQ_REL);
+		if (reports[i] != NULL) {
+			queued += shards[i].report_queued;
+		}
+	}
+
+	fprintf(out, json ? "\"queued_messages\":%lu,\"clients\":[" :
+			"queued_messages %lu\n", queued);
+
+	for (i = 0; i < num_shards; i++) {
+		if ((reports[i] != NULL) && (reports[i][0] != '\0')) {
+			fprintf(out, "%s%s", (json && !first) ? "," : "", reports[i]);
+			first = 0;
+		}
+		free(reports[i]);
+	}
+
+	if (json) {
+		fprintf(out, "]");
+	}
+
+	free(reports);
+}
+
+/* Ends the shard's round: publishes the room counts if anyone joined or
+ * left, then frees the counts that no shard can be reading any more */
+void end_round(struct shard *shard)
+{
+	write_report(shard);
+	publish_members(shard);
+	rcu_quiescent(&rcu, shard->index);
+	rcu_reclaim(&rcu, &shard->garbage);
+}
+
+/* Removes every client of the shard closed during the last round of
+ * events */
+void remove_closed_clients(struct shard *shard)
+{
+	struct client_node *cli_node, **link;
+	int prune_paused = 0;
+
+	/* Closed clients no longer hold anyone back, nor wait to be resumed or
+	 * uncorked */
+	for (cli_node = shard->closed_clients; cli_node != NULL;
+		 cli_node = cli_node->next_closed) {
+		if (cli_node->stalled) {
+			unstall_client(cli_node);
+		}
+		prune_paused |= cli_node->paused;
+	}
+
+	/* A client written early because its queue filled up is on the corked
+	 * list without being corked */
+	if ((shard->closed_clients != NULL) && (shard->corked_head != NULL)) {
+		shard->corked_tail = NULL;
+		link = &shard->corked_head;
+		while (*link != NULL) {
+			if ((*link)->state == CLIENT_CLOSED) {
+				*link = (*link)->next_corked;
+			} else {
+				shard->corked_tail = *link;
+				link = &(*link)->next_corked;
+			}
+		}
+	}
+
+	if (prune_paused) {
+		link = &shard->paused_clients;
+		while (*link != NULL) {
+			if ((*link)->state == CLIENT_CLOSED) {
+				*link = (*link)->next_paused;
+			} else {
+				link = &(*link)->next_paused;
+			}
+		}
+	}
+
+	while ((cli_node = shard->closed_clients) != NULL) {
+		shard->closed_clients = cli_node->next_closed;
+		log_info("ending connection with: %d", cli_node->id);
+		metrics_add(CLIENTS_DISCONNECTED, 1);
+		leave_room(cli_node);
+		remove_client(shard, cli_node->sock_fd);
+	}
+}
+
+/* Once no client is stalled, reads everything the shard's paused senders
+ * sent in the meantime */
+void resume_paused_clients(struct shard *shard)
+{
+	struct client_node *cli_node, *next;
+
+	if (__atomic_load_n(&stalled_clients, __ATOMIC_ACQUIRE) > 0) {
+		return;
+	}
+
+	/* Senders may be paused again while the list is being walked */
+	cli_node = shard->paused_clients;
+	shard->paused_clients = NULL;
+
+	while (cli_node != NULL) {
+		next = cli_node->next_paused;
+		cli_node->paused = 0;
+
+		/* With io_uring, frames already received are handled before the
+		 * receive is started again */
+		if (backend == BACKEND_URING) {
+			if (handle_input(cli_node) && !cli_node->paused &&
+				!cli_node->recv_armed) {
+				uring_arm_recv(cli_node);
+			}
+		} else {
+			handle_client(cli_node);
+		}
+		cli_node = next;
+	}
+}
+
+/* Creates a client for a newly accepted socket and adds it to the shard's
+ * clients; if the server is full or the client cannot be set up, the socket
+ * is closed.  Returns the new client, or NULL on failure */
+struct client_node *new_client(struct shard *shard, int cli_sockfd)
+{
+	struct client_node *cli_node;
+	int count, one = 1;
+
+	/* Count the client in before checking, so that shards accepting at the
+	 * same time cannot overshoot the limit together */
+	count = __atomic_add_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+
+	if ((max_clients > 0) && (count > max_clients)) {
+		log_warn("new_client: server is full; refusing connection");
+		metrics_add(CLIENTS_REJECTED, 1);
+		__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+		close(cli_sockfd);
+		return NULL;
+	}
+
+	/* io_uring waits for blocking sockets itself, but hands EAGAIN back for
+	 * non-blocking ones */
+	if ((backend == BACKEND_EPOLL) && !set_nonblocking(cli_sockfd)) {
+		__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+		close(cli_sockfd);
+		return NULL;
+	}
+
+	/* Create new client node and add new client information */
+	cli_node = pool_alloc(&client_pool);
+
+	/* Drop the connection if no memory can be allocated */
+	if (cli_node == NULL) {
+		log_error("new_client: cannot allocate client");
+		__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+		close(cli_sockfd);
+		return NULL;
+	}
+	memset(cli_node, 0, sizeof(*cli_node));
+
+	cli_node->id = __atomic_add_fetch(&current_id, 1, __ATOMIC_RELAXED);
+	cli_node->sock_fd = cli_sockfd;
+	cli_node->shard = shard;
+	cli_node->state = CLIENT_AWAIT_NAME;
+	cli_node->room = -1;
+	frame_parser_init(&cli_node->input);
+	outq_init(&cli_node->outq);
+
+	/* Large messages go out without a copy where the kernel allows it */
+	if ((zerocopy_min > 0) && (backend == BACKEND_EPOLL)) {
+		if (setsockopt(cli_sockfd, SOL_SOCKET, SO_ZEROCOPY, &one,
+					   sizeof(one)) == 0) {
+			cli_node->outq.zerocopy_min = zerocopy_min;
+		} else {
+			log_warn("new_client: SO_ZEROCOPY failed; copying instead");
+		}
+	}
+
+	/* Attempt to add a new client to the table */
+	if (!add_client(cli_node)) {
+		log_error("new_client: cannot add client");
+		__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+		close(cli_sockfd);
+		pool_free(&client_pool, cli_node);
+		return NULL;
+	}
+
+	metrics_add(CLIENTS_ACCEPTED, 1);
+
+	/* The first deadline is the nearest one the client could miss */
+	cli_node->connected_at = cli_node->read_at = shard->now;
+	if (timing) {
+		timer_init(&cli_node->timer, client_timeout);
+		timer_set(&shard->timers, &cli_node->timer, shard->now +
+				  ((handshake_timeout > 0) ? handshake_timeout :
+				   (stall_timeout > 0) ? stall_timeout : idle_timeout));
+	}
+
+	return cli_node;
+}
+
+/* Accepts every pending connection on the shard's listening socket and adds
+ * each to the shard's clients.  Connections arriving while the server is
+ * full are closed straight away.  Returns the number of clients added */
+int handle_new_connection(struct shard *shard)
+{
+	int cli_sockfd;
+	socklen_t cli_len;
+	int rc = 0;
+	struct client_node *cli_node;
+	struct epoll_event event;
+
+    struct sockaddr_in cli_addr;
+
+    while (1) {
+
+		/* Attempt to accept a new connection */
+		cli_len = sizeof(cli_addr);
+		cli_sockfd = accept(shard->listen_fd, (struct sockaddr *)&cli_addr,
+							&cli_len);
+		if (cli_sockfd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				log_error("handle_new_connection: error on accept");
+			}
+			break;
+		}
+
+		if ((cli_node = new_client(shard, cli_sockfd)) == NULL) {
+			continue;
+		}
+
+		/* Watch the new client for input, hang-ups and room to write */
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = cli_node;
+
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, cli_sockfd, &event) < 0) {
+			log_error("handle_new_connection: epoll_ctl failed");
+			remove_client(shard, cli_sockfd);
+			continue;
+		}
+
+		rc++;
+	}
+
+	if (rc > 0) {
+		log_info("handle_new_connection; %d clients added", rc);
+	}
+
+	return rc;
+}
+
+/* Raises the limit on open descriptors as far as allowed, since every client
+ * holds one */
+void raise_fd_limit(void)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/* Opens a non-blocking socket listening on port that shares the port with
+ * every other shard's socket; returns the socket, or -1 on failure */
+int open_listener(int port_number)
+{
+	int sockfd;
+	int enable = 1;
+	struct sockaddr_in serv_addr;
+
+	/* Create a main socket that communicates with the other sockets */
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		log_error("open_listener: socket failed");
+		return -1;
+	}
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+	/* Set all values in buffer serv_addr to zero */
+	bzero((char *) &serv_addr, sizeof(serv_addr));
+
+	/* Initialize serv_addr values; set in_adrr to accept connections to all
+	 * IPs via INADDR_ANY */
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port_number);
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+
+	/* Attempt to bind address to socket */
+	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		log_error("open_listener: bind socket to %d failed", port_number);
+		close(sockfd);
+		return -1;
+	}
+
+	/* Listen for clients connecting to socket; accepts happen in the loop */
+	if ((listen(sockfd, SOMAXCONN) < 0) || !set_nonblocking(sockfd)) {
+		log_error("open_listener: listen failed");
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/* Sets up the shard's listening socket, epoll instance, wake-up eventfd and
+ * inboxes; returns 0 on failure and 1 on success */
+int init_shard(struct shard *shard, int index, int port_number)
+{
+	static const struct itimerspec tick = {
+		{0, TIMER_TICK_MS * 1000000}, {0, TIMER_TICK_MS * 1000000}
+	};
+	struct epoll_event event;
+	int i;
+
+	shard->index = index;
+	shard->closed_clients = NULL;
+	shard->paused_clients = NULL;
+	shard->corked_head = shard->corked_tail = NULL;
+	shard->cork_armed = 0;
+	shard->rooms = NULL;
+	shard->num_rooms = 0;
+	shard->members_changed = 0;
+	shard->report_wanted = 0;
+	shard->report = NULL;
+	rcu_garbage_init(&shard->garbage);
+
+	if ((shard->members = calloc(1, sizeof(struct members))) == NULL) {
+		log_error("init_shard: cannot allocate members");
+		return 0;
+	}
+
+	if (!client_table_init(&shard->clients, 0)) {
+		log_error("init_shard: cannot allocate client table");
+		return 0;
+	}
+
+	shard->inbox = calloc(num_shards, sizeof(struct spsc_ring));
+	shard->backlog = calloc(num_shards, sizeof(struct outq));
+	shard->wake = calloc(num_shards, sizeof(int));
+
+	if ((shard->inbox == NULL) || (shard->backlog == NULL) ||
+		(shard->wake == NULL)) {
+		log_error("init_shard: cannot allocate inboxes");
+		return 0;
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		if ((i != index) && !spsc_ring_init(&shard->inbox[i], INBOX_LEN)) {
+			log_error("init_shard: cannot allocate inboxes");
+			return 0;
+		}
+		outq_init(&shard->backlog[i]);
+	}
+
+	if ((shard->listen_fd = open_listener(port_number)) < 0) {
+		return 0;
+	}
+
+	if ((shard->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		log_error("init_shard: cannot create eventfd");
+		return 0;
+	}
+
+	if ((shard->cork_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		log_error("init_shard: cannot create timerfd");
+		return 0;
+	}
+
+	/* The timer wheel turns only while there are deadlines to keep */
+	shard->now = metrics_now();
+	shard->tick_fd = -1;
+	if (timing && (((shard->tick_fd = timerfd_create(CLOCK_MONOTONIC,
+													 TFD_NONBLOCK)) < 0) ||
+				   (timerfd_settime(shard->tick_fd, 0, &tick, NULL) < 0) ||
+				   !timer_wheel_init(&shard->timers, TIMER_SLOTS,
+									 TIMER_TICK_MS * 1000000ULL, shard->now))) {
+		log_error("init_shard: cannot set up the timer wheel");
+		return 0;
+	}
+
+	/* With io_uring, accepts and wake-ups are requests that stay armed */
+	if (backend == BACKEND_URING) {
+		if (!uring_init(&shard->ring, URING_ENTRIES) ||
+			!uring_register_buffers(&shard->ring, URING_BUF_COUNT,
+									URING_BUF_LEN, URING_BUF_GROUP)) {
+			log_error("init_shard: cannot set up io_uring");
+			return 0;
+		}
+		uring_arm_accept(shard);
+		uring_arm_wake(shard);
+		uring_arm_cork(shard);
+		if (timing) {
+			uring_arm_tick(shard);
+		}
+		return 1;
+	}
+
+	if ((shard->epoll_fd = epoll_create1(0)) < 0) {
+		log_error("init_shard: cannot create epoll instance");
+		return 0;
+	}
+
+	/* The listening socket is the only one registered without a client */
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &event) < 0) {
+		log_error("init_shard: epoll_ctl failed");
+		return 0;
+	}
+
+	/* The wake-up eventfd is told apart from clients by its address */
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &shard->wake_fd;
+
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &event) < 0) {
+		log_error("init_shard: epoll_ctl failed");
+		return 0;
+	}
+
+	/* And so is the cork timer */
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &shard->cork_fd;
+
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->cork_fd, &event) < 0) {
+		log_error("init_shard: epoll_ctl failed");
+		return 0;
+	}
+
+	/* And so is the tick timer */
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &shard->tick_fd;
+
+	if (timing &&
+		(epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->tick_fd, &event) < 0)) {
+		log_error("init_shard: epoll_ctl failed");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Returns 1 if a multishot receive into the ring's provided buffers works,
+ * by arming one on a socket pair with a byte waiting.  Kernels before 6.0
+ * know every request type the backend uses, but fail a multishot receive
+ * with EINVAL, which only a real request shows */
+int uring_recv_multishot_works(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int fds[2], ok = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		return 0;
+	}
+
+	/* The byte is already there, so the request completes at once */
+	if ((write(fds[1], "x", 1) == 1) && ((sqe = uring_get_sqe(ring)) != NULL)) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fds[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUF_GROUP;
+
+		if ((uring_submit(ring, 1) == 1) &&
+			((cqe = uring_peek_cqe(ring)) != NULL)) {
+			ok = (cqe->res == 1) && (cqe->flags & IORING_CQE_F_BUFFER);
+			uring_cqe_seen(ring);
+		}
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	return ok;
+}
+
+/* Returns 1 if the kernel offers everything the io_uring backend needs:
+ * the request types it uses, provided buffer rings and multishot receives
+ * into them */
+int uring_available(void)
+{
+	struct uring ring;
+	int ok;
+
+	if (!uring_init(&ring, 8)) {
+		return 0;
+	}
+
+	ok = uring_supports(&ring, IORING_OP_SENDMSG) &&
+		uring_supports(&ring, IORING_OP_ACCEPT) &&
+		uring_supports(&ring, IORING_OP_RECV) &&
+		uring_supports(&ring, IORING_OP_POLL_ADD) &&
+		uring_supports(&ring, IORING_OP_ASYNC_CANCEL) &&
+		uring_register_buffers(&ring, 8, URING_BUF_LEN, URING_BUF_GROUP) &&
+		uring_recv_multishot_works(&ring);
+
+	uring_destroy(&ring);
+	return ok;
+}
+
+/* Keeps the calling thread on one core so that a shard's clients stay in
+ * that core's caches */
+void pin_to_core(int index)
+{
+	cpu_set_t cpus;
+	long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (num_cores < 1) {
+		return;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(index % num_cores, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/* Handles the completion of one of the client's requests; a client
+ * removed while requests were in flight is freed by the last of them */
+void handle_client_completion(struct client_node *cli_node, enum uring_op op,
+							  int res, unsigned int flags)
+{
+	struct uring *ring = &cli_node->shard->ring;
+	unsigned long messages_sent;
+	unsigned int bid;
+	size_t space_len;
+	char *space;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		cli_node->uring_ops--;
+	}
+
+	if (op == URING_RECV) {
+		if (!(flags & IORING_CQE_F_MORE)) {
+			cli_node->recv_armed = 0;
+		}
+
+		if (flags & IORING_CQE_F_BUFFER) {
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			/* Move the data out so the buffer can go straight back */
+			if ((res > 0) && !cli_node->removed &&
+				(cli_node->state != CLIENT_CLOSED)) {
+				space = frame_parser_space(&cli_node->input, &space_len);
+				if ((space != NULL) && (space_len >= (size_t)res)) {
+					memcpy(space, uring_buffer(ring, bid), res);
+					frame_parser_commit(&cli_node->input, res);
+					cli_node->bytes_in += res;
+					cli_node->read_at = metrics_now();
+					metrics_add(BYTES_IN, res);
+				} else {
+					close_client(cli_node);
+				}
+			}
+			uring_recycle_buffer(ring, bid);
+		}
+
+		if (!cli_node->removed && (cli_node->state != CLIENT_CLOSED)) {
+			if (res > 0) {
+				handle_input(cli_node);
+			} else if ((res == 0) ||
+					   ((res != -ENOBUFS) && (res != -ECANCELED))) {
+				/* The client hung up or the receive failed */
+				close_client(cli_node);
+			}
+		}
+
+		/* Keep receiving unless the client is paused, gone or the request
+		 * is still armed */
+		if (!cli_node->recv_armed && !cli_node->removed &&
+			(cli_node->state != CLIENT_CLOSED) && !cli_node->paused) {
+			uring_arm_recv(cli_node);
+		}
+	} else if (op == URING_SEND) {
+		cli_node->send->msg.msg_iovlen = 0;
+		cli_node->outq.busy = 0;
+
+		if (!cli_node->removed && (cli_node->state != CLIENT_CLOSED)) {
+			if (res < 0) {
+				close_client(cli_node);
+			} else {
+				messages_sent = cli_node->outq.messages_sent;
+				outq_advance(&cli_node->outq, res);
+				if (res > 0) {
+					cli_node->progress_at = cli_node->shard->now;
+				}
+				metrics_add(BYTES_OUT, res);
+				metrics_add(WRITES, 1);
+				metrics_add(MESSAGES_OUT, cli_node->outq.messages_sent -
+							messages_sent);
+				if (cli_node->stalled &&
+					(cli_node->outq.count <= (unsigned int)queue_limit / 2)) {
+					unstall_client(cli_node);
+				}
+				uring_send(cli_node);
+			}
+		}
+	}
+
+	if (cli_node->removed && (cli_node->uring_ops == 0)) {
+		free_client(cli_node);
+	}
+}
+
+/* Serve the shard through io_uring: every request prepared during a round
+ * is submitted with the wait for the next completions, in one system call.
+ * A long run of completions is cut every MAX_EVENTS so that the sends it
+ * prepares start before the queues they drain fill up */
+void run_shard_uring(struct shard *shard)
+{
+	struct io_uring_cqe *cqe;
+	struct client_node *cli_node;
+	enum uring_op op;
+	void *ptr;
+	int res, reaped;
+	unsigned int flags;
+
+	while (1) {
+		/* No room counts are held while waiting */
+		rcu_offline(&rcu, shard->index);
+		res = uring_submit(&shard->ring, 1);
+		rcu_online(&rcu, shard->index);
+		shard->now = metrics_now();
+
+		if (res < 0) {
+			log_error("run_shard_uring: io_uring_enter failed");
+			exit(1);
+		}
+
+		reaped = 0;
+		while ((cqe = uring_peek_cqe(&shard->ring)) != NULL) {
+			if ((++reaped % MAX_EVENTS == 0) &&
+				(uring_submit(&shard->ring, 0) < 0)) {
+				log_error("run_shard_uring: io_uring_enter failed");
+				exit(1);
+			}
+
+			ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+			op = cqe->user_data & URING_OP_MASK;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(&shard->ring);
+
+			switch (op) {
+			case URING_ACCEPT:
+				if ((res >= 0) && ((cli_node = new_client(shard, res)) != NULL)) {
+					uring_arm_recv(cli_node);
+				}
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_arm_accept(shard);
+				}
+				break;
+			case URING_WAKE:
+				drain_inbox(shard);
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_arm_wake(shard);
+				}
+				break;
+			case URING_CORK:
+				uncork_clients(shard);
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_arm_cork(shard);
+				}
+				break;
+			case URING_TICK:
+				tick_shard(shard);
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_arm_tick(shard);
+				}
+				break;
+			case URING_CANCEL:
+				break;
+			default:
+				handle_client_completion(ptr, op, res, flags);
+				break;
+			}
+		}
+
+		/* Removing stalled clients may let paused senders go, and resumed
+		 * senders may close further clients */
+		remove_closed_clients(shard);
+		resume_paused_clients(shard);
+		remove_closed_clients(shard);
+
+		/* Hand this round's broadcasts to the other shards */
+		flush_backlogs(shard);
+
+		end_round(shard);
+	}
+}
+
+/* Serve the shard's new connections, client messages and inbox as they
+ * become ready */
+void *run_shard(void *args)
+{
+	struct shard *shard = args;
+	struct epoll_event events[MAX_EVENTS];
+	struct client_node *cli_node;
+	int n, i;
+
+	if (num_shards > 1) {
+		pin_to_core(shard->index);
+	}
+
+	if (backend == BACKEND_URING) {
+		run_shard_uring(shard);
+		return NULL;
+	}
+
+	while (1) {
+		/* No room counts are held while waiting */
+		rcu_offline(&rcu, shard->index);
+		n = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, -1);
+		rcu_online(&rcu, shard->index);
+		shard->now = metrics_now();
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("run_shard: epoll_wait failed");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			cli_node = events[i].data.ptr;
+
+			if (cli_node == NULL) {
+				handle_new_connection(shard);
+				continue;
+			}
+
+			if (events[i].data.ptr == &shard->wake_fd) {
+				drain_inbox(shard);
+				continue;
+			}
+
+			if (events[i].data.ptr == &shard->cork_fd) {
+				uncork_clients(shard);
+				continue;
+			}
+
+			if (events[i].data.ptr == &shard->tick_fd) {
+				tick_shard(shard);
+				continue;
+			}
+
+			/* Write out whatever was waiting for room in the socket; a
+			 * corked queue waits for its deadline */
+			if ((events[i].events & EPOLLOUT) &&
+				(cli_node->state != CLIENT_CLOSED) && !cli_node->corked) {
+				flush_client(cli_node);
+			}
+
+			/* Zero-copy sends are reported done on the error queue */
+			if ((events[i].events & EPOLLERR) &&
+				(cli_node->outq.zerocopy != NULL)) {
+				reap_zerocopy(cli_node);
+			}
+
+			/* Read whatever arrived; a hang-up shows up as a 0-byte read.
+			 * Paused clients are read once they are resumed */
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+				(cli_node->state != CLIENT_CLOSED) && !cli_node->paused) {
+				handle_client(cli_node);
+			}
+		}
+
+		/* Removing stalled clients may let paused senders go, and resumed
+		 * senders may close further clients */
+		remove_closed_clients(shard);
+		resume_paused_clients(shard);
+		remove_closed_clients(shard);
+
+		/* Hand this round's broadcasts to the other shards */
+		flush_backlogs(shard);
+
+		end_round(shard);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	char *admin_path = NULL, *end;
+	int port_number, i, opt;
+
+	/* Log lines are written to stdout by a thread of their own */
+	if (!log_init(STDOUT_FILENO)) {
+		printf("main: cannot start logging\n");
+		exit(1);
+	}
+
+	/* Read the options; by default the number of clients is unbounded */
+	while ((opt = getopt(argc, argv, "m:q:p:s:b:H:n:A:C:Z:T:")) != -1) {
+		switch (opt) {
+		case 'm':
+			max_clients = atoi(optarg);
+			break;
+		case 'q':
+			queue_limit = (atoi(optarg) > 0) ? atoi(optarg) : 1;
+			break;
+		case 'p':
+			if (strcmp(optarg, "drop") == 0) {
+				slow_policy = SLOW_DROP_OLDEST;
+			} else if (strcmp(optarg, "disconnect") == 0) {
+				slow_policy = SLOW_DISCONNECT;
+			} else if (strcmp(optarg, "pause") == 0) {
+				slow_policy = SLOW_PAUSE_SENDER;
+			} else {
+				printf(USAGE);
+				exit(1);
+			}
+			break;
+		case 's':
+			num_shards = atoi(optarg);
+			if (num_shards <= 0) {
+				num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+			if (num_shards <= 0) {
+				num_shards = 1;
+			}
+			break;
+		case 'H':
+			if (!history_init(&history, optarg, MAX_ROOMS)) {
+				log_error("main: cannot keep history in %s", optarg);
+				exit(1);
+			}
+			keep_history = 1;
+			break;
+		case 'n':
+			replay_count = atoi(optarg);
+			break;
+		case 'A':
+			admin_path = optarg;
+			break;
+		case 'C':
+			cork_window = strtoull(optarg, &end, 10) * 1000;
+			if (*end == ',') {
+				cork_messages = (atoi(end + 1) > 0) ? atoi(end + 1) : 1;
+			}
+			break;
+		case 'Z':
+			zerocopy_min = strtoull(optarg, NULL, 10);
+			break;
+		case 'T':
+			idle_timeout = strtoull(optarg, &end, 10) * 1000000000ULL;
+			if (*end == ',') {
+				handshake_timeout = strtoull(end + 1, &end, 10) * 1000000000ULL;
+			}
+			if (*end == ',') {
+				stall_timeout = strtoull(end + 1, &end, 10) * 1000000000ULL;
+			}
+			timing = (idle_timeout > 0) || (handshake_timeout > 0) ||
+				(stall_timeout > 0);
+			break;
+		case 'b':
+			if (strcmp(optarg, "epoll") == 0) {
+				backend = BACKEND_EPOLL;
+			} else if (strcmp(optarg, "uring") == 0) {
+				backend = BACKEND_URING;
+			} else {
+				printf(USAGE);
+				exit(1);
+			}
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+
+	if ((backend == BACKEND_URING) && !uring_available()) {
+		log_warn("io_uring is not available; using epoll instead");
+		backend = BACKEND_EPOLL;
+	}
+
+	if ((backend == BACKEND_URING) && (zerocopy_min > 0)) {
+		log_warn("zero-copy sends need the epoll backend; copying instead");
+	}
+
+	/* Check that both a name and a port number are provided */
+	if (argc - optind < 2) {
+		printf(USAGE);
+		exit(1);
+	}
+
+	raise_fd_limit();
+
+	/* Writing to a client that has just hung up must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Get the port number from the argument provided */
+	port_number = atoi(argv[optind]);
+
+	shards = aligned_alloc(RING_CACHE_LINE, num_shards * sizeof(struct shard));
+	if ((shards == NULL) || !rcu_init(&rcu, num_shards) ||
+		!room_table_init(&rooms, MAX_ROOMS) ||
+		(room_table_get(&rooms, "lobby") != LOBBY) ||
+		(keep_history && (history_open(&history, LOBBY, "lobby") == NULL))) {
+		log_error("main: cannot allocate shards");
+		exit(1);
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		if (!init_shard(&shards[i], i, port_number)) {
+			exit(1);
+		}
+	}
+
+	/* Counters are kept whether or not anyone reads them */
+	metrics_init(counter_names, NUM_COUNTERS, histogram_names, NUM_HISTOGRAMS);
+	if ((admin_path != NULL) && !metrics_serve(admin_path, report_clients)) {
+		log_error("main: cannot open admin socket %s", admin_path);
+		exit(1);
+	}
+
+	/* The main thread serves the first shard itself */
+	for (i = 1; i < num_shards; i++) {
+		if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+			log_error("main: cannot start shard %d", i);
+			exit(1);
+		}
+	}
+
+	run_shard(&shards[0]);
+
 	return 0;
 }
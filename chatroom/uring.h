@@ -0,0 +1,276 @@
+/* uring.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A thin wrapper over the io_uring system calls, enough for the server's
+ * io_uring backend without depending on liburing.
+ *
+ * A ring is a pair of queues shared with the kernel: requests are written
+ * to the submission queue and handed over in batches with a single
+ * io_uring_enter, and results are read back from the completion queue.
+ * uring_register_buffers sets up a provided buffer ring, a pool of receive
+ * buffers the kernel picks from as data arrives, so that a receive does not
+ * pin a buffer per connection while it waits.
+ *
+ * */
+#ifndef URING_H
+#define URING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail;		/* entries prepared but not yet published */
+	unsigned int to_submit;			/* entries published but not yet entered */
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	/* provided receive buffers */
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned int buf_count;
+	unsigned int buf_len;
+	size_t buf_ring_len;
+};
+
+/* Creates a ring with room for entries submissions; returns 0 on failure
+ * and 1 on success */
+static inline int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return 0;
+	}
+
+	ring->sq_ring_len = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if ((ring->sq_ring == MAP_FAILED) || (ring->cq_ring == MAP_FAILED) ||
+		(ring->sqes == MAP_FAILED)) {
+		close(ring->fd);
+		return 0;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 1;
+}
+
+/* Returns 1 if the kernel behind the ring supports opcode */
+static inline int uring_supports(struct uring *ring, int opcode)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int supported = 0;
+
+	if ((probe = calloc(1, len)) == NULL) {
+		return 0;
+	}
+
+	if ((syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+				 probe, 256) == 0) && (opcode <= probe->last_op)) {
+		supported = (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+
+	free(probe);
+	return supported;
+}
+
+/* Hands every prepared submission to the kernel and, if wait is set, waits
+ * for at least one completion; returns the number submitted or -1 on
+ * failure */
+static inline int uring_submit(struct uring *ring, int wait)
+{
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	int rc;
+
+	/* Publish prepared entries to the kernel */
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	rc = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+				 wait ? 1 : 0, flags, NULL, 0);
+
+	/* An interrupted wait simply returns to the caller's loop */
+	if (rc < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	ring->to_submit -= rc;
+	return rc;
+}
+
+/* Returns a cleared submission entry to fill in, handing earlier entries to
+ * the kernel first if the queue is full; returns NULL if none is free */
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int index;
+
+	if (ring->sq_local_tail - head > ring->sq_mask) {
+		if (uring_submit(ring, 0) < 0) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head > ring->sq_mask) {
+			return NULL;
+		}
+	}
+
+	index = ring->sq_local_tail & ring->sq_mask;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/* Returns the oldest unread completion, or NULL if there is none */
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Marks the oldest completion as read */
+static inline void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Gives the receive buffer bid back to the kernel */
+static inline void uring_recycle_buffer(struct uring *ring, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+	unsigned short tail = ring->buf_ring->tail;
+
+	buf = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_len);
+	buf->len = ring->buf_len;
+	buf->bid = bid;
+
+	__atomic_store_n(&ring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the start of receive buffer bid */
+static inline char *uring_buffer(struct uring *ring, unsigned int bid)
+{
+	return ring->bufs + (size_t)bid * ring->buf_len;
+}
+
+/* Registers count receive buffers of len bytes each as buffer group group;
+ * count must be a power of two.  Returns 0 on failure and 1 on success */
+static inline int uring_register_buffers(struct uring *ring, unsigned int count,
+										 unsigned int len, int group)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	ring->buf_count = count;
+	ring->buf_len = len;
+	ring->buf_ring_len = count * sizeof(struct io_uring_buf);
+
+	ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		return 0;
+	}
+
+	if ((ring->bufs = malloc((size_t)count * len)) == NULL) {
+		return 0;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = group;
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) {
+		return 0;
+	}
+
+	ring->buf_ring->tail = 0;
+	for (i = 0; i < count; i++) {
+		uring_recycle_buffer(ring, i);
+	}
+
+	return 1;
+}
+
+/* Unmaps the ring and closes it */
+static inline void uring_destroy(struct uring *ring)
+{
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_len);
+	}
+	free(ring->bufs);
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+}
+
+#endif
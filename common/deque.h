@@ -0,0 +1,138 @@
+/* deque.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A bounded work-stealing deque of pointers, after Chase and Lev as
+ * adapted to C11 atomics by Le, Pop, Cohen and Zappa Nardelli.
+ *
+ * One thread owns the deque and pushes and pops at its bottom, last in
+ * first out, without a lock and, unless one item is left, without a
+ * compare-and-swap.  Any other thread may steal from its top, first in
+ * first out, with one compare-and-swap.  The owner and thieves only meet
+ * on the last item.
+ *
+ * */
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdlib.h>
+
+#define DEQUE_CACHE_LINE 64
+
+struct work_deque {
+	void **slots;
+	long mask;						/* capacity - 1; capacity is a power of two */
+
+	/* advanced by thieves, and by the owner taking the last item */
+	_Alignas(DEQUE_CACHE_LINE) long top;
+
+	/* written by the owner */
+	_Alignas(DEQUE_CACHE_LINE) long bottom;
+};
+
+/* Prepares an empty deque holding at least capacity pointers; returns 0 on
+ * failure and 1 on success */
+static inline int deque_init(struct work_deque *deque, long capacity)
+{
+	long size = 2;
+
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	if ((deque->slots = calloc(size, sizeof(void *))) == NULL) {
+		return 0;
+	}
+
+	deque->mask = size - 1;
+	deque->top = deque->bottom = 0;
+
+	return 1;
+}
+
+/* Frees the deque's slots; anything still queued is forgotten */
+static inline void deque_destroy(struct work_deque *deque)
+{
+	free(deque->slots);
+	deque->slots = NULL;
+}
+
+/* Called by the owner to add item at the bottom; returns 0 if the deque is
+ * full and 1 on success */
+static inline int deque_push(struct work_deque *deque, void *item)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (bottom - top > deque->mask) {
+		return 0;
+	}
+
+	__atomic_store_n(&deque->slots[bottom & deque->mask], item,
+					 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/* Called by the owner to take the newest item; returns NULL if the deque is
+ * empty */
+static inline void *deque_pop(struct work_deque *deque)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	long top;
+	void *item;
+
+	/* Claim the bottom slot before looking at what thieves have taken */
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	item = __atomic_load_n(&deque->slots[bottom & deque->mask],
+						   __ATOMIC_RELAXED);
+
+	/* The last item goes to whichever of the owner and a thief takes it
+	 * first */
+	if (top == bottom) {
+		if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+										 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			item = NULL;
+		}
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+
+	return item;
+}
+
+/* Called by any other thread to take the oldest item; returns NULL if the
+ * deque is empty or another thread took the item first */
+static inline void *deque_steal(struct work_deque *deque)
+{
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long bottom;
+	void *item;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom) {
+		return NULL;
+	}
+
+	item = __atomic_load_n(&deque->slots[top & deque->mask], __ATOMIC_RELAXED);
+
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+									 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	return item;
+}
+
+#endif
@@ -0,0 +1,329 @@
+/* log.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Asynchronous logging that keeps formatting output and writing it off the
+ * threads doing the work.
+ *
+ * Each thread that logs gets its own ring of fixed-size records, created on
+ * its first log call.  A log call formats its text straight into the next
+ * free record and publishes it with one store: no lock, no system call and
+ * nothing shared with other threads.  A background writer thread drains
+ * every ring, adds the time and level to each record and writes the lot
+ * with as few writes as possible.  If a thread logs faster than the writer
+ * keeps up, records that do not fit are dropped and counted rather than
+ * making the thread wait.
+ *
+ * Calls below LOG_LEVEL are removed by the preprocessor, arguments and all;
+ * build with -DLOG_LEVEL=LOG_DEBUG to keep debug records.  Records still
+ * queued at exit are written out by an atexit handler.
+ *
+ * */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_CACHE_LINE 64
+
+/* longest text kept from one log call */
+#define LOG_RECORD_LEN 240
+
+/* number of records in each thread's ring; a power of two */
+#define LOG_RING_LEN 4096
+
+/* how long the writer sleeps once every ring is empty */
+#define LOG_FLUSH_MS 10
+
+/* size of the buffer the writer fills before each write */
+#define LOG_WRITE_BUF 65536
+
+struct log_record {
+	struct timespec time;
+	int level;
+	char text[LOG_RECORD_LEN];
+};
+
+/* One thread's records; the thread is the only producer and the writer the
+ * only consumer */
+struct log_ring {
+	struct log_record *records;
+	int thread;						/* number given to the thread */
+	int closed;						/* the thread has exited */
+	struct log_ring *next;
+
+	/* written by the writer */
+	_Alignas(LOG_CACHE_LINE) unsigned int head;
+
+	/* written by the thread */
+	_Alignas(LOG_CACHE_LINE) unsigned int tail;
+	unsigned int cached_head;
+	unsigned long dropped;			/* records that did not fit */
+};
+
+static struct {
+	int fd;
+	int started;
+	int num_threads;
+	struct log_ring *rings;			/* every thread's ring */
+	pthread_mutex_t rings_lock;		/* held to add a ring */
+	pthread_mutex_t drain_lock;		/* held by whoever drains the rings */
+	pthread_key_t key;
+	pthread_t writer;
+	char buf[LOG_WRITE_BUF];
+	size_t buf_len;
+} log_state = {
+	.fd = 1,
+	.rings_lock = PTHREAD_MUTEX_INITIALIZER,
+	.drain_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread struct log_ring *log_ring;
+
+/* Marks the exiting thread's ring closed; the writer frees it once empty */
+static inline void log_thread_exit(void *ring)
+{
+	__atomic_store_n(&((struct log_ring *)ring)->closed, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the calling thread's ring, creating it on first use; returns NULL
+ * if no memory can be allocated */
+static inline struct log_ring *log_thread_ring(void)
+{
+	struct log_ring *ring;
+
+	if (log_ring != NULL) {
+		return log_ring;
+	}
+
+	ring = aligned_alloc(LOG_CACHE_LINE, sizeof(struct log_ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+
+	if ((ring->records = malloc(LOG_RING_LEN * sizeof(struct log_record))) == NULL) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_state.rings_lock);
+	ring->thread = log_state.num_threads++;
+	ring->next = log_state.rings;
+	__atomic_store_n(&log_state.rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_state.rings_lock);
+
+	if (log_state.started) {
+		pthread_setspecific(log_state.key, ring);
+	}
+
+	return log_ring = ring;
+}
+
+/* Queues a record on the calling thread's ring; use the log_* macros so
+ * that calls below LOG_LEVEL disappear */
+static inline void log_write(int level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static inline void log_write(int level, const char *format, ...)
+{
+	struct log_ring *ring = log_thread_ring();
+	struct log_record *record;
+	unsigned int tail;
+	va_list args;
+
+	if (ring == NULL) {
+		return;
+	}
+
+	tail = ring->tail;
+	if (tail - ring->cached_head >= LOG_RING_LEN) {
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->cached_head >= LOG_RING_LEN) {
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	record = &ring->records[tail & (LOG_RING_LEN - 1)];
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->level = level;
+
+	va_start(args, format);
+	vsnprintf(record->text, LOG_RECORD_LEN, format, args);
+	va_end(args);
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#if LOG_LEVEL <= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_INFO
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_WARN
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void)0)
+#endif
+
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+/* Writes out whatever the writer has buffered */
+static inline void log_write_out(void)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < log_state.buf_len) {
+		if ((n = write(log_state.fd, log_state.buf + done,
+					   log_state.buf_len - done)) <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	log_state.buf_len = 0;
+}
+
+/* Appends one formatted line to the writer's buffer */
+static inline void log_append(const struct timespec *time, int level,
+							  int thread, const char *text)
+{
+	static const char *levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+	struct tm tm;
+	int n;
+
+	if (log_state.buf_len + LOG_RECORD_LEN + 64 > LOG_WRITE_BUF) {
+		log_write_out();
+	}
+
+	localtime_r(&time->tv_sec, &tm);
+	n = snprintf(log_state.buf + log_state.buf_len,
+				 LOG_WRITE_BUF - log_state.buf_len,
+				 "%04d-%02d-%02d %02d:%02d:%02d.%06ld %-5s [%d] %s\n",
+				 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+				 tm.tm_min, tm.tm_sec, time->tv_nsec / 1000,
+				 levels[level], thread, text);
+
+	if (n > 0) {
+		log_state.buf_len += n;
+	}
+}
+
+/* Writes out every queued record, freeing the rings of threads that have
+ * exited; returns the number of records written */
+static inline int log_drain(void)
+{
+	struct log_ring *ring, **link;
+	struct log_record *record;
+	struct timespec now;
+	char text[64];
+	unsigned long dropped;
+	unsigned int head, tail;
+	int written = 0;
+
+	pthread_mutex_lock(&log_state.drain_lock);
+
+	link = &log_state.rings;
+	while ((ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			record = &ring->records[head & (LOG_RING_LEN - 1)];
+			log_append(&record->time, record->level, ring->thread, record->text);
+			written++;
+		}
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+		if ((dropped = __atomic_exchange_n(&ring->dropped, 0,
+										   __ATOMIC_RELAXED)) > 0) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			snprintf(text, sizeof(text), "%lu log records dropped", dropped);
+			log_append(&now, LOG_WARN, ring->thread, text);
+		}
+
+		/* An empty ring whose thread has exited is unlinked and freed; if
+		 * another thread is adding its ring right now, that waits for the
+		 * next drain */
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+			(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) &&
+			(pthread_mutex_trylock(&log_state.rings_lock) == 0)) {
+			*link = ring->next;
+			pthread_mutex_unlock(&log_state.rings_lock);
+			free(ring->records);
+			free(ring);
+			continue;
+		}
+
+		link = &ring->next;
+	}
+
+	log_write_out();
+
+	pthread_mutex_unlock(&log_state.drain_lock);
+
+	return written;
+}
+
+/* Drains the rings for as long as the program runs */
+static inline void *log_writer(void *args)
+{
+	(void)args;
+
+	while (1) {
+		if (log_drain() == 0) {
+			usleep(LOG_FLUSH_MS * 1000);
+		}
+	}
+
+	return NULL;
+}
+
+/* Writes out every record still queued when the program exits */
+static inline void log_flush(void)
+{
+	log_drain();
+}
+
+/* Starts the writer thread, writing to fd; returns 0 on failure and 1 on
+ * success */
+static inline int log_init(int fd)
+{
+	log_state.fd = fd;
+
+	if (pthread_key_create(&log_state.key, log_thread_exit) != 0) {
+		return 0;
+	}
+
+	/* A thread that logged before now is never reported as exited */
+	log_state.started = 1;
+	atexit(log_flush);
+
+	return (pthread_create(&log_state.writer, NULL, log_writer, NULL) == 0);
+}
+
+#endif
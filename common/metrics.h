@@ -0,0 +1,441 @@
+/* metrics.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Counters and latency histograms kept per thread and read over a local
+ * admin socket.
+ *
+ * Each thread that counts gets a slot of its own on its first update, so
+ * an update is a plain load and store to memory no other thread writes: no
+ * lock and no atomic read-modify-write.  Reading the metrics sums every
+ * slot, so totals lag updates in flight by at most a few counts.  Slots are
+ * never freed, so what an exited thread counted stays in the totals.
+ *
+ * Histograms are log-linear in the manner of HdrHistogram: values are
+ * bucketed by their highest set bit and split into METRICS_SUB_BUCKETS
+ * linear steps within each power of two, which bounds the error of any
+ * reported percentile to about 3% over the whole 64-bit range.
+ *
+ * metrics_serve listens on a Unix socket.  Each connection may send one
+ * line, "json" or "text", and is sent every metric in that format before
+ * the connection is closed; anything else, or nothing within a second,
+ * means text.  A program may add a section of its own with a report
+ * callback.
+ *
+ * */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define METRICS_MAX_COUNTERS 32
+#define METRICS_MAX_HISTOGRAMS 4
+
+/* linear steps within each power of two of a histogram */
+#define METRICS_SUB_BITS 5
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+/* longest command read from an admin connection */
+#define METRICS_COMMAND_LEN 64
+
+struct metrics_histogram {
+	uint64_t count;					/* only filled in when summed */
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+/* Everything one thread has counted */
+struct metrics_slot {
+	uint64_t counters[METRICS_MAX_COUNTERS];
+	struct metrics_histogram histograms[METRICS_MAX_HISTOGRAMS];
+	struct metrics_slot *next;
+};
+
+static struct {
+	const char **counter_names;
+	int num_counters;
+	const char **histogram_names;
+	int num_histograms;
+	struct metrics_slot *slots;			/* every thread's slot */
+	pthread_mutex_t slots_lock;			/* held to add a slot */
+	void (*report)(FILE *out, int json);
+	int listen_fd;
+	pthread_t server;
+} metrics_state = {
+	.slots_lock = PTHREAD_MUTEX_INITIALIZER,
+	.listen_fd = -1
+};
+
+static __thread struct metrics_slot *metrics_slot;
+
+/* Returns the calling thread's slot, creating it on first use; returns NULL
+ * if no memory can be allocated */
+static inline struct metrics_slot *metrics_thread_slot(void)
+{
+	struct metrics_slot *slot;
+
+	if (metrics_slot != NULL) {
+		return metrics_slot;
+	}
+
+	if ((slot = calloc(1, sizeof(struct metrics_slot))) == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&metrics_state.slots_lock);
+	slot->next = metrics_state.slots;
+	__atomic_store_n(&metrics_state.slots, slot, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&metrics_state.slots_lock);
+
+	return metrics_slot = slot;
+}
+
+/* Adds n to the calling thread's copy of a value only it writes */
+static inline void metrics_bump(uint64_t *value, uint64_t n)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+					 __ATOMIC_RELAXED);
+}
+
+/* Adds n to counter */
+static inline void metrics_add(int counter, uint64_t n)
+{
+	struct metrics_slot *slot = metrics_thread_slot();
+
+	if (slot != NULL) {
+		metrics_bump(&slot->counters[counter], n);
+	}
+}
+
+/* Returns the bucket of a histogram holding value */
+static inline int metrics_bucket(uint64_t value)
+{
+	int top;
+
+	if (value < METRICS_SUB_BUCKETS) {
+		return (int)value;
+	}
+
+	top = 63 - __builtin_clzll(value);
+
+	return (top - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+		(int)((value >> (top - METRICS_SUB_BITS)) - METRICS_SUB_BUCKETS);
+}
+
+/* Returns the highest value that falls in bucket */
+static inline uint64_t metrics_bucket_high(int bucket)
+{
+	int group = bucket / METRICS_SUB_BUCKETS;
+	uint64_t step = bucket % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+
+	if (group == 0) {
+		return bucket;
+	}
+
+	return ((step + 1) << (group - 1)) - 1;
+}
+
+/* Adds value to histogram */
+static inline void metrics_record(int histogram, uint64_t value)
+{
+	struct metrics_slot *slot = metrics_thread_slot();
+	struct metrics_histogram *h;
+
+	if (slot == NULL) {
+		return;
+	}
+
+	h = &slot->histograms[histogram];
+	metrics_bump(&h->buckets[metrics_bucket(value)], 1);
+	metrics_bump(&h->sum, value);
+	if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+/* Returns the time in nanoseconds on a clock that never goes back, for
+ * measuring latencies */
+static inline uint64_t metrics_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Returns the sum of counter over every thread */
+static inline uint64_t metrics_counter(int counter)
+{
+	struct metrics_slot *slot;
+	uint64_t total = 0;
+
+	for (slot = __atomic_load_n(&metrics_state.slots, __ATOMIC_ACQUIRE);
+		 slot != NULL; slot = slot->next) {
+		total += __atomic_load_n(&slot->counters[counter], __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+/* Sums histogram over every thread into total */
+static inline void metrics_histogram(int histogram,
+									 struct metrics_histogram *total)
+{
+	struct metrics_slot *slot;
+	struct metrics_histogram *h;
+	uint64_t max;
+	int i;
+
+	memset(total, 0, sizeof(*total));
+
+	for (slot = __atomic_load_n(&metrics_state.slots, __ATOMIC_ACQUIRE);
+		 slot != NULL; slot = slot->next) {
+		h = &slot->histograms[histogram];
+
+		for (i = 0; i < METRICS_BUCKETS; i++) {
+			total->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		}
+		total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		if ((max = __atomic_load_n(&h->max, __ATOMIC_RELAXED)) > total->max) {
+			total->max = max;
+		}
+	}
+
+	/* Counted from the buckets so that percentiles add up */
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		total->count += total->buckets[i];
+	}
+}
+
+/* Returns the value below which a share of quantile of the histogram's
+ * values fall, to within the bucket width */
+static inline uint64_t metrics_percentile(const struct metrics_histogram *h,
+										  double quantile)
+{
+	uint64_t rank, seen = 0, high;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t)(quantile * h->count);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			high = metrics_bucket_high(i);
+			return (high < h->max) ? high : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/* Writes s as a JSON string */
+static inline void metrics_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+
+	for (; *s != '\0'; s++) {
+		if ((*s == '"') || (*s == '\\')) {
+			fprintf(out, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(out, "\\u%04x", (unsigned char)*s);
+		} else {
+			fputc(*s, out);
+		}
+	}
+
+	fputc('"', out);
+}
+
+/* Writes every metric to out as one "name value" line each */
+static inline void metrics_write_text(FILE *out, struct metrics_histogram *h)
+{
+	const char *name;
+	int i;
+
+	for (i = 0; i < metrics_state.num_counters; i++) {
+		fprintf(out, "%s %llu\n", metrics_state.counter_names[i],
+				(unsigned long long)metrics_counter(i));
+	}
+
+	for (i = 0; i < metrics_state.num_histograms; i++) {
+		name = metrics_state.histogram_names[i];
+		metrics_histogram(i, h);
+
+		fprintf(out, "%s_count %llu\n", name, (unsigned long long)h->count);
+		fprintf(out, "%s_mean %llu\n", name,
+				(unsigned long long)((h->count > 0) ? h->sum / h->count : 0));
+		fprintf(out, "%s_p50 %llu\n", name,
+				(unsigned long long)metrics_percentile(h, 0.5));
+		fprintf(out, "%s_p90 %llu\n", name,
+				(unsigned long long)metrics_percentile(h, 0.9));
+		fprintf(out, "%s_p99 %llu\n", name,
+				(unsigned long long)metrics_percentile(h, 0.99));
+		fprintf(out, "%s_p999 %llu\n", name,
+				(unsigned long long)metrics_percentile(h, 0.999));
+		fprintf(out, "%s_max %llu\n", name, (unsigned long long)h->max);
+	}
+
+	if (metrics_state.report != NULL) {
+		metrics_state.report(out, 0);
+	}
+}
+
+/* Writes every metric to out as one JSON object */
+static inline void metrics_write_json(FILE *out, struct metrics_histogram *h)
+{
+	int i;
+
+	fprintf(out, "{\"counters\":{");
+	for (i = 0; i < metrics_state.num_counters; i++) {
+		fprintf(out, "%s\"%s\":%llu", (i > 0) ? "," : "",
+				metrics_state.counter_names[i],
+				(unsigned long long)metrics_counter(i));
+	}
+
+	fprintf(out, "},\"histograms\":{");
+	for (i = 0; i < metrics_state.num_histograms; i++) {
+		metrics_histogram(i, h);
+
+		fprintf(out, "%s\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,"
+				"\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+				(i > 0) ? "," : "", metrics_state.histogram_names[i],
+				(unsigned long long)h->count,
+				(unsigned long long)((h->count > 0) ? h->sum / h->count : 0),
+				(unsigned long long)metrics_percentile(h, 0.5),
+				(unsigned long long)metrics_percentile(h, 0.9),
+				(unsigned long long)metrics_percentile(h, 0.99),
+				(unsigned long long)metrics_percentile(h, 0.999),
+				(unsigned long long)h->max);
+	}
+	fprintf(out, "}");
+
+	if (metrics_state.report != NULL) {
+		fprintf(out, ",");
+		metrics_state.report(out, 1);
+	}
+
+	fprintf(out, "}\n");
+}
+
+/* Writes every metric to out, as JSON or as text */
+static inline void metrics_write(FILE *out, int json)
+{
+	struct metrics_histogram *h;
+
+	/* Too large for the stack of a small thread */
+	if ((h = malloc(sizeof(struct metrics_histogram))) == NULL) {
+		return;
+	}
+
+	if (json) {
+		metrics_write_json(out, h);
+	} else {
+		metrics_write_text(out, h);
+	}
+
+	free(h);
+}
+
+/* Answers admin connections for as long as the program runs */
+static inline void *metrics_server(void *args)
+{
+	struct timeval timeout = {1, 0};
+	char command[METRICS_COMMAND_LEN];
+	ssize_t n;
+	FILE *out;
+	int fd;
+
+	(void)args;
+
+	while (1) {
+		if ((fd = accept(metrics_state.listen_fd, NULL, NULL)) < 0) {
+			continue;
+		}
+
+		/* An admin client that says nothing gets text */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		if ((n = read(fd, command, sizeof(command) - 1)) < 0) {
+			n = 0;
+		}
+		command[n] = '\0';
+
+		if ((out = fdopen(fd, "w")) == NULL) {
+			close(fd);
+			continue;
+		}
+
+		metrics_write(out, strncmp(command, "json", 4) == 0);
+		fclose(out);
+	}
+
+	return NULL;
+}
+
+/* Names the counters and histograms counted with metrics_add and
+ * metrics_record, by index */
+static inline void metrics_init(const char **counter_names, int num_counters,
+								const char **histogram_names,
+								int num_histograms)
+{
+	metrics_state.counter_names = counter_names;
+	metrics_state.num_counters = num_counters;
+	metrics_state.histogram_names = histogram_names;
+	metrics_state.num_histograms = num_histograms;
+}
+
+/* Starts answering admin connections on a Unix socket at path, replacing
+ * any socket left there; report, if not NULL, writes a section of the
+ * program's own after the metrics.  As JSON that section is written as
+ * members of the top-level object.  Returns 0 on failure and 1 on success */
+static inline int metrics_serve(const char *path,
+								void (*report)(FILE *out, int json))
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return 0;
+	}
+
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+		(listen(fd, 8) < 0)) {
+		close(fd);
+		return 0;
+	}
+
+	metrics_state.report = report;
+	metrics_state.listen_fd = fd;
+
+	return (pthread_create(&metrics_state.server, NULL, metrics_server,
+						   NULL) == 0);
+}
+
+#endif
@@ -0,0 +1,237 @@
+/* pool.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Pools of fixed-size objects, so that objects made and freed all the time
+ * cost no call to malloc or free once the pool has grown to what the
+ * program needs.
+ *
+ * Each thread keeps a cache of free objects of every pool it uses, and
+ * allocates from and frees to that cache without a lock.  A cache that
+ * runs dry takes a batch of POOL_BATCH objects from the pool's depot, or
+ * carves a new batch from one malloc if the depot is empty; a cache that
+ * grows past POOL_CACHE_MAX hands a batch back to the depot.  Objects may
+ * be freed on another thread than the one that allocated them, and move
+ * back through the depot.  Memory is never given back to the system, and
+ * a thread's cache is emptied into the depots when the thread exits.
+ *
+ * */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/* most pools a program may have */
+#define POOL_MAX_POOLS 16
+
+/* objects moved between a thread's cache and the depot at a time */
+#define POOL_BATCH 64
+
+/* most free objects a thread keeps of each pool */
+#define POOL_CACHE_MAX (4 * POOL_BATCH)
+
+/* alignment of every object; at least the size of struct pool_free */
+#define POOL_ALIGN 16
+
+/* A free object; the first word links it into a cache or a batch, and the
+ * second links whole batches in the depot */
+struct pool_free {
+	struct pool_free *next;
+	struct pool_free *next_batch;
+};
+
+struct pool {
+	size_t size;
+	int index;						/* slot of the pool in every thread's
+									 * caches, counted from 1 */
+	pthread_mutex_t lock;			/* held to use the depot */
+	struct pool_free *depot;		/* full batches of free objects */
+};
+
+/* Declares a pool of objects of object_size bytes; sizes are rounded up to
+ * a multiple of POOL_ALIGN so that every object is aligned as malloc's are */
+#define POOL_INITIALIZER(object_size) { \
+	.size = ((object_size) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN, \
+	.index = 0, \
+	.lock = PTHREAD_MUTEX_INITIALIZER, \
+	.depot = NULL \
+}
+
+/* One thread's free objects of one pool */
+struct pool_cache {
+	struct pool *pool;
+	struct pool_free *head;
+	int count;
+};
+
+static struct {
+	int num_pools;
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	pthread_key_t key;
+} pool_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT
+};
+
+static __thread struct pool_cache pool_caches[POOL_MAX_POOLS];
+static __thread int pool_thread_known;
+
+/* Hands the first count objects of the cache to the depot as one batch */
+static inline void pool_give_batch(struct pool_cache *cache, int count)
+{
+	struct pool_free *batch = cache->head, *last = batch;
+	struct pool *p = cache->pool;
+	int i;
+
+	for (i = 1; i < count; i++) {
+		last = last->next;
+	}
+	cache->head = last->next;
+	cache->count -= count;
+	last->next = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	batch->next_batch = p->depot;
+	p->depot = batch;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Empties every cache of the exiting thread into the depots */
+static inline void pool_thread_exit(void *unused)
+{
+	struct pool_cache *cache;
+	int i;
+
+	(void)unused;
+
+	for (i = 0; i < POOL_MAX_POOLS; i++) {
+		cache = &pool_caches[i];
+
+		while (cache->count > 0) {
+			pool_give_batch(cache, (cache->count < POOL_BATCH) ?
+							cache->count : POOL_BATCH);
+		}
+	}
+}
+
+static inline void pool_make_key(void)
+{
+	pthread_key_create(&pool_state.key, pool_thread_exit);
+}
+
+/* Returns the calling thread's cache of p, giving p its slot on its first
+ * use by any thread; returns NULL if there are too many pools */
+static inline struct pool_cache *pool_cache(struct pool *p)
+{
+	int index = __atomic_load_n(&p->index, __ATOMIC_ACQUIRE);
+
+	if (index == 0) {
+		pthread_mutex_lock(&pool_state.lock);
+		if ((index = p->index) == 0) {
+			if (pool_state.num_pools == POOL_MAX_POOLS) {
+				pthread_mutex_unlock(&pool_state.lock);
+				return NULL;
+			}
+			index = ++pool_state.num_pools;
+			__atomic_store_n(&p->index, index, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pool_state.lock);
+	}
+
+	/* The cache is emptied when the thread exits */
+	if (!pool_thread_known) {
+		pthread_once(&pool_state.once, pool_make_key);
+		pthread_setspecific(pool_state.key, pool_caches);
+		pool_thread_known = 1;
+	}
+
+	pool_caches[index - 1].pool = p;
+
+	return &pool_caches[index - 1];
+}
+
+/* Fills an empty cache with a batch from the depot, or with a new batch if
+ * the depot is empty; returns 0 if no memory can be allocated and 1 on
+ * success */
+static inline int pool_take_batch(struct pool_cache *cache)
+{
+	struct pool *p = cache->pool;
+	struct pool_free *batch;
+	char *slab;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	if ((batch = p->depot) != NULL) {
+		p->depot = batch->next_batch;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (batch != NULL) {
+		cache->head = batch;
+		for (cache->count = 0; batch != NULL; batch = batch->next) {
+			cache->count++;
+		}
+		return 1;
+	}
+
+	if ((slab = malloc(POOL_BATCH * p->size)) == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < POOL_BATCH; i++) {
+		batch = (struct pool_free *)(slab + i * p->size);
+		batch->next = (i + 1 < POOL_BATCH) ?
+			(struct pool_free *)(slab + (i + 1) * p->size) : NULL;
+	}
+
+	cache->head = (struct pool_free *)slab;
+	cache->count = POOL_BATCH;
+
+	return 1;
+}
+
+/* Returns an object from the pool, or NULL if no memory can be allocated;
+ * its contents are undefined */
+static inline void *pool_alloc(struct pool *p)
+{
+	struct pool_cache *cache = pool_cache(p);
+	struct pool_free *obj;
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	if ((cache->count == 0) && !pool_take_batch(cache)) {
+		return NULL;
+	}
+
+	obj = cache->head;
+	cache->head = obj->next;
+	cache->count--;
+
+	return obj;
+}
+
+/* Returns obj, allocated from the pool on any thread, to the pool */
+static inline void pool_free(struct pool *p, void *obj)
+{
+	struct pool_cache *cache = pool_cache(p);
+	struct pool_free *node = obj;
+
+	/* A pool only runs out of slots before its first allocation */
+	if (cache == NULL) {
+		return;
+	}
+
+	node->next = cache->head;
+	cache->head = node;
+	cache->count++;
+
+	if (cache->count > POOL_CACHE_MAX) {
+		pool_give_batch(cache, POOL_BATCH);
+	}
+}
+
+#endif
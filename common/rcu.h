@@ -0,0 +1,161 @@
+/* rcu.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Quiescent-state-based reclamation for data that many threads read and
+ * few threads replace.
+ *
+ * A writer never changes shared data in place: it builds a new version,
+ * publishes it with a single pointer store and retires the old version.
+ * Readers load the pointer and use what they find without taking a lock.
+ * Each reader thread reports a quiescent state whenever it holds no
+ * pointer to shared data, typically once per trip around its event loop.
+ * A retired version is freed only once every reader has reported a
+ * quiescent state since it was retired, so no one can still be using it.
+ *
+ * A reader about to block reports itself offline, and is treated as
+ * quiescent until it comes back online, so that a sleeping thread does not
+ * hold back reclamation.
+ *
+ * */
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdlib.h>
+
+#define RCU_CACHE_LINE 64
+
+/* epoch reported by a reader that is offline */
+#define RCU_OFFLINE (~0UL)
+
+struct rcu_reader {
+	_Alignas(RCU_CACHE_LINE) unsigned long seen;	/* last epoch observed */
+};
+
+struct rcu_domain {
+	_Alignas(RCU_CACHE_LINE) unsigned long epoch;	/* bumped by every retire */
+	struct rcu_reader *readers;
+	int num_readers;
+};
+
+/* Placed at the start of every object that may be retired */
+struct rcu_head {
+	struct rcu_head *next;
+	unsigned long epoch;			/* epoch at which it was retired */
+};
+
+/* Objects retired by one writer, oldest first */
+struct rcu_garbage {
+	struct rcu_head *head;
+	struct rcu_head *tail;
+};
+
+/* Prepares a domain for num_readers reader threads, all online; returns 0
+ * on failure and 1 on success */
+static inline int rcu_init(struct rcu_domain *domain, int num_readers)
+{
+	int i;
+
+	domain->epoch = 0;
+	domain->num_readers = num_readers;
+	domain->readers = aligned_alloc(RCU_CACHE_LINE,
+									num_readers * sizeof(struct rcu_reader));
+
+	if (domain->readers == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < num_readers; i++) {
+		domain->readers[i].seen = 0;
+	}
+
+	return 1;
+}
+
+/* Reports that reader holds no pointer to shared data */
+static inline void rcu_quiescent(struct rcu_domain *domain, int reader)
+{
+	__atomic_store_n(&domain->readers[reader].seen,
+					 __atomic_load_n(&domain->epoch, __ATOMIC_ACQUIRE),
+					 __ATOMIC_RELEASE);
+}
+
+/* Reports that reader is about to block holding no pointer to shared data */
+static inline void rcu_offline(struct rcu_domain *domain, int reader)
+{
+	__atomic_store_n(&domain->readers[reader].seen, RCU_OFFLINE,
+					 __ATOMIC_RELEASE);
+}
+
+/* Reports that reader is back and may load shared pointers again */
+static inline void rcu_online(struct rcu_domain *domain, int reader)
+{
+	__atomic_store_n(&domain->readers[reader].seen,
+					 __atomic_load_n(&domain->epoch, __ATOMIC_ACQUIRE),
+					 __ATOMIC_SEQ_CST);
+
+	/* The writer must see this reader online before the reader looks at
+	 * anything it may go on to free */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Prepares an empty list of retired objects */
+static inline void rcu_garbage_init(struct rcu_garbage *garbage)
+{
+	garbage->head = garbage->tail = NULL;
+}
+
+/* Queues obj, already replaced by a newer version, to be freed once no
+ * reader can hold it any more */
+static inline void rcu_retire(struct rcu_domain *domain,
+							  struct rcu_garbage *garbage,
+							  struct rcu_head *obj)
+{
+	obj->next = NULL;
+	obj->epoch = __atomic_add_fetch(&domain->epoch, 1, __ATOMIC_ACQ_REL);
+
+	if (garbage->tail == NULL) {
+		garbage->head = obj;
+	} else {
+		garbage->tail->next = obj;
+	}
+	garbage->tail = obj;
+}
+
+/* Frees, with free(), every retired object that no reader can still hold;
+ * returns the number of objects freed */
+static inline int rcu_reclaim(struct rcu_domain *domain,
+							  struct rcu_garbage *garbage)
+{
+	struct rcu_head *obj;
+	unsigned long oldest = RCU_OFFLINE, seen;
+	int i, freed = 0;
+
+	if (garbage->head == NULL) {
+		return 0;
+	}
+
+	/* Order the scan after the stores publishing newer versions */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < domain->num_readers; i++) {
+		seen = __atomic_load_n(&domain->readers[i].seen, __ATOMIC_ACQUIRE);
+		if (seen < oldest) {
+			oldest = seen;
+		}
+	}
+
+	while (((obj = garbage->head) != NULL) && (obj->epoch <= oldest)) {
+		garbage->head = obj->next;
+		free(obj);
+		freed++;
+	}
+
+	if (garbage->head == NULL) {
+		garbage->tail = NULL;
+	}
+
+	return freed;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/* ring.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A bounded, lock-free queue of pointers between exactly one producer
+ * thread and exactly one consumer thread.
+ *
+ * The producer only ever writes tail and the consumer only ever writes head,
+ * so neither side takes a lock or spins on a compare-and-swap; each keeps a
+ * cached copy of the other's index and rereads it only when the ring looks
+ * full or empty.  The two sides live on separate cache lines so that they
+ * do not bounce a line between cores.
+ *
+ * */
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+
+#define RING_CACHE_LINE 64
+
+struct spsc_ring {
+	void **slots;
+	unsigned int mask;				/* capacity - 1; capacity is a power of two */
+
+	/* written by the consumer */
+	_Alignas(RING_CACHE_LINE) unsigned int head;
+	unsigned int cached_tail;
+
+	/* written by the producer */
+	_Alignas(RING_CACHE_LINE) unsigned int tail;
+	unsigned int cached_head;
+};
+
+/* Prepares an empty ring holding at least capacity pointers; returns 0 on
+ * failure and 1 on success */
+static inline int spsc_ring_init(struct spsc_ring *ring, unsigned int capacity)
+{
+	unsigned int size = 2;
+
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	if ((ring->slots = calloc(size, sizeof(void *))) == NULL) {
+		return 0;
+	}
+
+	ring->mask = size - 1;
+	ring->head = ring->cached_tail = 0;
+	ring->tail = ring->cached_head = 0;
+
+	return 1;
+}
+
+/* Frees the ring's slots; anything still queued is forgotten */
+static inline void spsc_ring_destroy(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/* Called by the producer to add item; returns 0 if the ring is full and 1
+ * on success */
+static inline int spsc_ring_push(struct spsc_ring *ring, void *item)
+{
+	unsigned int tail = ring->tail;
+
+	if (tail - ring->cached_head > ring->mask) {
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->cached_head > ring->mask) {
+			return 0;
+		}
+	}
+
+	ring->slots[tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* Called by the consumer to take the oldest item; returns NULL if the ring
+ * is empty */
+static inline void *spsc_ring_pop(struct spsc_ring *ring)
+{
+	unsigned int head = ring->head;
+	void *item;
+
+	if (head == ring->cached_tail) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == ring->cached_tail) {
+			return NULL;
+		}
+	}
+
+	item = ring->slots[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+#endif
@@ -0,0 +1,172 @@
+/* timerwheel.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A hashed timer wheel, after Varghese and Lauck, for keeping a deadline on
+ * every connection of a server that may have a great many.
+ *
+ * Time is cut into ticks of tick_ns nanoseconds on the monotonic clock, and
+ * a timer due at tick T waits in slot T % num_slots.  Adding and cancelling
+ * a timer only link it into and out of its slot's list, whatever the number
+ * of timers.  Advancing the wheel visits one slot per tick that has passed;
+ * timers in a slot that are due a turn or more later stay where they are.
+ * Deadlines are rounded up to the next tick, so a timer never fires early
+ * and fires at most one tick late.
+ *
+ * A timer is embedded in whatever it times, like a struct work (see
+ * workers.h), so timing something allocates nothing.  A wheel belongs to
+ * one thread.
+ *
+ * */
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct timer {
+	void (*fire)(struct timer *timer);
+	struct timer *next;
+	struct timer **pprev;			/* link pointing here; NULL if not set */
+	uint64_t expires;				/* tick at which the timer fires */
+};
+
+struct timer_wheel {
+	struct timer **slots;
+	uint64_t mask;					/* number of slots - 1, a power of two */
+	uint64_t tick_ns;
+	uint64_t current;				/* last tick the wheel has reached */
+	unsigned long count;			/* timers set */
+};
+
+/* Prepares an empty wheel of at least num_slots slots of tick_ns each,
+ * starting at now; returns 0 on failure and 1 on success */
+static inline int timer_wheel_init(struct timer_wheel *wheel,
+								   unsigned int num_slots, uint64_t tick_ns,
+								   uint64_t now)
+{
+	uint64_t size = 2;
+
+	while (size < num_slots) {
+		size *= 2;
+	}
+
+	if ((wheel->slots = calloc(size, sizeof(struct timer *))) == NULL) {
+		return 0;
+	}
+
+	wheel->mask = size - 1;
+	wheel->tick_ns = tick_ns;
+	wheel->current = now / tick_ns;
+	wheel->count = 0;
+
+	return 1;
+}
+
+/* Frees the wheel's slots; timers still set are forgotten */
+static inline void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+	free(wheel->slots);
+	wheel->slots = NULL;
+}
+
+/* Prepares a timer that is not set and calls fire when it goes off */
+static inline void timer_init(struct timer *timer,
+							  void (*fire)(struct timer *timer))
+{
+	timer->fire = fire;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* Returns 1 if the timer is set and 0 otherwise */
+static inline int timer_pending(const struct timer *timer)
+{
+	return (timer->pprev != NULL);
+}
+
+static inline void timer_link(struct timer **head, struct timer *timer)
+{
+	if ((timer->next = *head) != NULL) {
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = head;
+	*head = timer;
+}
+
+static inline void timer_unlink(struct timer *timer)
+{
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	*timer->pprev = timer->next;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* Stops the timer if it is set */
+static inline void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (timer_pending(timer)) {
+		timer_unlink(timer);
+		wheel->count--;
+	}
+}
+
+/* Sets the timer to go off at deadline, in nanoseconds, replacing any
+ * deadline it had; a deadline already passed goes off on the next tick */
+static inline void timer_set(struct timer_wheel *wheel, struct timer *timer,
+							 uint64_t deadline)
+{
+	uint64_t tick = (deadline + wheel->tick_ns - 1) / wheel->tick_ns;
+
+	timer_cancel(wheel, timer);
+
+	if (tick <= wheel->current) {
+		tick = wheel->current + 1;
+	}
+
+	timer->expires = tick;
+	timer_link(&wheel->slots[tick & wheel->mask], timer);
+	wheel->count++;
+}
+
+/* Moves the wheel on to now, firing every timer due by then.  Due timers
+ * are taken off the wheel before any fires, so a timer may be set again or
+ * cancel another from its fire function */
+static inline void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+	struct timer *due = NULL, *timer, *next;
+	uint64_t target = now / wheel->tick_ns, ticks, i;
+
+	if (target <= wheel->current) {
+		return;
+	}
+
+	/* After a long wait every slot is visited once, not once per tick */
+	ticks = target - wheel->current;
+	if (ticks > wheel->mask + 1) {
+		ticks = wheel->mask + 1;
+	}
+
+	for (i = 1; i <= ticks; i++) {
+		for (timer = wheel->slots[(wheel->current + i) & wheel->mask];
+			 timer != NULL; timer = next) {
+			next = timer->next;
+			if (timer->expires <= target) {
+				timer_unlink(timer);
+				timer_link(&due, timer);
+			}
+		}
+	}
+
+	wheel->current = target;
+
+	while ((timer = due) != NULL) {
+		timer_unlink(timer);
+		wheel->count--;
+		timer->fire(timer);
+	}
+}
+
+#endif
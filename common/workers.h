@@ -0,0 +1,259 @@
+/* workers.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * A fixed pool of worker threads, one per core by default, that run jobs
+ * handed to them from any thread.
+ *
+ * A job is a struct work embedded in whatever it works on, so handing one
+ * over allocates nothing.  Each worker keeps its own deque (see deque.h):
+ * jobs a worker hands over go to the bottom of its own deque and it runs
+ * the newest first, while workers with nothing to do steal the oldest jobs
+ * from the top of the others' deques.  Threads outside the pool hand jobs
+ * to a shared queue, from which a worker takes a share at a time into its
+ * own deque.  Workers with nothing to run or steal sleep until a job is
+ * handed over.
+ *
+ * */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "deque.h"
+
+/* number of jobs each worker's deque holds */
+#define WORKER_DEQUE_LEN 1024
+
+/* most jobs a worker takes from the shared queue at a time */
+#define WORKER_BATCH 32
+
+struct work {
+	void (*run)(struct work *work);
+	struct work *next;				/* link in the shared queue */
+};
+
+struct worker_pool;
+
+struct worker {
+	struct work_deque deque;
+	struct worker_pool *pool;
+	int index;
+	unsigned int seed;				/* picks whom to steal from first */
+	pthread_t thread;
+};
+
+struct worker_pool {
+	int num_workers;
+	struct worker *workers;
+
+	pthread_mutex_t lock;			/* held to use the shared queue or to
+									 * go to sleep */
+	pthread_cond_t wake;
+	struct work *head, *tail;		/* the shared queue */
+	int queued;						/* jobs in the shared queue */
+	int sleeping;					/* workers waiting on wake */
+};
+
+static __thread struct worker *worker_self;
+
+/* Returns the core count, or 1 if it cannot be found */
+static inline int worker_count_default(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (int)n : 1;
+}
+
+/* Wakes a sleeping worker, if any, to steal what was just handed over */
+static inline void worker_wake(struct worker_pool *pool)
+{
+	if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Hands work to the pool.  From a worker of the pool, work goes on that
+ * worker's own deque unless it is full; from anywhere else, or when it is,
+ * work goes on the shared queue */
+static inline void worker_submit(struct worker_pool *pool, struct work *work)
+{
+	struct worker *self = worker_self;
+
+	if ((self != NULL) && (self->pool == pool) &&
+		deque_push(&self->deque, work)) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		worker_wake(pool);
+		return;
+	}
+
+	work->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL) {
+		pool->head = work;
+	} else {
+		pool->tail->next = work;
+	}
+	pool->tail = work;
+	__atomic_store_n(&pool->queued, pool->queued + 1, __ATOMIC_RELAXED);
+
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Takes the first job of the shared queue and moves a fair share of the
+ * rest onto the worker's deque; called with the pool's lock held.  Returns
+ * NULL if the shared queue is empty */
+static inline struct work *worker_take_shared(struct worker *self)
+{
+	struct worker_pool *pool = self->pool;
+	struct work *work = pool->head, *extra;
+	int share, taken = 1;
+
+	if (work == NULL) {
+		return NULL;
+	}
+
+	share = pool->queued / pool->num_workers;
+	if (share > WORKER_BATCH) {
+		share = WORKER_BATCH;
+	}
+
+	pool->head = work->next;
+	while ((taken <= share) && ((extra = pool->head) != NULL) &&
+		   deque_push(&self->deque, extra)) {
+		pool->head = extra->next;
+		taken++;
+	}
+
+	if (pool->head == NULL) {
+		pool->tail = NULL;
+	}
+	__atomic_store_n(&pool->queued, pool->queued - taken, __ATOMIC_RELAXED);
+
+	/* Others may steal what was moved onto the deque */
+	if (taken > 1) {
+		pthread_cond_signal(&pool->wake);
+	}
+
+	return work;
+}
+
+/* Steals a job from another worker, trying each once starting from a
+ * random one; returns NULL if there was nothing to steal */
+static inline struct work *worker_steal(struct worker *self)
+{
+	struct worker_pool *pool = self->pool;
+	struct worker *victim;
+	struct work *work;
+	int i, start;
+
+	self->seed = self->seed * 1103515245 + 12345;
+	start = (self->seed >> 16) % pool->num_workers;
+
+	for (i = 0; i < pool->num_workers; i++) {
+		victim = &pool->workers[(start + i) % pool->num_workers];
+
+		if ((victim != self) && ((work = deque_steal(&victim->deque)) != NULL)) {
+			return work;
+		}
+	}
+
+	return NULL;
+}
+
+/* Runs jobs for as long as the program runs: the worker's own first, then
+ * the shared queue's, then other workers' */
+static inline void *worker_main(void *args)
+{
+	struct worker *self = args;
+	struct worker_pool *pool = self->pool;
+	struct work *work;
+
+	worker_self = self;
+
+	while (1) {
+		if ((work = deque_pop(&self->deque)) == NULL) {
+			if (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) > 0) {
+				pthread_mutex_lock(&pool->lock);
+				work = worker_take_shared(self);
+				pthread_mutex_unlock(&pool->lock);
+			}
+
+			if (work == NULL) {
+				work = worker_steal(self);
+			}
+		}
+
+		/* Sleep only once nothing is left to take or steal; jobs pushed
+		 * onto a deque after the worker counted itself sleeping are seen
+		 * by whoever pushed them */
+		if (work == NULL) {
+			pthread_mutex_lock(&pool->lock);
+			__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+
+			while (((work = worker_take_shared(self)) == NULL) &&
+				   ((work = worker_steal(self)) == NULL)) {
+				pthread_cond_wait(&pool->wake, &pool->lock);
+			}
+
+			__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		work->run(work);
+	}
+
+	return NULL;
+}
+
+/* Starts num_workers workers, or one per core if num_workers is 0; returns
+ * 0 on failure and 1 on success */
+static inline int worker_pool_init(struct worker_pool *pool, int num_workers)
+{
+	int i;
+
+	if (num_workers <= 0) {
+		num_workers = worker_count_default();
+	}
+
+	pool->num_workers = num_workers;
+	pool->head = pool->tail = NULL;
+	pool->queued = pool->sleeping = 0;
+
+	if ((pthread_mutex_init(&pool->lock, NULL) != 0) ||
+		(pthread_cond_init(&pool->wake, NULL) != 0) ||
+		((pool->workers = aligned_alloc(DEQUE_CACHE_LINE, num_workers *
+										sizeof(struct worker))) == NULL)) {
+		return 0;
+	}
+	memset(pool->workers, 0, num_workers * sizeof(struct worker));
+
+	for (i = 0; i < num_workers; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		pool->workers[i].seed = i + 1;
+
+		if (!deque_init(&pool->workers[i].deque, WORKER_DEQUE_LEN)) {
+			return 0;
+		}
+	}
+
+	/* Every deque exists before any worker may steal from it */
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+						   &pool->workers[i]) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#endif
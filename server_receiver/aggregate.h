@@ -0,0 +1,577 @@
+/* aggregate.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * Counts and sums of the fields of records received, per key and per
+ * window of time, worked out by a pipeline of threads.
+ *
+ * A record is a line of fields separated by spaces or tabs, each field a
+ * key=value pair; a field without a value, or with one that is not a
+ * number, is only counted.  Keys are cut to AGGREGATE_KEY_LEN - 1 bytes.
+ *
+ * The threads that receive lines are the first stage: each hands whole
+ * lines, a chunk at a time, to one of num_parsers parser threads in turn.
+ * There are at most max_producers such threads, and every parser has a
+ * bounded lock-free ring (see ring.h) from each of them, so no two threads
+ * ever share a ring.  A parser sleeps on an eventfd when all of its rings
+ * are empty, and a receiving thread only waits when every parser's ring
+ * from it is full, that is when the parsers fall behind.
+ *
+ * The parsers are the second stage.  Each parses its chunks and adds the
+ * fields to a table of its own for the current window, so parsers share
+ * nothing while they work.  When the window ends, each parser hands its
+ * table on through a ring of its own to the merger, the third stage, and
+ * starts a new one.  The merger adds up the parsers' tables for each
+ * window, and once every parser has moved past a window, logs its totals
+ * and keeps them as the last window for whoever asks.
+ *
+ * Windows are window_ms long and aligned on the real-time clock, so that
+ * they line up with the clocks of whoever reads them.  A record belongs to
+ * the window in which a parser takes it.
+ *
+ * */
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "../common/log.h"
+#include "../common/ring.h"
+
+/* longest key kept, with its terminating null, and keys in each table;
+ * fields with keys beyond those are counted together */
+#define AGGREGATE_KEY_LEN 32
+#define AGGREGATE_KEYS 1024
+
+/* chunks each ring holds */
+#define AGGREGATE_RING_LEN 64
+
+/* keys logged for each window; the rest are only kept */
+#define AGGREGATE_LOG_KEYS 32
+
+/* Whole lines handed to a parser */
+struct aggregate_chunk {
+	size_t len;
+	char data[];					/* len bytes, then a null */
+};
+
+struct aggregate_entry {
+	char key[AGGREGATE_KEY_LEN];	/* empty for a free entry */
+	uint64_t count;
+	double sum;
+};
+
+/* What one parser, or the merger, has added up for one window */
+struct aggregate_table {
+	uint64_t window;				/* start of the window, in ms since 1970 */
+	uint64_t records;
+	uint64_t others;				/* fields with keys the table had no
+									 * room for */
+	int count;						/* keys */
+	int reported;					/* parsers whose tables are added in */
+	struct aggregate_table *next;	/* windows the merger has open */
+	struct aggregate_entry entries[AGGREGATE_KEYS];
+};
+
+struct aggregate_log;
+
+struct aggregate_parser {
+	struct aggregate_log *agg;
+	int index;
+	pthread_t thread;
+	struct spsc_ring *inbox;		/* from each producer */
+	int wake_fd;
+	int sleeping;
+	struct aggregate_table *table;	/* current window */
+	struct spsc_ring outbox;		/* finished tables, to the merger */
+	uint64_t reported;				/* last window handed on; set by the
+									 * merger */
+};
+
+struct aggregate_log {
+	uint64_t window_ms;
+	struct aggregate_parser *parsers;
+	int num_parsers;
+	int max_producers;				/* threads that may hand chunks */
+	int num_producers;				/* threads that have handed chunks */
+
+	pthread_t merger;
+	int merger_fd;					/* written when a table is handed on */
+	struct aggregate_table *open;	/* windows being added up, oldest first */
+
+	/* the last window added up, replaced under the lock */
+	pthread_mutex_t lock;
+	struct aggregate_table *last;
+
+	/* times a producer found every ring full */
+	uint64_t stalls;
+};
+
+/* index of the calling thread among producers, once it has handed a chunk,
+ * and the parser it hands its next chunk to */
+static __thread int aggregate_producer = -1;
+static __thread int aggregate_next_parser;
+
+/* Returns the time on the real-time clock in milliseconds */
+static inline uint64_t aggregate_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Returns an empty table for the window starting at window, or NULL if no
+ * memory can be allocated */
+static inline struct aggregate_table *aggregate_table_new(uint64_t window)
+{
+	struct aggregate_table *table;
+
+	if ((table = calloc(1, sizeof(struct aggregate_table))) != NULL) {
+		table->window = window;
+	}
+
+	return table;
+}
+
+/* Returns the entry for the len bytes of key in table, taking a free entry
+ * for a key not seen yet, or NULL if the table is full */
+static inline struct aggregate_entry *aggregate_find(
+	struct aggregate_table *table, const char *key, size_t len)
+{
+	struct aggregate_entry *entry;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	/* An empty key would look like a free entry */
+	if (len == 0) {
+		return NULL;
+	}
+	if (len >= AGGREGATE_KEY_LEN) {
+		len = AGGREGATE_KEY_LEN - 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+	}
+
+	/* Kept at most three quarters full, so a probe ends soon */
+	for (i = 0; i < AGGREGATE_KEYS; i++) {
+		entry = &table->entries[(hash + i) % AGGREGATE_KEYS];
+
+		if (entry->key[0] == '\0') {
+			if (table->count >= AGGREGATE_KEYS / 4 * 3) {
+				return NULL;
+			}
+			memcpy(entry->key, key, len);
+			entry->key[len] = '\0';
+			table->count++;
+			return entry;
+		}
+
+		if ((strncmp(entry->key, key, len) == 0) && (entry->key[len] == '\0')) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Adds every field of the lines in chunk to table */
+static inline void aggregate_parse(struct aggregate_table *table,
+								   struct aggregate_chunk *chunk)
+{
+	struct aggregate_entry *entry;
+	char *p = chunk->data, *end = chunk->data + chunk->len, *key, *value;
+	char *number_end;
+	double number;
+	int fields = 0;
+
+	while (p < end) {
+		/* Between fields */
+		if ((*p == ' ') || (*p == '\t') || (*p == '\r')) {
+			p++;
+			continue;
+		}
+		if (*p == '\n') {
+			table->records += (fields > 0);
+			fields = 0;
+			p++;
+			continue;
+		}
+
+		/* A field runs to the next space or the end of the line */
+		key = p;
+		while ((p < end) && (*p != '=') && (*p != ' ') && (*p != '\t') &&
+			   (*p != '\r') && (*p != '\n')) {
+			p++;
+		}
+		fields++;
+
+		if ((entry = aggregate_find(table, key, p - key)) == NULL) {
+			table->others++;
+		} else {
+			entry->count++;
+		}
+
+		if ((p == end) || (*p != '=')) {
+			continue;
+		}
+
+		/* strtod skips leading spaces, which would run into the next field
+		 * or line */
+		value = ++p;
+		if ((entry != NULL) && (value < end) && (*value != ' ') &&
+			(*value != '\t') && (*value != '\r') && (*value != '\n')) {
+			number = strtod(value, &number_end);
+			if ((number_end > value) &&
+				((*number_end == ' ') || (*number_end == '\t') ||
+				 (*number_end == '\r') || (*number_end == '\n') ||
+				 (*number_end == '\0'))) {
+				entry->sum += number;
+			}
+		}
+
+		while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\n')) {
+			p++;
+		}
+	}
+
+	table->records += (fields > 0);
+}
+
+/* Adds the counts in from to those in to */
+static inline void aggregate_add(struct aggregate_table *to,
+								 const struct aggregate_table *from)
+{
+	const struct aggregate_entry *entry;
+	struct aggregate_entry *sum;
+	int i;
+
+	to->records += from->records;
+	to->others += from->others;
+
+	for (i = 0; i < AGGREGATE_KEYS; i++) {
+		entry = &from->entries[i];
+		if (entry->key[0] == '\0') {
+			continue;
+		}
+
+		if ((sum = aggregate_find(to, entry->key, strlen(entry->key))) == NULL) {
+			to->others += entry->count;
+		} else {
+			sum->count += entry->count;
+			sum->sum += entry->sum;
+		}
+	}
+}
+
+/* Wakes whoever sleeps on the eventfd fd */
+static inline void aggregate_wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0) {
+		/* The counter is already non-zero, so the thread will wake anyway */
+	}
+}
+
+/* Hands the parser's table on to the merger and starts one for window */
+static inline void aggregate_hand_on(struct aggregate_parser *parser,
+									 uint64_t window)
+{
+	struct aggregate_table *next;
+
+	/* Without memory the window goes on; records are added to the old
+	 * table, and so to the window it was started for */
+	if ((next = aggregate_table_new(window)) == NULL) {
+		return;
+	}
+
+	/* The merger only falls behind if its ring holds many windows */
+	while (!spsc_ring_push(&parser->outbox, parser->table)) {
+		sched_yield();
+	}
+	aggregate_wake(parser->agg->merger_fd);
+
+	parser->table = next;
+}
+
+/* Takes the chunks waiting for the parser, up to a ringful from each
+ * producer so that the end of a window is not missed, and adds them to its
+ * table; returns the number taken */
+static inline int aggregate_drain(struct aggregate_parser *parser)
+{
+	struct aggregate_chunk *chunk;
+	int count, i, j, taken = 0;
+
+	count = __atomic_load_n(&parser->agg->num_producers, __ATOMIC_ACQUIRE);
+	if (count > parser->agg->max_producers) {
+		count = parser->agg->max_producers;
+	}
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; (j < AGGREGATE_RING_LEN) &&
+			 ((chunk = spsc_ring_pop(&parser->inbox[i])) != NULL); j++) {
+			aggregate_parse(parser->table, chunk);
+			free(chunk);
+			taken++;
+		}
+	}
+
+	return taken;
+}
+
+/* Parses chunks for as long as the program runs, handing its table on at
+ * the end of every window */
+static inline void *aggregate_parser_main(void *args)
+{
+	struct aggregate_parser *parser = args;
+	struct aggregate_log *agg = parser->agg;
+	struct pollfd pfd = {parser->wake_fd, POLLIN, 0};
+	uint64_t now, window, count;
+
+	while (1) {
+		aggregate_drain(parser);
+
+		now = aggregate_now();
+		window = now - now % agg->window_ms;
+		if (window > parser->table->window) {
+			aggregate_hand_on(parser, window);
+			continue;
+		}
+
+		/* Producers wake a sleeping parser; look once more after saying so,
+		 * in case a chunk came in between */
+		__atomic_store_n(&parser->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (aggregate_drain(parser) == 0) {
+			poll(&pfd, 1, window + agg->window_ms - now);
+			if (read(parser->wake_fd, &count, sizeof(count)) < 0) {
+				/* Woken by the end of the window */
+			}
+		}
+		__atomic_store_n(&parser->sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Logs the totals of a window, unless it had no records */
+static inline void aggregate_report(struct aggregate_table *table)
+{
+	struct aggregate_entry *entry;
+	int i, logged = 0;
+
+	/* An idle server would otherwise log every window */
+	if (table->records == 0) {
+		return;
+	}
+
+	log_info("window %llu: %llu records, %d keys, %llu fields not kept",
+			 (unsigned long long)table->window,
+			 (unsigned long long)table->records, table->count,
+			 (unsigned long long)table->others);
+
+	for (i = 0; (i < AGGREGATE_KEYS) && (logged < AGGREGATE_LOG_KEYS); i++) {
+		entry = &table->entries[i];
+		if (entry->key[0] != '\0') {
+			log_info("window %llu: %s count %llu sum %g",
+					 (unsigned long long)table->window, entry->key,
+					 (unsigned long long)entry->count, entry->sum);
+			logged++;
+		}
+	}
+}
+
+/* Adds up the parsers' tables for as long as the program runs, closing a
+ * window once every parser has handed on a later one */
+static inline void *aggregate_merger_main(void *args)
+{
+	struct aggregate_log *agg = args;
+	struct aggregate_parser *parser;
+	struct aggregate_table *table, **link, *done;
+	uint64_t count, oldest;
+	int i;
+
+	while (1) {
+		if (read(agg->merger_fd, &count, sizeof(count)) < 0) {
+			continue;
+		}
+
+		for (i = 0; i < agg->num_parsers; i++) {
+			parser = &agg->parsers[i];
+
+			while ((table = spsc_ring_pop(&parser->outbox)) != NULL) {
+				parser->reported = table->window;
+
+				/* Open windows are kept in order */
+				for (link = &agg->open;
+					 (*link != NULL) && ((*link)->window < table->window);
+					 link = &(*link)->next) {
+				}
+
+				if ((*link != NULL) && ((*link)->window == table->window)) {
+					aggregate_add(*link, table);
+					(*link)->reported++;
+					free(table);
+				} else {
+					table->next = *link;
+					table->reported = 1;
+					*link = table;
+				}
+			}
+		}
+
+		/* A parser hands on each window once, and in order */
+		oldest = UINT64_MAX;
+		for (i = 0; i < agg->num_parsers; i++) {
+			if (agg->parsers[i].reported < oldest) {
+				oldest = agg->parsers[i].reported;
+			}
+		}
+
+		while (((done = agg->open) != NULL) && (done->window <= oldest)) {
+			agg->open = done->next;
+			aggregate_report(done);
+
+			pthread_mutex_lock(&agg->lock);
+			table = agg->last;
+			agg->last = done;
+			pthread_mutex_unlock(&agg->lock);
+			free(table);
+		}
+	}
+
+	return NULL;
+}
+
+/* Starts num_parsers parsers and the merger, adding up windows of
+ * window_ms of the lines handed on by up to max_producers threads; returns
+ * 0 on failure and 1 on success */
+static inline int aggregate_init(struct aggregate_log *agg, int num_parsers,
+								 int max_producers, unsigned int window_ms)
+{
+	struct aggregate_parser *parser;
+	uint64_t now;
+	int i, j;
+
+	agg->window_ms = (window_ms > 0) ? window_ms : 1;
+	agg->num_parsers = num_parsers;
+	agg->max_producers = max_producers;
+	agg->num_producers = 0;
+	agg->open = NULL;
+	agg->last = NULL;
+	agg->stalls = 0;
+
+	if (((agg->parsers = calloc(num_parsers,
+								sizeof(struct aggregate_parser))) == NULL) ||
+		((agg->merger_fd = eventfd(0, 0)) < 0) ||
+		(pthread_mutex_init(&agg->lock, NULL) != 0)) {
+		return 0;
+	}
+
+	now = aggregate_now();
+	for (i = 0; i < num_parsers; i++) {
+		parser = &agg->parsers[i];
+		parser->agg = agg;
+		parser->index = i;
+		parser->reported = 0;
+
+		if ((parser->inbox = calloc(max_producers,
+									sizeof(struct spsc_ring))) == NULL) {
+			return 0;
+		}
+		for (j = 0; j < max_producers; j++) {
+			if (!spsc_ring_init(&parser->inbox[j], AGGREGATE_RING_LEN)) {
+				return 0;
+			}
+		}
+
+		if (!spsc_ring_init(&parser->outbox, AGGREGATE_RING_LEN) ||
+			((parser->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) ||
+			((parser->table = aggregate_table_new(
+				now - now % agg->window_ms)) == NULL)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < num_parsers; i++) {
+		if (pthread_create(&agg->parsers[i].thread, NULL, aggregate_parser_main,
+						   &agg->parsers[i]) != 0) {
+			return 0;
+		}
+	}
+
+	return (pthread_create(&agg->merger, NULL, aggregate_merger_main,
+						   agg) == 0);
+}
+
+/* Hands the whole lines in iov to the next parser, waiting while every
+ * parser is behind; returns 0 on failure and 1 on success */
+static inline int aggregate_push(struct aggregate_log *agg,
+								 const struct iovec *iov, int iovcnt)
+{
+	struct aggregate_parser *parser;
+	struct aggregate_chunk *chunk;
+	size_t len = 0;
+	int i;
+
+	if (aggregate_producer < 0) {
+		aggregate_producer = __atomic_fetch_add(&agg->num_producers, 1,
+												__ATOMIC_ACQ_REL);
+	}
+	if (aggregate_producer >= agg->max_producers) {
+		log_error("aggregate_push: more than %d threads hand on lines",
+				  agg->max_producers);
+		return 0;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if ((chunk = malloc(sizeof(struct aggregate_chunk) + len + 1)) == NULL) {
+		return 0;
+	}
+	chunk->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(chunk->data + chunk->len, iov[i].iov_base, iov[i].iov_len);
+		chunk->len += iov[i].iov_len;
+	}
+	chunk->data[len] = '\0';
+
+	/* Parsers are taken in turn, skipping those whose ring is full */
+	for (i = 0; ; i++) {
+		parser = &agg->parsers[aggregate_next_parser];
+		aggregate_next_parser = (aggregate_next_parser + 1) % agg->num_parsers;
+
+		if (spsc_ring_push(&parser->inbox[aggregate_producer], chunk)) {
+			break;
+		}
+
+		if ((i + 1) % agg->num_parsers == 0) {
+			__atomic_add_fetch(&agg->stalls, 1, __ATOMIC_RELAXED);
+			sched_yield();
+		}
+	}
+
+	/* Pairs with the parser saying it sleeps before it looks once more */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&parser->sleeping, __ATOMIC_RELAXED)) {
+		aggregate_wake(parser->wake_fd);
+	}
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,430 @@
+/* ingest.h
+ * Author: Dickson Wong
+ * Date: Oct 17, 2026
+ *
+ * One append-only log of the records received from every client, made
+ * durable in groups.
+ *
+ * Records are appended to a batch in memory under the log's lock, a
+ * memcpy each, and a committer thread of the log's own writes the batch
+ * out.  There are two batches: while one is written and synced, appends
+ * go to the other.  The committer takes the batch being filled once it
+ * holds commit_bytes, or commit_ms after its first record, whichever comes
+ * first, and writes it to the end of the newest segment with one write
+ * and one fdatasync.  Many clients' records thus reach the disk in large
+ * sequential writes, and one sync covers all of them.  Appends wait only
+ * when both batches are full, that is when the disk falls behind.
+ *
+ * Whoever appends is an owner (struct ingest_owner, embedded like a struct
+ * timer, see timerwheel.h).  Each batch lists the owners with records in
+ * it, and once the batch is on disk committed is called for each of them,
+ * with durable set to the number of the owner's records now on disk, so
+ * that the owner can be told.  hold is called, with the lock held, when an
+ * owner is first listed in a batch; committed is called once for each
+ * hold.  Records appended without an owner are committed all the same, but
+ * no one is told.
+ *
+ * The log is a run of segment files in its directory, named after the
+ * offset in the whole log of their first byte.  A segment that reaches
+ * segment_max is closed and a new one started.  A log already in the
+ * directory is appended to, after cutting its newest segment back to its
+ * last whole record.
+ *
+ * */
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../common/log.h"
+
+/* longest log directory name, and longest segment file name in it */
+#define INGEST_PATH_LEN 4096
+#define INGEST_SEGMENT_PATH_LEN (INGEST_PATH_LEN + 32)
+
+/* most bytes handed to one append, beyond commit_bytes, that a batch has
+ * room for */
+#define INGEST_APPEND_MAX (256 << 10)
+
+struct ingest_owner {
+	uint64_t batch;					/* last batch the owner is listed in */
+	unsigned long records;			/* records appended, under the lock */
+	unsigned long durable;			/* records on disk, as of a commit */
+};
+
+struct ingest_batch {
+	char *data;
+	size_t len;
+	size_t cap;
+	uint64_t number;
+	uint64_t first_at;				/* time of the first record */
+	struct ingest_owner **owners;	/* owners with records in the batch */
+	int count;
+	int owners_cap;
+};
+
+struct ingest_log {
+	char dir[INGEST_PATH_LEN];
+	int fd;							/* newest segment */
+	uint64_t segment_start;			/* offset in the log of its first byte */
+	size_t segment_len;
+	size_t segment_max;
+
+	size_t commit_bytes;
+	uint64_t commit_ns;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;			/* signalled when a batch gets records */
+	pthread_cond_t room;			/* broadcast when batches are swapped */
+	struct ingest_batch batches[2];
+	int open;						/* batch being appended to */
+	uint64_t next_batch;
+
+	void (*hold)(struct ingest_owner *owner);
+	void (*committed)(struct ingest_owner *owner);
+	pthread_t committer;
+
+	/* written by the committer */
+	unsigned long commits;
+	uint64_t bytes_committed;
+};
+
+/* Returns the time on the monotonic clock in nanoseconds */
+static inline uint64_t ingest_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Opens the segment starting at offset start of the log, creating it if
+ * need be, and positions writes at its end.  A segment created is synced
+ * into the directory, so that records committed to it are not lost with
+ * its name.  Returns 0 on failure and 1 on success */
+static inline int ingest_open_segment(struct ingest_log *log, uint64_t start)
+{
+	char path[INGEST_SEGMENT_PATH_LEN];
+	struct stat st;
+	int dir_fd;
+
+	snprintf(path, sizeof(path), "%s/%020llu.log", log->dir,
+			 (unsigned long long)start);
+
+	if (((log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) ||
+		(fstat(log->fd, &st) < 0)) {
+		log_error("ingest_open_segment: cannot open %s", path);
+		return 0;
+	}
+
+	log->segment_start = start;
+	log->segment_len = st.st_size;
+
+	if (st.st_size == 0) {
+		if ((dir_fd = open(log->dir, O_RDONLY | O_DIRECTORY)) < 0) {
+			return 0;
+		}
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	return 1;
+}
+
+/* Cuts the newest segment back to the end of its last whole record, in case
+ * the server stopped while writing it; returns 0 on failure and 1 on
+ * success */
+static inline int ingest_recover(struct ingest_log *log)
+{
+	char path[INGEST_SEGMENT_PATH_LEN], chunk[4096];
+	size_t end = log->segment_len, n;
+	int rfd, i;
+
+	snprintf(path, sizeof(path), "%s/%020llu.log", log->dir,
+			 (unsigned long long)log->segment_start);
+	if ((rfd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+
+	while (end > 0) {
+		n = (end < sizeof(chunk)) ? end : sizeof(chunk);
+		if (pread(rfd, chunk, n, end - n) != (ssize_t)n) {
+			close(rfd);
+			return 0;
+		}
+		for (i = n - 1; (i >= 0) && (chunk[i] != '\n'); i--) {
+		}
+		if (i >= 0) {
+			end -= n - i - 1;
+			break;
+		}
+		end -= n;
+	}
+	close(rfd);
+
+	if (end < log->segment_len) {
+		log_warn("ingest_recover: dropping %zu bytes of a partial record",
+				 log->segment_len - end);
+		if (ftruncate(log->fd, end) < 0) {
+			return 0;
+		}
+		log->segment_len = end;
+	}
+
+	return 1;
+}
+
+/* Writes len bytes at data to the newest segment, starting a new segment
+ * first if this one is full; returns 0 on failure and 1 on success */
+static inline int ingest_write(struct ingest_log *log, const char *data,
+							   size_t len)
+{
+	ssize_t n;
+
+	if ((log->segment_len > 0) && (log->segment_len + len > log->segment_max)) {
+		if ((fdatasync(log->fd) < 0) || (close(log->fd) < 0) ||
+			!ingest_open_segment(log, log->segment_start + log->segment_len)) {
+			return 0;
+		}
+	}
+
+	while (len > 0) {
+		if ((n = write(log->fd, data, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		data += n;
+		len -= n;
+		log->segment_len += n;
+	}
+
+	return 1;
+}
+
+/* Commits batch after batch for as long as the program runs */
+static inline void *ingest_committer(void *args)
+{
+	struct ingest_log *log = args;
+	struct ingest_batch *batch;
+	struct timespec until;
+	uint64_t deadline;
+	int i;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (1) {
+		batch = &log->batches[log->open];
+
+		while (batch->len == 0) {
+			pthread_cond_wait(&log->ready, &log->lock);
+		}
+
+		/* Give the batch until it is big enough or old enough */
+		deadline = batch->first_at + log->commit_ns;
+		while ((batch->len < log->commit_bytes) && (ingest_now() < deadline)) {
+			until.tv_sec = deadline / 1000000000;
+			until.tv_nsec = deadline % 1000000000;
+			pthread_cond_timedwait(&log->ready, &log->lock, &until);
+		}
+
+		/* Every record of the batch's owners so far is in it, since the
+		 * other batch is already on disk */
+		for (i = 0; i < batch->count; i++) {
+			batch->owners[i]->durable = batch->owners[i]->records;
+		}
+
+		log->open ^= 1;
+		log->batches[log->open].number = log->next_batch++;
+		pthread_cond_broadcast(&log->room);
+		pthread_mutex_unlock(&log->lock);
+
+		/* An unsynced log cannot be acknowledged; stop rather than lie */
+		if (!ingest_write(log, batch->data, batch->len) ||
+			(fdatasync(log->fd) < 0)) {
+			log_error("ingest_committer: cannot write the log");
+			exit(1);
+		}
+
+		/* Read by other threads while the committer runs */
+		__atomic_add_fetch(&log->commits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&log->bytes_committed, batch->len, __ATOMIC_RELAXED);
+
+		for (i = 0; i < batch->count; i++) {
+			log->committed(batch->owners[i]);
+		}
+
+		pthread_mutex_lock(&log->lock);
+		batch->len = 0;
+		batch->count = 0;
+	}
+
+	return NULL;
+}
+
+/* Finds the newest segment in the log's directory; returns its starting
+ * offset, or 0 if there is none */
+static inline uint64_t ingest_newest_segment(const char *dir_path)
+{
+	struct dirent *entry;
+	unsigned long long start, newest = 0;
+	DIR *dir;
+
+	if ((dir = opendir(dir_path)) == NULL) {
+		return 0;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if ((sscanf(entry->d_name, "%20llu.log", &start) == 1) &&
+			(start > newest)) {
+			newest = start;
+		}
+	}
+	closedir(dir);
+
+	return newest;
+}
+
+/* Opens or creates the log in dir and starts its committer; returns 0 on
+ * failure and 1 on success */
+static inline int ingest_init(struct ingest_log *log, const char *dir,
+							  size_t segment_max, size_t commit_bytes,
+							  unsigned int commit_ms,
+							  void (*hold)(struct ingest_owner *owner),
+							  void (*committed)(struct ingest_owner *owner))
+{
+	pthread_condattr_t attr;
+	int i;
+
+	if (strlen(dir) >= sizeof(log->dir)) {
+		return 0;
+	}
+	strcpy(log->dir, dir);
+
+	log->segment_max = segment_max;
+	log->commit_bytes = (commit_bytes > 0) ? commit_bytes : 1;
+	log->commit_ns = commit_ms * 1000000ULL;
+	log->hold = hold;
+	log->committed = committed;
+	log->open = 0;
+	log->next_batch = 1;
+	log->commits = 0;
+	log->bytes_committed = 0;
+
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		log_error("ingest_init: cannot create %s", dir);
+		return 0;
+	}
+
+	if (!ingest_open_segment(log, ingest_newest_segment(dir)) ||
+		!ingest_recover(log)) {
+		return 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		log->batches[i].cap = log->commit_bytes + INGEST_APPEND_MAX;
+		log->batches[i].len = 0;
+		log->batches[i].number = log->next_batch++;
+		log->batches[i].count = 0;
+		log->batches[i].owners_cap = 64;
+		log->batches[i].data = malloc(log->batches[i].cap);
+		log->batches[i].owners = malloc(64 * sizeof(struct ingest_owner *));
+		if ((log->batches[i].data == NULL) || (log->batches[i].owners == NULL)) {
+			return 0;
+		}
+	}
+
+	/* The committer waits on the same clock as ingest_now */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	if ((pthread_mutex_init(&log->lock, NULL) != 0) ||
+		(pthread_cond_init(&log->ready, &attr) != 0) ||
+		(pthread_cond_init(&log->room, NULL) != 0) ||
+		(pthread_create(&log->committer, NULL, ingest_committer, log) != 0)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Appends the bytes of iov, holding records whole records, for owner, which
+ * may be NULL; they are committed together and never split across
+ * segments.  Waits while the disk is behind.  Returns 0 on failure and 1 on
+ * success */
+static inline int ingest_append(struct ingest_log *log,
+								struct ingest_owner *owner,
+								const struct iovec *iov, int iovcnt,
+								unsigned long records)
+{
+	struct ingest_batch *batch;
+	struct ingest_owner **owners;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (len > INGEST_APPEND_MAX) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&log->lock);
+
+	/* Past commit_bytes the batch is the committer's to take */
+	while ((batch = &log->batches[log->open])->len >= log->commit_bytes) {
+		pthread_cond_wait(&log->room, &log->lock);
+	}
+
+	if ((owner != NULL) && (owner->batch != batch->number)) {
+		if (batch->count == batch->owners_cap) {
+			owners = realloc(batch->owners, 2 * batch->owners_cap *
+							 sizeof(struct ingest_owner *));
+			if (owners == NULL) {
+				pthread_mutex_unlock(&log->lock);
+				return 0;
+			}
+			batch->owners = owners;
+			batch->owners_cap *= 2;
+		}
+		batch->owners[batch->count++] = owner;
+		owner->batch = batch->number;
+		log->hold(owner);
+	}
+
+	if (batch->len == 0) {
+		batch->first_at = ingest_now();
+		pthread_cond_signal(&log->ready);
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(batch->data + batch->len, iov[i].iov_base, iov[i].iov_len);
+		batch->len += iov[i].iov_len;
+	}
+	if (owner != NULL) {
+		owner->records += records;
+	}
+
+	if (batch->len >= log->commit_bytes) {
+		pthread_cond_signal(&log->ready);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return 1;
+}
+
+#endif
@@ -4,44 +4,247 @@
  * 
  * 
  * A simple server using socket that establishes connections with up to 
- * four clients and simply prints them all out.  The HOST_NAME of this server
- * will be localhost.
+ * four clients (or MAX_CLIENTS when given) and simply prints them all out.
+ * The HOST_NAME of this server will be localhost.
  * 
- * Usage: ./server.exe PORT_NO SERVER_NAME
+ * Clients do not get a thread each.  The main thread accepts connections
+ * and waits on every client socket with epoll; each socket that becomes
+ * readable is handed as a job to a fixed pool of WORKERS threads (one per
+ * core by default, see workers.h), which steal from each other when busy.
+ * A socket is armed for one event at a time, so one client's messages are
+ * only ever read by one worker at a time and keep their order.
+ * 
+ * Workers only read.  The main thread sets every client up and takes it
+ * down again: a worker that reads the end of a client's input hands the
+ * client back, and the main thread closes its socket and frees its place
+ * for another client.
+ * 
+ * A client that sends nothing for IDLE_S seconds (60 by default; 0 never
+ * times out) is disconnected, so that peers that vanished without closing
+ * do not hold a place forever.  The main thread keeps each client's
+ * deadline on a hashed timer wheel (see timerwheel.h); workers only note
+ * when they last read, and the deadline is worked out afresh when the
+ * timer goes off.  A timed-out socket is shut down, and the worker that
+ * reads its end of input hands it back like any other.
+ * 
+ * Given -L, the server ingests instead of printing: every line a client
+ * sends is a record, appended to one log in LOG_DIR shared by every client
+ * (see ingest.h).  Records from all clients are written together and
+ * synced once per group, when COMMIT_KB have gathered or COMMIT_MS after
+ * the first of them, and the log moves to a new segment file every
+ * SEGMENT_MB.  After every commit each client with records in it is sent
+ * "ACK N\n", N being how many of its records are now on disk; only those
+ * may be taken as received.  A client's place is kept, and its socket
+ * open, until its last records are acknowledged.
+ * 
+ * Given -G, the server also adds up the fields of every line, or instead of
+ * printing it: lines of key=value fields are counted, and their values
+ * summed, per key over windows of WINDOW_MS (see aggregate.h).  Workers
+ * and receivers only frame lines and hand them on through lock-free rings
+ * to PARSERS threads (one per core by default), each adding up a window
+ * of its own; a merger adds the parsers' windows together as each ends,
+ * logs the totals and keeps the last for the admin socket.
+ * 
+ * Given -U, the server takes datagrams on UDP port PORT_NO instead of
+ * connections, for senders that cannot wait for a handshake.  RECEIVERS
+ * threads each have a socket of their own on the port (SO_REUSEPORT, so
+ * the kernel spreads senders over them) and take up to UDP_BATCH datagrams
+ * per recvmmsg, into buffers allocated once.  Each datagram is printed, or
+ * logged as records given -L, as a TCP client's message would be, but is
+ * never acknowledged.  The server counts datagrams and bytes from each
+ * sender, and datagrams truncated or dropped by the kernel for want of
+ * room.
+ * 
+ * Given -A, the server answers on a Unix socket at ADMIN_SOCKET with what
+ * it has received and how many clients it has accepted and refused (see
+ * metrics.h), and with what it has committed, the last window it has
+ * added up and from whom it has had datagrams, when it has.
+ * 
+ * Usage: ./server.exe [-w WORKERS] [-A ADMIN_SOCKET] [-T IDLE_S]
+ *                     [-m MAX_CLIENTS] [-L LOG_DIR] [-F COMMIT_MS[,COMMIT_KB]]
+ *                     [-S SEGMENT_MB] [-G WINDOW_MS[,PARSERS]] [-U RECEIVERS]
+ *                     PORT_NO SERVER_NAME
  * 
  * */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "ingest.h"
+#include "aggregate.h"
+#include "../common/log.h"
+#include "../common/metrics.h"
+#include "../common/pool.h"
+#include "../common/workers.h"
+#include "../common/timerwheel.h"
+
 #define BUFFER_LEN 256
 #define MESSAGE_LEN (BUFFER_LEN - 1)
-#define MAX_CLIENTS 4
+#define DEFAULT_MAX_CLIENTS 4
+#define MAX_EVENTS 64
+
+/* most reads one job makes before letting other clients' jobs run */
+#define READS_PER_JOB 16
+
+/* seconds a client may send nothing before it is disconnected */
+#define DEFAULT_IDLE_S 60
+
+/* length of a tick of the timer wheel, and number of slots */
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 1024
+
+/* bytes read at a time when ingesting, and longest record; longer lines
+ * are cut into records of this length */
+#define INGEST_READ_LEN (64 << 10)
+#define INGEST_RECORD_MAX (64 << 10)
+
+/* how long and how many kilobytes records gather for before they are
+ * committed, and megabytes in each segment, unless -F or -S say otherwise */
+#define DEFAULT_COMMIT_MS 0
+#define DEFAULT_COMMIT_KB 1024
+#define DEFAULT_SEGMENT_MB 256
+
+/* datagrams taken per recvmmsg, longest datagram kept whole, and senders
+ * each receiver counts separately; the rest are counted together */
+#define UDP_BATCH 64
+#define UDP_DATAGRAM_LEN 2048
+#define UDP_SENDERS 4096
+
+/* receive buffer asked for on each UDP socket, so bursts are not dropped */
+#define UDP_RCVBUF (4 << 20)
+
+#define USAGE "usage: server [-w WORKERS] [-A ADMIN_SOCKET] [-T IDLE_S] " \
+	"[-m MAX_CLIENTS] [-L LOG_DIR] [-F COMMIT_MS[,COMMIT_KB]] " \
+	"[-S SEGMENT_MB] [-G WINDOW_MS[,PARSERS]] [-U RECEIVERS] " \
+	"PORT_NO SERVER_NAME\n"
 
 static int num_clients = 0;
+static int max_clients = DEFAULT_MAX_CLIENTS;
 static struct client_node *head;
 static struct client_node *tail;
 static int current_id = 0;
+static int epoll_fd;
+static struct worker_pool workers;
+
+/* clients handed back by workers, and the eventfd written when one is */
+static struct client_node *ended_clients;
+static int ended_fd;
+
+/* deadlines of every client, kept by the main thread, and the timerfd
+ * going off every tick; idle_timeout is in nanoseconds, 0 for none */
+static struct timer_wheel timers;
+static int tick_fd;
+static uint64_t idle_timeout = DEFAULT_IDLE_S * 1000000000ULL;
+
+/* time the main thread last woke */
+static uint64_t now;
+
+/* the log clients' records go to, given -L */
+static struct ingest_log ingest;
+static int ingesting = 0;
+
+/* the counts and sums of records' fields, given -G */
+static struct aggregate_log aggregates;
+static int aggregating = 0;
 
 pthread_mutex_t client_table_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t client_serve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the server counts, named as on the admin socket */
+enum counter {
+	BYTES_IN,
+	MESSAGES_IN,
+	CLIENTS_ACCEPTED,
+	CLIENTS_REJECTED,
+	CLIENTS_DISCONNECTED,
+	CLIENTS_TIMED_OUT,
+	ACKS_SENT,
+	DATAGRAMS_IN,
+	DATAGRAMS_TRUNCATED,
+	NUM_COUNTERS
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+	"bytes_in", "messages_in", "clients_accepted", "clients_rejected",
+	"clients_disconnected", "clients_timed_out", "acks_sent", "datagrams_in",
+	"datagrams_truncated"
+};
 
 struct client_node {
 	int id;
 	int sock_fd;
-	char name[5];
+	char name[12];
+	uint64_t read_at;				/* time of the last read, set by workers */
+	struct timer timer;				/* set for the idle deadline */
+	struct work work;				/* reads what the socket has ready */
 	struct client_node *next;
+	struct client_node *next_ended;
+
+	/* one for the connection and one for each batch of the log holding the
+	 * client's records; the client is freed when none are left */
+	int refs;
+	int ended;						/* connection over; set by the main
+									 * thread */
+
+	/* ingesting only */
+	struct ingest_owner owner;
+	char *partial;					/* start of a line read, up to
+									 * INGEST_RECORD_MAX */
+	size_t partial_len;
 };
 
+/* What one UDP receiver has had from one sender */
+struct sender {
+	struct in_addr addr;
+	in_port_t port;					/* 0 for a free entry */
+	uint64_t datagrams;
+	uint64_t bytes;
+};
+
+/* A thread taking datagrams on a socket of its own, with a batch of
+ * buffers for recvmmsg to fill */
+struct receiver {
+	int id;
+	int fd;
+	pthread_t thread;
+	char *buffers;					/* UDP_BATCH of UDP_DATAGRAM_LEN + 1 */
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_in addrs[UDP_BATCH];
+	char controls[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+	/* counts, read by the admin socket; the receiver takes the lock once
+	 * per batch */
+	pthread_mutex_t lock;
+	struct sender senders[UDP_SENDERS];
+	int num_senders;
+	uint64_t others;				/* datagrams from senders not counted */
+	uint32_t dropped;				/* by the kernel, as told with the last
+									 * datagram taken */
+};
+
+/* receivers set up so far, given -U */
+static struct receiver *receivers;
+static int num_receivers = 0;
+static int receiving = 0;
+
 /* Add a client to the list; returns -1 on failure and 0 on success */
 int add_client(struct client_node *new_client) 
 {
-	if (num_clients >= MAX_CLIENTS) {
+	if (num_clients >= max_clients) {
 		return -1;
 	}
 	
@@ -58,61 +261,534 @@ int add_client(struct client_node *new_client)
 	return 0;
 }
 
-/* Clears the buffer by replacing all characters by zeros */
-void clear_buffer(char *buffer) 
+/* Take a client off the list; called with the table lock held */
+void remove_client(struct client_node *cli_node)
+{
+	struct client_node **link = &head, *prev = NULL;
+
+	while ((*link != NULL) && (*link != cli_node)) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+
+	if (*link == NULL) {
+		return;
+	}
+
+	*link = cli_node->next;
+	if (tail == cli_node) {
+		tail = prev;
+	}
+
+	num_clients--;
+}
+
+/* Client nodes come from a pool and go back to it once ended */
+static struct pool client_pool = POOL_INITIALIZER(sizeof(struct client_node));
+
+/* Sets O_NONBLOCK on fd; returns 0 on failure and 1 on success */
+int set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+		return 0;
+	}
+
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+/* Hands the client back to the main thread, to have its connection ended
+ * or, once nothing holds it any more, to be taken off the list, closed and
+ * freed; the caller must not touch the client afterwards */
+void end_client(struct client_node *cli_node)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&client_table_lock);
+	cli_node->next_ended = ended_clients;
+	ended_clients = cli_node;
+	pthread_mutex_unlock(&client_table_lock);
+
+	if (write(ended_fd, &one, sizeof(one)) < 0) {
+		/* The counter is already non-zero, so the main thread will wake */
+	}
+}
+
+/* Drops a reference to the client; the last one hands it back to the main
+ * thread to be freed */
+void release_client(struct client_node *cli_node)
+{
+	if (__atomic_sub_fetch(&cli_node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		end_client(cli_node);
+	}
+}
+
+/* Ends the connection of every client handed back by the workers, and
+ * takes those nothing holds any more off the list, making room for new
+ * ones, then closes and frees them; closing a socket also takes it out of
+ * the epoll set */
+void remove_ended_clients(void)
+{
+	struct client_node *cli_node, *ended, *next, *dead = NULL;
+	uint64_t count;
+
+	if (read(ended_fd, &count, sizeof(count)) < 0) {
+		/* Nothing was handed back since the last call */
+	}
+
+	pthread_mutex_lock(&client_table_lock);
+	ended = ended_clients;
+	ended_clients = NULL;
+	pthread_mutex_unlock(&client_table_lock);
+
+	for (cli_node = ended; cli_node != NULL; cli_node = next) {
+		next = cli_node->next_ended;
+
+		/* A client with records not yet on disk keeps its place until the
+		 * commit that drops its last reference hands it back again */
+		if (!cli_node->ended) {
+			cli_node->ended = 1;
+			metrics_add(CLIENTS_DISCONNECTED, 1);
+			timer_cancel(&timers, &cli_node->timer);
+			if (__atomic_sub_fetch(&cli_node->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+				continue;
+			}
+		}
+
+		cli_node->next_ended = dead;
+		dead = cli_node;
+	}
+
+	pthread_mutex_lock(&client_table_lock);
+	for (cli_node = dead; cli_node != NULL; cli_node = cli_node->next_ended) {
+		remove_client(cli_node);
+	}
+	pthread_mutex_unlock(&client_table_lock);
+
+	while ((cli_node = dead) != NULL) {
+		dead = cli_node->next_ended;
+		close(cli_node->sock_fd);
+		free(cli_node->partial);
+		pool_free(&client_pool, cli_node);
+	}
+}
+
+/* Disconnects the client if it has sent nothing for idle_timeout, or sets
+ * the timer again for when it will have.  The socket is only shut down: the
+ * worker that reads its end of input ends the client as usual */
+void client_timeout(struct timer *timer)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)timer - offsetof(struct client_node, timer));
+	uint64_t deadline;
+
+	deadline = __atomic_load_n(&cli_node->read_at, __ATOMIC_RELAXED) +
+		idle_timeout;
+
+	if (deadline > now) {
+		timer_set(&timers, timer, deadline);
+		return;
+	}
+
+	log_warn("%s: sent nothing for too long; disconnecting", cli_node->name);
+	metrics_add(CLIENTS_TIMED_OUT, 1);
+	shutdown(cli_node->sock_fd, SHUT_RDWR);
+}
+
+/* Prints a message of n bytes at buffer, terminated, from the client or
+ * sender called name */
+void print_message(const char *name, const char *buffer, int n)
 {
-	bzero((char *) buffer, BUFFER_LEN);
+	log_info("%s says: %s", name, buffer);
+	metrics_add(BYTES_IN, n);
+	metrics_add(MESSAGES_IN, 1);
 }
 
-/* Interface with the client as specified in args; prints all messages
- * received from client; return 0 upon disconnection; on any instance of
- * error occuring, return -1 */
-void *handle_client(void *args) {
+/* Job run by a worker once the client's socket is readable: prints every
+ * message the socket has ready, up to READS_PER_JOB of them, then arms the
+ * socket for its next event unless the client has disconnected */
+void serve_client(struct work *work)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)work - offsetof(struct client_node, work));
+	struct epoll_event event;
 	char buffer[BUFFER_LEN];
-	clear_buffer(buffer);
-	struct client_node cli_node = *(struct client_node *)args;
-	int n;
-	int client_connected = 1;
-	
-	/* While the client is connected, read messages and print on server. 
-	 * if the message is ".DISCONNECT", then return 0 */
-	while (client_connected) {
-		if ((n = read(cli_node.sock_fd, buffer, MESSAGE_LEN)) != 0)
-		{
-			/* lock serve_client lock */
-			pthread_mutex_lock(&client_serve_lock);
-			
-			/* Client has disconnected from server suddenly */
-			if (n < 0)
-			{
-				printf("%s: suddenly disconnected or unknown error\n", 
-					   cli_node.name);
-				client_connected = 0;
-				close(cli_node.sock_fd);
-			} 
-			
-			/* Client sent a disconnect message */
-			else if (strcmp(buffer, ".DISCONNECT") == 0) 
-			{
-				printf("%s: disonnected\n", cli_node.name);
-				client_connected = 0;
-				close(cli_node.sock_fd);
-				clear_buffer(buffer);
+	int i, n, got = 0;
+	
+	for (i = 0; i < READS_PER_JOB; i++) {
+		n = read(cli_node->sock_fd, buffer, MESSAGE_LEN);
+		
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
 			
-			/* Print message from client */
-			else 
-			{
-				printf("%s says: %s\n", cli_node.name, buffer);
-				clear_buffer(buffer);
+			/* Everything ready has been read */
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
 			}
 			
-			/* unlock serve client lock */
-			pthread_mutex_unlock(&client_serve_lock);
+			log_warn("%s: suddenly disconnected or unknown error",
+					 cli_node->name);
+			end_client(cli_node);
+			return;
 		}
-    }
+		
+		/* Client has disconnected from server suddenly */
+		if (n == 0) {
+			log_warn("%s: suddenly disconnected", cli_node->name);
+			end_client(cli_node);
+			return;
+		}
+		
+		/* Terminate what was read instead of clearing the whole buffer
+		 * after every read */
+		buffer[n] = '\0';
+		
+		/* Client sent a disconnect message */
+		if (strcmp(buffer, ".DISCONNECT") == 0) {
+			log_info("%s: disonnected", cli_node->name);
+			end_client(cli_node);
+			return;
+		}
+		
+		print_message(cli_node->name, buffer, n);
+		got = 1;
+	}
 	
-	return 0;
+	/* Once per job is close enough for the idle deadline */
+	if (got) {
+		__atomic_store_n(&cli_node->read_at, metrics_now(), __ATOMIC_RELAXED);
+	}
+	
+	/* Wait for more; if data is still waiting, the event fires at once */
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = cli_node;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cli_node->sock_fd, &event) < 0) {
+		log_error("serve_client: cannot wait on %s", cli_node->name);
+		end_client(cli_node);
+	}
+}
+
+/* Called by the log when it first lists the client in a batch: the client
+ * is kept until that batch is committed */
+void hold_client(struct ingest_owner *owner)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)owner - offsetof(struct client_node, owner));
+
+	__atomic_add_fetch(&cli_node->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Called by the committer once a batch holding the client's records is on
+ * disk: tells the client how many of its records are, then lets it go.
+ * Acknowledgements are cumulative, so one the socket has no room for is
+ * dropped and the next one makes up for it */
+void ack_client(struct ingest_owner *owner)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)owner - offsetof(struct client_node, owner));
+	char ack[32];
+	int n;
+
+	n = snprintf(ack, sizeof(ack), "ACK %lu\n", owner->durable);
+	if (send(cli_node->sock_fd, ack, n, MSG_NOSIGNAL | MSG_DONTWAIT) == n) {
+		metrics_add(ACKS_SENT, 1);
+	}
+
+	release_client(cli_node);
+}
+
+/* Hands whole lines, records of them, to the log for owner, which may be
+ * NULL, and to the parsers, as the server was asked to; returns 0 on
+ * failure and 1 on success */
+int store_lines(struct ingest_owner *owner, const struct iovec *iov,
+				int iovcnt, unsigned long records)
+{
+	metrics_add(MESSAGES_IN, records);
+
+	if (ingesting && !ingest_append(&ingest, owner, iov, iovcnt, records)) {
+		return 0;
+	}
+
+	return (!aggregating || aggregate_push(&aggregates, iov, iovcnt));
+}
+
+/* Stores the client's unfinished line as a record of its own, ending it
+ * with a newline; returns 0 on failure and 1 on success */
+int ingest_partial(struct client_node *cli_node)
+{
+	struct iovec iov;
+
+	cli_node->partial[cli_node->partial_len++] = '\n';
+	iov.iov_base = cli_node->partial;
+	iov.iov_len = cli_node->partial_len;
+	cli_node->partial_len = 0;
+
+	return store_lines(&cli_node->owner, &iov, 1, 1);
+}
+
+/* Stores the n bytes at data read from the client, every whole line a
+ * record and the client's lines in order, and keeps the start of an
+ * unfinished line for the next read.  Lines longer than INGEST_RECORD_MAX
+ * are cut.  Returns 0 on failure and 1 on success */
+int ingest_data(struct client_node *cli_node, char *data, size_t n)
+{
+	struct iovec iov[2];
+	char *first, *last, *p;
+	unsigned long records;
+	size_t len, end;
+
+	while (n > 0) {
+		/* The line going on from the last read, up to its end if read */
+		first = memchr(data, '\n', n);
+		len = (first != NULL) ? (size_t)(first - data) : n;
+
+		/* A line that is too long becomes a record of INGEST_RECORD_MAX;
+		 * the partial line has room for the newline that ends it */
+		if (cli_node->partial_len + len > INGEST_RECORD_MAX) {
+			len = INGEST_RECORD_MAX - cli_node->partial_len;
+			memcpy(cli_node->partial + cli_node->partial_len, data, len);
+			cli_node->partial_len += len;
+			if (!ingest_partial(cli_node)) {
+				return 0;
+			}
+			data += len;
+			n -= len;
+			continue;
+		}
+
+		if (first == NULL) {
+			memcpy(cli_node->partial + cli_node->partial_len, data, n);
+			cli_node->partial_len += n;
+			break;
+		}
+
+		/* Every other line read is shorter than a read, so whole lines are
+		 * stored at once, after the partial line they finish */
+		last = memrchr(data, '\n', n);
+		end = last - data + 1;
+		for (records = 0, p = data; p <= last; records++) {
+			p = (char *)memchr(p, '\n', last - p + 1) + 1;
+		}
+
+		iov[0].iov_base = cli_node->partial;
+		iov[0].iov_len = cli_node->partial_len;
+		iov[1].iov_base = data;
+		iov[1].iov_len = end;
+		if (!store_lines(&cli_node->owner, iov, 2, records)) {
+			return 0;
+		}
+
+		cli_node->partial_len = 0;
+		data += end;
+		n -= end;
+	}
+
+	return 1;
+}
+
+/* Job run by a worker once an ingesting or aggregating client's socket is
+ * readable: the lines the socket has ready are stored, up to READS_PER_JOB
+ * reads of them, then the socket is armed for its next event unless the
+ * client has disconnected.  An unfinished last line is stored when the
+ * client leaves */
+void ingest_client(struct work *work)
+{
+	struct client_node *cli_node = (struct client_node *)
+		((char *)work - offsetof(struct client_node, work));
+	static __thread char *buffer;
+	struct epoll_event event;
+	int i, n, got = 0;
+
+	/* Too large for the stack of a worker, and only ever one per worker */
+	if ((buffer == NULL) && ((buffer = malloc(INGEST_READ_LEN)) == NULL)) {
+		log_error("ingest_client: cannot allocate a buffer");
+		end_client(cli_node);
+		return;
+	}
+	if ((cli_node->partial == NULL) &&
+		((cli_node->partial = malloc(INGEST_RECORD_MAX + 1)) == NULL)) {
+		log_error("ingest_client: cannot allocate %s's line", cli_node->name);
+		end_client(cli_node);
+		return;
+	}
+
+	for (i = 0; i < READS_PER_JOB; i++) {
+		n = read(cli_node->sock_fd, buffer, INGEST_READ_LEN);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			/* Everything ready has been read */
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+
+			log_warn("%s: suddenly disconnected or unknown error",
+					 cli_node->name);
+			end_client(cli_node);
+			return;
+		}
+
+		if (n == 0) {
+			if ((cli_node->partial_len > 0) && !ingest_partial(cli_node)) {
+				log_error("ingest_client: cannot store %s's last line",
+						  cli_node->name);
+			}
+			log_info("%s: disconnected", cli_node->name);
+			end_client(cli_node);
+			return;
+		}
+
+		metrics_add(BYTES_IN, n);
+		if (!ingest_data(cli_node, buffer, n)) {
+			log_error("ingest_client: cannot store what %s sent",
+					  cli_node->name);
+			end_client(cli_node);
+			return;
+		}
+		got = 1;
+	}
+
+	/* Once per job is close enough for the idle deadline */
+	if (got) {
+		__atomic_store_n(&cli_node->read_at, metrics_now(), __ATOMIC_RELAXED);
+	}
+
+	/* Wait for more; if data is still waiting, the event fires at once */
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = cli_node;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cli_node->sock_fd, &event) < 0) {
+		log_error("ingest_client: cannot wait on %s", cli_node->name);
+		end_client(cli_node);
+	}
+}
+
+/* Writes what the log has committed for the admin socket */
+void report_ingest(FILE *out, int json)
+{
+	unsigned long commits;
+	uint64_t bytes;
+
+	commits = __atomic_load_n(&ingest.commits, __ATOMIC_RELAXED);
+	bytes = __atomic_load_n(&ingest.bytes_committed, __ATOMIC_RELAXED);
+
+	fprintf(out, json ? "\"commits\":%lu,\"bytes_committed\":%llu" :
+			"commits %lu\nbytes_committed %llu\n", commits,
+			(unsigned long long)bytes);
+}
+
+/* Writes what each receiver has had from each sender, and what was lost,
+ * for the admin socket.  The kernel keeps a sender on one receiver, so a
+ * sender is normally listed once */
+void report_senders(FILE *out, int json)
+{
+	struct receiver *rcv;
+	struct sender *snd;
+	char addr[INET_ADDRSTRLEN];
+	uint64_t dropped = 0, others = 0;
+	int count, i, j, first = 1;
+
+	count = __atomic_load_n(&num_receivers, __ATOMIC_ACQUIRE);
+
+	fprintf(out, json ? "\"senders\":[" : "");
+
+	for (i = 0; i < count; i++) {
+		rcv = &receivers[i];
+		pthread_mutex_lock(&rcv->lock);
+		for (j = 0; j < UDP_SENDERS; j++) {
+			snd = &rcv->senders[j];
+			if (snd->port == 0) {
+				continue;
+			}
+			inet_ntop(AF_INET, &snd->addr, addr, sizeof(addr));
+			fprintf(out, json ? "%s{\"sender\":\"%s:%u\",\"receiver\":%d,"
+					"\"datagrams\":%llu,\"bytes\":%llu}" :
+					"%ssender %s:%u receiver %d datagrams %llu bytes %llu\n",
+					(json && !first) ? "," : "", addr, ntohs(snd->port), rcv->id,
+					(unsigned long long)snd->datagrams,
+					(unsigned long long)snd->bytes);
+			first = 0;
+		}
+		dropped += rcv->dropped;
+		others += rcv->others;
+		pthread_mutex_unlock(&rcv->lock);
+	}
+
+	fprintf(out, json ? "],\"datagrams_from_others\":%llu,"
+			"\"datagrams_dropped\":%llu" :
+			"datagrams_from_others %llu\ndatagrams_dropped %llu\n",
+			(unsigned long long)others, (unsigned long long)dropped);
+}
+
+/* Writes the totals of the last window added up for the admin socket */
+void report_aggregates(FILE *out, int json)
+{
+	struct aggregate_table *table;
+	struct aggregate_entry *entry;
+	int i, first = 1;
+
+	pthread_mutex_lock(&aggregates.lock);
+
+	if ((table = aggregates.last) == NULL) {
+		fprintf(out, json ? "\"window\":null,\"aggregates\":[]" : "");
+	} else {
+		fprintf(out, json ? "\"window\":%llu,\"records\":%llu,"
+				"\"fields_not_kept\":%llu,\"aggregates\":[" :
+				"window %llu\nrecords %llu\nfields_not_kept %llu\n",
+				(unsigned long long)table->window,
+				(unsigned long long)table->records,
+				(unsigned long long)table->others);
+
+		for (i = 0; i < AGGREGATE_KEYS; i++) {
+			entry = &table->entries[i];
+			if (entry->key[0] == '\0') {
+				continue;
+			}
+
+			if (json) {
+				fprintf(out, "%s{\"key\":", first ? "" : ",");
+				metrics_json_string(out, entry->key);
+				fprintf(out, ",\"count\":%llu,\"sum\":%.17g}",
+						(unsigned long long)entry->count, entry->sum);
+			} else {
+				fprintf(out, "aggregate %s count %llu sum %.17g\n", entry->key,
+						(unsigned long long)entry->count, entry->sum);
+			}
+			first = 0;
+		}
+
+		fprintf(out, json ? "]" : "");
+	}
+
+	pthread_mutex_unlock(&aggregates.lock);
+
+	fprintf(out, json ? ",\"aggregate_stalls\":%llu" :
+			"aggregate_stalls %llu\n",
+			(unsigned long long)__atomic_load_n(&aggregates.stalls,
+												__ATOMIC_RELAXED));
+}
+
+/* Adds the server's own section to the admin socket's answer */
+void report_server(FILE *out, int json)
+{
+	if (ingesting) {
+		report_ingest(out, json);
+	}
+
+	if (aggregating) {
+		fprintf(out, (json && ingesting) ? "," : "");
+		report_aggregates(out, json);
+	}
+
+	if (receiving) {
+		fprintf(out, (json && (ingesting || aggregating)) ? "," : "");
+		report_senders(out, json);
+	}
 }
 
 /* Attempts to create a new connection and adds it to the list of clients
@@ -120,20 +796,37 @@ void *handle_client(void *args) {
  * return 0. */
 int handle_new_connection(int sockfd) 
 {
-	int cli_sockfd, cli_len;
-	struct client_node cli_node;
-    struct sockaddr_in cli_addr;
-    int handle_failed = -1;
-    pthread_t cli_thread;
+	int cli_sockfd;
+	struct client_node *cli_node;
+	struct epoll_event event;
+	int handle_failed = -1;
     
     /* Attempt to accept a new connection */
-    cli_sockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &cli_len);
+    cli_sockfd = accept(sockfd, NULL, NULL);
     if (cli_sockfd < 0) {
-		printf("handle_new_connection: error on accept\n");
+		log_error("handle_new_connection: error on accept");
+		return -1;
+	}
+	
+	if (num_clients >= max_clients) {
+		log_warn("handle_new_connection: server is full; refusing connection");
+		metrics_add(CLIENTS_REJECTED, 1);
+		close(cli_sockfd);
 		return -1;
 	}
 	
-	if (num_clients >= MAX_CLIENTS) {
+	/* Workers read until the socket has nothing more */
+	if (!set_nonblocking(cli_sockfd)) {
+		log_error("handle_new_connection: cannot make socket non-blocking");
+		close(cli_sockfd);
+		return -1;
+	}
+	
+	/* The node outlives this call, since workers read it and the list
+	 * keeps it */
+	if ((cli_node = pool_alloc(&client_pool)) == NULL) {
+		log_error("handle_new_connection: cannot allocate client");
+		close(cli_sockfd);
 		return -1;
 	}
 	
@@ -142,49 +835,418 @@ int handle_new_connection(int sockfd)
 	
 	/* Add new client information */
 	current_id++;
-	cli_node.id = current_id;
-	cli_node.sock_fd = cli_sockfd;
-	sprintf(cli_node.name, "%d", current_id);
-	cli_node.next = NULL;
+	cli_node->id = current_id;
+	cli_node->sock_fd = cli_sockfd;
+	snprintf(cli_node->name, sizeof(cli_node->name), "%d", current_id);
+	cli_node->read_at = now;
+	timer_init(&cli_node->timer, client_timeout);
+	cli_node->work.run = (ingesting || aggregating) ? ingest_client :
+		serve_client;
+	cli_node->next = NULL;
+	cli_node->refs = 1;
+	cli_node->ended = 0;
+	memset(&cli_node->owner, 0, sizeof(cli_node->owner));
+	cli_node->partial = NULL;
+	cli_node->partial_len = 0;
 	
 	/* Attempt to add a new client to the table */
-	if (add_client((struct client_node *)&cli_node) >= 0) {
+	if (add_client(cli_node) >= 0) {
 		handle_failed = 0;
-		
-		/* Spawn another thread to handle the client */
-		pthread_create(&cli_thread, NULL, (void *)handle_client, (void *)&cli_node);
-		//detach
+		metrics_add(CLIENTS_ACCEPTED, 1);
 	}
 		
 	/* Unlock the table lock */
 	pthread_mutex_unlock(&client_table_lock);
 	
-	return handle_failed;	
+	/* Nothing else holds a node that was not added */
+	if (handle_failed < 0) {
+		close(cli_sockfd);
+		pool_free(&client_pool, cli_node);
+		return -1;
+	}
+	
+	if (idle_timeout > 0) {
+		timer_set(&timers, &cli_node->timer, now + idle_timeout);
+	}
+	
+	/* Hand the socket to the workers once it has something to read */
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = cli_node;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cli_sockfd, &event) < 0) {
+		log_error("handle_new_connection: cannot wait on %s", cli_node->name);
+		end_client(cli_node);
+		return -1;
+	}
+	
+	return 0;
 }
 	
+/* Counts a datagram of len bytes from addr against its sender; called with
+ * the receiver's lock held */
+void count_datagram(struct receiver *rcv, const struct sockaddr_in *addr,
+					size_t len)
+{
+	struct sender *snd;
+	uint32_t hash;
+	int i;
+
+	hash = (addr->sin_addr.s_addr * 2654435761u) ^ addr->sin_port;
+
+	/* Senders are never forgotten, so a probe ends at the sender or at a
+	 * free entry */
+	for (i = 0; i < UDP_SENDERS; i++) {
+		snd = &rcv->senders[(hash + i) % UDP_SENDERS];
+
+		if (snd->port == 0) {
+			if (rcv->num_senders >= UDP_SENDERS / 2) {
+				break;
+			}
+			snd->addr = addr->sin_addr;
+			snd->port = addr->sin_port;
+			rcv->num_senders++;
+		}
+
+		if ((snd->addr.s_addr == addr->sin_addr.s_addr) &&
+			(snd->port == addr->sin_port)) {
+			snd->datagrams++;
+			snd->bytes += len;
+			return;
+		}
+	}
+
+	/* The table is half full; leave the rest for those already in it */
+	rcv->others++;
+}
+
+/* Stores the datagrams of a batch as records, a newline ending any that
+ * lacks one, in as few appends as INGEST_APPEND_MAX allows; returns 0 on
+ * failure and 1 on success */
+int ingest_datagrams(struct receiver *rcv, int count)
+{
+	static const char newline = '\n';
+	struct iovec iov[2 * UDP_BATCH];
+	unsigned long records = 0;
+	size_t len = 0, n;
+	char *data, *p, *end;
+	int i, iovcnt = 0;
+
+	for (i = 0; i < count; i++) {
+		data = rcv->iovs[i].iov_base;
+		n = rcv->msgs[i].msg_len;
+		if (n == 0) {
+			continue;
+		}
+
+		if (len + n + 1 > INGEST_APPEND_MAX) {
+			if (!store_lines(NULL, iov, iovcnt, records)) {
+				return 0;
+			}
+			iovcnt = 0;
+			len = 0;
+			records = 0;
+		}
+
+		iov[iovcnt].iov_base = data;
+		iov[iovcnt++].iov_len = n;
+		len += n;
+		if (data[n - 1] != '\n') {
+			iov[iovcnt].iov_base = (void *)&newline;
+			iov[iovcnt++].iov_len = 1;
+			len++;
+			records++;
+		}
+
+		for (p = data, end = data + n; (p = memchr(p, '\n', end - p)) != NULL;
+			 p++) {
+			records++;
+		}
+	}
+
+	if (iovcnt > 0) {
+		if (!store_lines(NULL, iov, iovcnt, records)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Takes datagrams on the receiver's socket for as long as the program runs,
+ * a batch at a time, and prints or logs them */
+void *receive_datagrams(void *args)
+{
+	struct receiver *rcv = args;
+	struct mmsghdr *msg;
+	struct cmsghdr *cmsg;
+	char name[INET_ADDRSTRLEN + 8];
+	uint64_t bytes;
+	uint32_t dropped = 0;
+	int i, n;
+
+	while (1) {
+		/* recvmmsg writes back the lengths of names and controls */
+		for (i = 0; i < UDP_BATCH; i++) {
+			rcv->msgs[i].msg_hdr.msg_namelen = sizeof(rcv->addrs[i]);
+			rcv->msgs[i].msg_hdr.msg_controllen = sizeof(rcv->controls[i]);
+		}
+
+		/* Wait for one datagram and take as many more as are ready */
+		if ((n = recvmmsg(rcv->fd, rcv->msgs, UDP_BATCH, MSG_WAITFORONE,
+						  NULL)) < 0) {
+			if (errno != EINTR) {
+				log_error("receive_datagrams: recvmmsg failed on receiver %d",
+						  rcv->id);
+			}
+			continue;
+		}
+
+		bytes = 0;
+		for (i = 0; i < n; i++) {
+			msg = &rcv->msgs[i];
+			if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+				metrics_add(DATAGRAMS_TRUNCATED, 1);
+				msg->msg_len = UDP_DATAGRAM_LEN;
+			}
+			bytes += msg->msg_len;
+
+			/* The kernel's count of datagrams dropped on this socket */
+			for (cmsg = CMSG_FIRSTHDR(&msg->msg_hdr); cmsg != NULL;
+				 cmsg = CMSG_NXTHDR(&msg->msg_hdr, cmsg)) {
+				if ((cmsg->cmsg_level == SOL_SOCKET) &&
+					(cmsg->cmsg_type == SO_RXQ_OVFL)) {
+					memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+				}
+			}
+		}
+		metrics_add(DATAGRAMS_IN, n);
+		metrics_add(BYTES_IN, bytes);
+
+		pthread_mutex_lock(&rcv->lock);
+		for (i = 0; i < n; i++) {
+			count_datagram(rcv, &rcv->addrs[i], rcv->msgs[i].msg_len);
+		}
+		rcv->dropped = dropped;
+		pthread_mutex_unlock(&rcv->lock);
+
+		if (ingesting || aggregating) {
+			if (!ingest_datagrams(rcv, n)) {
+				log_error("receive_datagrams: cannot store a batch");
+			}
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			((char *)rcv->iovs[i].iov_base)[rcv->msgs[i].msg_len] = '\0';
+			snprintf(name, sizeof(name), "%s:%u",
+					 inet_ntoa(rcv->addrs[i].sin_addr),
+					 ntohs(rcv->addrs[i].sin_port));
+			print_message(name, rcv->iovs[i].iov_base, rcv->msgs[i].msg_len);
+		}
+	}
+
+	return NULL;
+}
+
+/* Opens the receiver's socket on port and points its batch at buffers
+ * allocated once; returns 0 on failure and 1 on success */
+int receiver_init(struct receiver *rcv, int id, int port_number)
+{
+	struct sockaddr_in addr;
+	struct msghdr *hdr;
+	int one = 1, size = UDP_RCVBUF, i;
+
+	memset(rcv, 0, sizeof(*rcv));
+	rcv->id = id;
+
+	if ((rcv->buffers = malloc(UDP_BATCH * (UDP_DATAGRAM_LEN + 1))) == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		rcv->iovs[i].iov_base = rcv->buffers + i * (UDP_DATAGRAM_LEN + 1);
+		rcv->iovs[i].iov_len = UDP_DATAGRAM_LEN;
+		hdr = &rcv->msgs[i].msg_hdr;
+		hdr->msg_name = &rcv->addrs[i];
+		hdr->msg_iov = &rcv->iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = rcv->controls[i];
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port_number);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	/* A smaller receive buffer than asked for only drops sooner */
+	if (((rcv->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) ||
+		(setsockopt(rcv->fd, SOL_SOCKET, SO_REUSEPORT, &one,
+					sizeof(one)) < 0) ||
+		(setsockopt(rcv->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0) ||
+		(bind(rcv->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+		return 0;
+	}
+	setsockopt(rcv->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	return (pthread_mutex_init(&rcv->lock, NULL) == 0);
+}
+
+/* Takes datagrams on port with count receivers; the main thread is the
+ * first and never returns */
+void serve_datagrams(int port_number, int count)
+{
+	int i;
+
+	if ((receivers = calloc(count, sizeof(struct receiver))) == NULL) {
+		log_error("serve_datagrams: cannot allocate receivers");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!receiver_init(&receivers[i], i, port_number)) {
+			log_error("serve_datagrams: cannot receive on %d", port_number);
+			exit(1);
+		}
+	}
+
+	/* The admin socket lists receivers once they are all set up */
+	__atomic_store_n(&num_receivers, count, __ATOMIC_RELEASE);
+
+	for (i = 1; i < count; i++) {
+		if (pthread_create(&receivers[i].thread, NULL, receive_datagrams,
+						   &receivers[i]) != 0) {
+			log_error("serve_datagrams: cannot start receiver %d", i);
+			exit(1);
+		}
+	}
+
+	receive_datagrams(&receivers[0]);
+}
+
 int main(int argc, char *argv[])
 {
-	int sockfd, port_number;
+	static const struct itimerspec tick = {
+		{0, TIMER_TICK_MS * 1000000}, {0, TIMER_TICK_MS * 1000000}
+	};
+	struct epoll_event events[MAX_EVENTS], event;
+	uint64_t expirations;
+	char *admin_path = NULL, *log_dir = NULL, *comma;
+	unsigned int commit_ms = DEFAULT_COMMIT_MS, window_ms = 0;
+	size_t commit_kb = DEFAULT_COMMIT_KB, segment_mb = DEFAULT_SEGMENT_MB;
+	int sockfd, port_number, num_workers = 0, udp_receivers = 0;
+	int num_parsers = 0;
+	int i, n, opt;
     struct sockaddr_in serv_addr;
     
+	/* Log lines are written to stdout by a thread of their own, so workers
+	 * never wait on the terminal or on each other to print */
+	if (!log_init(STDOUT_FILENO)) {
+		printf("main: cannot start logging\n");
+		exit(1);
+	}
+	
+	/* Read the options; by default there is a worker per core */
+	while ((opt = getopt(argc, argv, "w:A:T:m:L:F:S:G:U:")) != -1) {
+		switch (opt) {
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
+		case 'A':
+			admin_path = optarg;
+			break;
+		case 'T':
+			idle_timeout = strtoull(optarg, NULL, 10) * 1000000000ULL;
+			break;
+		case 'm':
+			max_clients = atoi(optarg);
+			break;
+		case 'L':
+			log_dir = optarg;
+			break;
+		case 'F':
+			commit_ms = strtoul(optarg, &comma, 10);
+			if (*comma == ',') {
+				commit_kb = strtoul(comma + 1, NULL, 10);
+			}
+			break;
+		case 'S':
+			segment_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'G':
+			window_ms = strtoul(optarg, &comma, 10);
+			if (*comma == ',') {
+				num_parsers = atoi(comma + 1);
+			}
+			break;
+		case 'U':
+			udp_receivers = atoi(optarg);
+			break;
+		default:
+			printf(USAGE);
+			exit(1);
+		}
+	}
+	
 	/* Check that both a name and a port number are provided */
-	if (argc < 3) {
+	if (argc - optind < 2) {
 		printf("main: server requires both name and port number.\n");
+		printf(USAGE);
+		exit(1);
+	}
+	
+	/* Get the port number from the argument provided */
+	port_number = atoi(argv[optind]);
+	ingesting = (log_dir != NULL);
+	aggregating = (window_ms > 0);
+	receiving = (udp_receivers > 0);
+	
+	/* Counters are kept whether or not anyone reads them */
+	metrics_init(counter_names, NUM_COUNTERS, NULL, 0);
+	
+	/* Clients' records are only acknowledged once the log has them */
+	if (ingesting && !ingest_init(&ingest, log_dir, segment_mb << 20,
+								  commit_kb << 10, commit_ms, hold_client,
+								  ack_client)) {
+		log_error("main: cannot open the log in %s", log_dir);
+		exit(1);
+	}
+	
+	/* By default there is a parser per core, like workers, and lines are
+	 * handed on by every receiver, or by every worker */
+	if (num_parsers <= 0) {
+		num_parsers = worker_count_default();
+	}
+	if (num_workers <= 0) {
+		num_workers = worker_count_default();
+	}
+	if (aggregating &&
+		!aggregate_init(&aggregates, num_parsers,
+						receiving ? udp_receivers : num_workers, window_ms)) {
+		log_error("main: cannot start the parsers");
+		exit(1);
+	}
+	
+	/* The admin socket reports on the log and parsers, so comes after them */
+	if ((admin_path != NULL) &&
+		!metrics_serve(admin_path, (ingesting || aggregating || receiving) ?
+					   report_server : NULL)) {
+		log_error("main: cannot open admin socket %s", admin_path);
 		exit(1);
 	}
 	
+	/* Datagrams need no connections, workers or deadlines */
+	if (receiving) {
+		serve_datagrams(port_number, udp_receivers);
+	}
+	
 	/* Create a main socket that communicates with the other sockets */
 	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		printf("main: socket failed\n");
+		log_error("main: socket failed");
 		exit(1);
 	}
 	
 	/* Set all values in buffer serv_addr to zero */
 	bzero((char *) &serv_addr, sizeof(serv_addr));
 	
-	/* Get the port number from the argument provided */
-	port_number = atoi(argv[1]);
-	
 	/* Initialize serv_addr values; set in_adrr to accept connections to all
 	 * IPs via INADDR_ANY */
 	serv_addr.sin_family = AF_INET;
@@ -193,14 +1255,71 @@ int main(int argc, char *argv[])
 	
 	/* Attempt to bind address to socket */
 	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-		printf("main: bind socket to %d failed\n", port_number);
+		log_error("main: bind socket to %d failed", port_number);
 		exit(1);
 	}
 	
-	/* Listen for a client connecting to socket */
-	while ((listen(sockfd, 5) != -1) && (num_clients < MAX_CLIENTS)) 
-	{
-		handle_new_connection(sockfd);
+	if (!worker_pool_init(&workers, num_workers)) {
+		log_error("main: cannot start workers");
+		exit(1);
+	}
+	
+	/* The listening socket is told apart from clients by a NULL pointer */
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (((epoll_fd = epoll_create1(0)) < 0) || (listen(sockfd, 5) < 0) ||
+		(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event) < 0)) {
+		log_error("main: cannot listen on %d", port_number);
+		exit(1);
+	}
+	
+	/* And the eventfd and tick timer by their addresses */
+	now = metrics_now();
+	event.data.ptr = &ended_fd;
+	if (((ended_fd = eventfd(0, EFD_NONBLOCK)) < 0) ||
+		(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ended_fd, &event) < 0)) {
+		log_error("main: cannot create eventfd");
+		exit(1);
+	}
+	
+	event.data.ptr = &tick_fd;
+	if ((idle_timeout > 0) &&
+		(((tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) ||
+		 (timerfd_settime(tick_fd, 0, &tick, NULL) < 0) ||
+		 !timer_wheel_init(&timers, TIMER_SLOTS, TIMER_TICK_MS * 1000000ULL,
+						   now) ||
+		 (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &event) < 0))) {
+		log_error("main: cannot set up the timer wheel");
+		exit(1);
+	}
+	
+	/* Accept clients, hand every client with something to read to the
+	 * workers, and take down those they hand back or that time out */
+	while (1) {
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("main: epoll_wait failed");
+			exit(1);
+		}
+		now = metrics_now();
+		
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				handle_new_connection(sockfd);
+			} else if (events[i].data.ptr == &ended_fd) {
+				remove_ended_clients();
+			} else if (events[i].data.ptr == &tick_fd) {
+				if (read(tick_fd, &expirations, sizeof(expirations)) < 0) {
+					/* The timer had not gone off; move the wheel on anyway */
+				}
+				timer_wheel_advance(&timers, now);
+			} else {
+				worker_submit(&workers,
+							  &((struct client_node *)events[i].data.ptr)->work);
+			}
+		}
     }
     
 	return 0;